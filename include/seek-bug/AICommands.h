@@ -8,8 +8,16 @@
 //===----------------------------------------------------------------------===//
 
 #include "seek-bug/SeekBugContext.h"
+#include "seek-bug/StackEncoder.h"
 
 #include <lldb/API/SBCommandInterpreter.h>
+#include <lldb/API/SBThread.h>
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace seekbug {
 
@@ -66,6 +74,121 @@ public:
                  lldb::SBCommandReturnObject &result) override;
 };
 
+/// Command that lists the background jobs started with --async.
+class AIJobsCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIJobsCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that blocks until a background job is done and prints its answer.
+class AIWaitCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIWaitCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that cancels a queued or running background job.
+class AICancelCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AICancelCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that shows response cache statistics or clears the cache.
+class AICacheCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AICacheCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that shows the performance telemetry of the session.
+class AIStatsCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIStatsCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that turns speculative prefill on process stops on or off.
+class AIPrefillCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIPrefillCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// What `ai chat` last told the model about the program, so that later
+/// turns only describe what changed.
+struct ChatStopState {
+  uint32_t StopID = 0;
+  std::string Function;
+  std::string Location;
+  /// Arguments and locals of the selected frame, with their values.
+  std::vector<std::pair<std::string, std::string>> Variables;
+};
+
+/// Command that holds a conversation about the program with the model.
+class AIChatCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+  ChatStopState lastStop;
+
+public:
+  AIChatCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command that turns the one-line annotation of every stop on or off.
+class AIWatchCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIWatchCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// Command run by the AI stop hook on every process stop.
+class AIOnStopCommand : public lldb::SBCommandPluginInterface {
+  SeekBugContext context;
+
+public:
+  AIOnStopCommand(SeekBugContext &context);
+  bool DoExecute(lldb::SBDebugger debugger, char **command,
+                 lldb::SBCommandReturnObject &result) override;
+};
+
+/// The frames of \p thread, innermost first.
+std::vector<StackFrameInfo> collectStackFrames(lldb::SBThread &thread);
+
+/// The prompt of `ai crash-elaborate` for a crash with the call stack
+/// \p frames. \p machineContext is the disassembly and registers of the
+/// innermost frame when it has no source. \p request has the settings of
+/// the answer, like its length and grammar, and instructions to follow the
+/// crash-elaborate preamble; the call stack is fitted to what they leave of
+/// the context.
+LLMRequest createCrashElaboratePrompt(SeekBugContext &context,
+                                      llvm::ArrayRef<StackFrameInfo> frames,
+                                      const std::string &machineContext = "",
+                                      LLMRequest request = LLMRequest());
+
 /// Register all AI-related commands in the LLDB interpreter.
 /// E.g., an 'ai' multiword command and a 'suggest' sub-command.
 bool RegisterAICommands(lldb::SBCommandInterpreter &interpreter,
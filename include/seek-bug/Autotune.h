@@ -0,0 +1,30 @@
+#pragma once
+
+//===-------- Autotune.h --------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <cstdint>
+#include <string>
+
+namespace seekbug {
+
+/// ~/.cache/seek-bug/profiles/<model>-<host>.json: the tuned options of the
+/// model identified by \p ModelFingerprint on this machine.
+std::string getTunedProfilePath(uint64_t ModelFingerprint);
+
+/// Read the profile stored by runAutotune(), if there is one.
+bool loadTunedProfile(uint64_t ModelFingerprint, LLMEngineOptions &Options);
+
+/// Measure prefill and decode speed of the model at \p ModelPath for a set
+/// of thread counts and batch sizes, and store the fastest combination as
+/// the profile that later runs use. Progress is reported on stderr.
+bool runAutotune(const std::string &ModelPath, LLMEngineOptions &Best,
+                 std::string &Error);
+
+} // end namespace seekbug
@@ -0,0 +1,68 @@
+#pragma once
+
+//===-------- ChatSession.h -----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace seekbug {
+
+/// A conversation with the model that stays in the KV cache between turns.
+/// It lives in a sequence of its own (LLMEngine::ChatSequence), so regular
+/// requests do not disturb it, and every turn only decodes the new user
+/// message, never the history. The conversation may take up a fixed share
+/// of the context; when it would outgrow it, the oldest turns are evicted
+/// and the rest is shifted down in place.
+class ChatSession {
+public:
+  explicit ChatSession(std::shared_ptr<LLMEngine> Engine);
+  ~ChatSession();
+
+  /// Add a user turn with the prompt of \p Request and generate the answer,
+  /// streaming it to the request's token sink. The preamble of \p Request
+  /// starts the conversation and is ignored after the first turn. If older
+  /// turns have to be evicted to make room, \p Restate, unless empty,
+  /// replaces the prompt, so that the turn does not refer to something the
+  /// model no longer sees. Errors are returned in brackets, like runLLM().
+  std::string ask(const LLMRequest &Request, const std::string &Restate = "");
+
+  /// Forget the conversation and give its part of the context back.
+  void reset();
+
+  /// Whether no turn is in the window. The system turn alone does not count:
+  /// it stays after a first turn that failed, and the next turn still has to
+  /// say where the program stopped.
+  bool isEmpty() const { return Turns.empty(); }
+  /// Turns in the window, and turns evicted from it so far.
+  size_t getNumTurns() const { return Turns.size(); }
+  unsigned getNumEvictedTurns() const { return NumEvicted; }
+  /// Tokens the conversation takes, and at most may take.
+  size_t getNumTokens() const { return Tokens.size(); }
+  size_t getWindowSize() const;
+
+private:
+  bool start(const LLMRequest &Formatted, std::string &Error);
+  bool decode(const std::vector<llama_token> &NewTokens,
+              const LLMRequest &Request);
+  void evictOldestTurn();
+
+  std::shared_ptr<LLMEngine> Engine;
+  /// Tokens the sequence holds, by position.
+  std::vector<llama_token> Tokens;
+  /// The tokens of the system turn, which is never evicted.
+  size_t PreambleSize = 0;
+  /// Where each turn in the window starts. A turn ends where the next one
+  /// starts, after the text that closes it.
+  std::vector<size_t> Turns;
+  unsigned NumEvicted = 0;
+};
+
+} // end namespace seekbug
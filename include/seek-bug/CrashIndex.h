@@ -0,0 +1,54 @@
+#pragma once
+
+//===-------- CrashIndex.h ------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdint>
+#include <string>
+
+namespace seekbug {
+
+/// On-disk index of crashes analyzed before, keyed by crash signature.
+/// Every entry is a small JSON file in one of 256 shard directories, so a
+/// lookup is a single file read however many crashes the index holds, and
+/// several processes can use the index at the same time.
+class CrashIndex {
+public:
+  struct Entry {
+    std::string Signature;
+    std::string Analysis;
+    /// Seconds since the epoch.
+    int64_t FirstSeen = 0;
+    int64_t LastSeen = 0;
+    uint64_t Count = 0;
+  };
+
+  explicit CrashIndex(std::string Directory);
+
+  /// ~/.cache/seek-bug/crashes, or empty if there is no cache directory.
+  static std::string getDefaultDirectory();
+
+  bool lookup(uint64_t Key, Entry &Result) const;
+
+  /// Count \p NumOccurrences more occurrences of a known crash and return
+  /// its entry.
+  bool recordOccurrence(uint64_t Key, Entry &Result,
+                        unsigned NumOccurrences = 1);
+
+  /// Store \p Analysis for the crash \p Key, counting \p NumOccurrences
+  /// occurrences. The history of an existing entry is kept.
+  bool store(uint64_t Key, const std::string &Signature,
+             const std::string &Analysis, unsigned NumOccurrences = 1);
+
+private:
+  std::string getEntryPath(uint64_t Key) const;
+  bool write(uint64_t Key, const Entry &E);
+
+  std::string Directory;
+};
+
+} // end namespace seekbug
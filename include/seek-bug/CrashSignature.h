@@ -0,0 +1,57 @@
+#pragma once
+
+//===-------- CrashSignature.h --------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <lldb/API/SBThread.h>
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include <cstdint>
+#include <string>
+
+namespace seekbug {
+
+/// Identity of a crash that does not depend on where the binaries were
+/// loaded: the innermost frames of the crashing thread as
+/// module!symbol+offset, without the frames of the signal machinery.
+struct CrashSignature {
+  /// One frame per line.
+  std::string Text;
+  uint64_t Hash = 0;
+  /// "module uuid" for every module on the signature frames, one per line.
+  std::string BuildIDs;
+
+  std::string getHashString() const;
+
+  /// Hash of the frames and the builds of their modules. The same frames in
+  /// a rebuilt binary may be a different bug, so the crash index keys on
+  /// this rather than on Hash.
+  uint64_t getBuildHash() const;
+};
+
+/// What a signature keeps of a frame.
+struct SignatureFrame {
+  /// File name of the module, or empty if unknown.
+  std::string Module;
+  /// UUID of the module, or empty if unknown.
+  std::string UUID;
+  /// Empty if the pc has no symbol.
+  std::string Symbol;
+  /// Offset of the pc into Symbol, or its file address without one.
+  uint64_t Offset = 0;
+};
+
+/// The signature of the innermost \p NumFrames of \p Frames, innermost
+/// first, after the frames of the signal machinery on top.
+CrashSignature computeCrashSignature(llvm::ArrayRef<SignatureFrame> Frames,
+                                     unsigned NumFrames = 8);
+
+CrashSignature computeCrashSignature(lldb::SBThread &Thread,
+                                     unsigned NumFrames = 8);
+
+} // end namespace seekbug
@@ -0,0 +1,74 @@
+#pragma once
+
+//===-------- DaemonProtocol.h --------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The protocol between seek-bug sessions and the seek-bugd inference daemon.
+// A session connects to the daemon's Unix domain socket, sends one Request
+// frame and reads the answer as a stream of Token frames ended by a Done or
+// an Error frame. Sending Cancel, or closing the connection, stops the
+// request. A session may instead send one Info frame, which the daemon
+// answers with an Info frame of its own. Every frame is a type byte, a 32-bit little-endian payload size
+// and the payload.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <llvm/ADT/StringRef.h>
+
+#include <string>
+#include <sys/types.h>
+
+namespace seekbug {
+
+enum class FrameType : char {
+  /// JSON: {"preamble": ..., "prompt": ..., "max_tokens": ..., "stop": [...],
+  /// "grammar": ..., "sampling": {...}}.
+  Request = 'R',
+  Cancel = 'C',
+  /// A piece of the answer, as raw text.
+  Token = 'T',
+  /// JSON: {"tokens": <number of generated tokens>}.
+  Done = 'D',
+  /// An error message.
+  Error = 'E',
+  /// From a session: empty. From the daemon: JSON: {"context_size": <tokens
+  /// of the daemon's context>}.
+  Info = 'I',
+};
+
+/// seek-bugd.sock in $XDG_RUNTIME_DIR, or in /tmp/seek-bugd-<uid> without
+/// one, so every user talks to their own daemon. Both directories are only
+/// accessible to their owner.
+std::string getDefaultDaemonSocketPath();
+
+/// The user the process at the other end of the Unix domain socket \p FD
+/// runs as.
+bool getPeerUID(int FD, uid_t &UID);
+
+bool writeFrame(int FD, FrameType Type, llvm::StringRef Payload);
+bool readFrame(int FD, FrameType &Type, std::string &Payload);
+
+/// Connect to the daemon at \p SocketPath. Returns the socket or -1. A
+/// daemon run by another user is refused: it would see every prompt, and
+/// could answer anything.
+int connectToDaemon(const std::string &SocketPath, std::string &Error);
+
+/// Ask the daemon connected at \p FD for the size of its context, which
+/// prompts have to fit into. It depends on the daemon's memory profile.
+bool requestDaemonInfo(int FD, uint32_t &ContextSize);
+/// Answer the Info frame of a session connected at \p FD.
+bool answerDaemonInfo(int FD, uint32_t ContextSize);
+
+/// Have the daemon at \p SocketPath answer \p Request with at most
+/// \p MaxNewTokens tokens. Pieces are passed to Request.OnToken as they
+/// arrive. Returns the answer, or an error message in brackets.
+std::string generateRemote(const std::string &SocketPath,
+                           const LLMRequest &Request, int MaxNewTokens);
+
+} // end namespace seekbug
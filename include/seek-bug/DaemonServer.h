@@ -0,0 +1,25 @@
+#pragma once
+
+//===-------- DaemonServer.h ----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <string>
+
+namespace seekbug {
+
+/// Serve requests of seek-bug sessions on the Unix domain socket at
+/// \p SocketPath until the process is terminated. Requests of all sessions
+/// are decoded as parallel sequences of shared batches: every step gives
+/// each running request one new token and fills the rest of the batch with
+/// prompt tokens of newly admitted ones. Returns false and sets \p Error if
+/// the socket cannot be set up.
+bool runDaemon(LLMEngine &Engine, const std::string &SocketPath,
+               std::string &Error);
+
+} // end namespace seekbug
@@ -0,0 +1,103 @@
+#pragma once
+
+//===-------- JobQueue.h --------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace seekbug {
+
+/// Background inference worker for `ai --async` commands. Jobs run one at a
+/// time on the session's engine, while the command interpreter stays usable.
+class JobQueue {
+public:
+  enum class JobState { Queued, Running, Done, Cancelled };
+
+  /// A snapshot of a job, as shown by `ai jobs`.
+  struct JobInfo {
+    unsigned ID;
+    std::string Description;
+    JobState State;
+    double ElapsedSeconds;
+  };
+
+  /// Called on the worker thread with the finished job's answer. \p Waited
+  /// tells whether someone is waiting for it, in which case the waiter shows
+  /// the answer and the callback should only do its other work.
+  using FinishedCallback =
+      std::function<void(unsigned ID, const std::string &Description,
+                         const std::string &Answer, bool Waited)>;
+
+  explicit JobQueue(std::shared_ptr<LLMEngine> Engine);
+  ~JobQueue();
+
+  /// Queue \p Request and return its job id right away.
+  unsigned submit(const std::string &Description, LLMRequest Request,
+                  FinishedCallback OnFinished);
+
+  std::vector<JobInfo> list();
+
+  enum class WaitResult { Finished, Interrupted, NoSuchJob };
+
+  /// Block until job \p ID is finished, and its callback has run, and
+  /// return its answer in \p Answer. Once \p Interrupt, if given, becomes
+  /// true, stop waiting instead; the job goes on and its callback shows the
+  /// answer as if nobody had waited.
+  WaitResult wait(unsigned ID, std::string &Answer,
+                  const std::atomic<bool> *Interrupt = nullptr);
+
+  /// Cancel job \p ID. A running job stops after its current decode step.
+  /// Returns false if there is no such job or it has already finished.
+  bool cancel(unsigned ID);
+
+  /// Cancel everything and join the worker. Called on session teardown.
+  void stop();
+
+  static const char *stateToString(JobState State);
+
+private:
+  struct Job {
+    unsigned ID;
+    std::string Description;
+    LLMRequest Request;
+    FinishedCallback OnFinished;
+    JobState State = JobState::Queued;
+    std::string Answer;
+    bool HasWaiter = false;
+    /// Whether the callback has run, or will not run at all.
+    bool Delivered = false;
+    std::atomic<bool> Cancel{false};
+    std::chrono::steady_clock::time_point Submitted;
+    std::chrono::steady_clock::time_point Finished;
+  };
+
+  void run();
+  void pruneFinished();
+
+  std::shared_ptr<LLMEngine> Engine;
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::map<unsigned, std::shared_ptr<Job>> Jobs;
+  std::deque<std::shared_ptr<Job>> Pending;
+  unsigned NextID = 1;
+  bool Stopping = false;
+  std::thread Worker;
+};
+
+} // end namespace seekbug
@@ -0,0 +1,39 @@
+#pragma once
+
+//===-------- MachineContext.h --------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <lldb/API/SBFrame.h>
+
+#include <cstddef>
+#include <string>
+
+namespace seekbug {
+
+/// How many instructions around the pc are disassembled.
+struct MachineContextLimits {
+  unsigned InstructionsBefore = 6;
+  unsigned InstructionsAfter = 3;
+  /// Most instructions decoded from the start of the function to find where
+  /// the instructions before the pc begin. Instructions have variable length
+  /// on some targets, so decoding backwards from the pc is not possible.
+  unsigned MaxScannedInstructions = 256;
+};
+
+/// What a frame without line information was executing, in place of a
+/// source snippet: the instructions around its pc, in the snippet format
+/// with the current instruction marked by "->", and the registers those
+/// instructions use, as "name=value" on one line. Instructions farthest from
+/// the pc are left out until the text fits \p TokenBudget tokens of
+/// \p Engine. Empty if nothing could be disassembled.
+std::string encodeMachineContext(lldb::SBFrame &Frame,
+                                 const LLMEngine &Engine, size_t TokenBudget,
+                                 const MachineContextLimits &Limits = {});
+
+} // end namespace seekbug
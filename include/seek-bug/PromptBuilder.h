@@ -0,0 +1,68 @@
+#pragma once
+
+//===-------- PromptBuilder.h ---------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace seekbug {
+
+/// Assembles the debugging context of a prompt from sections of different
+/// importance and keeps it within a token budget. Sections are emitted in
+/// the order they were added; when the budget is exceeded, the least
+/// important ones are shrunk or dropped first, the latest added first.
+class PromptBuilder {
+public:
+  /// From most to least important.
+  enum class Priority { CrashingFrame, OuterFrames, Snippets, Extras };
+
+  /// Tokens of the text of a section.
+  using TokenCounter = std::function<size_t(const std::string &)>;
+
+  PromptBuilder(const LLMEngine &Engine, size_t TokenBudget);
+  PromptBuilder(TokenCounter CountTokens, size_t TokenBudget);
+
+  /// Add \p Text. A \p Shrinkable section is source in the usual snippet
+  /// format; when space is short it is cut down to its headers and the
+  /// lines marked with "->" before it is dropped altogether.
+  void add(Priority P, std::string Text, bool Shrinkable = false);
+
+  /// The sections that fit, followed by a note if anything was left out.
+  std::string build();
+
+  /// Number of sections shrunk or dropped by the last build().
+  unsigned getNumShrunk() const { return NumShrunk; }
+  unsigned getNumDropped() const { return NumDropped; }
+
+private:
+  struct Section {
+    Priority P;
+    std::string Text;
+    bool Shrinkable;
+    size_t Tokens;
+    bool Dropped = false;
+  };
+
+  TokenCounter CountTokens;
+  size_t TokenBudget;
+  std::vector<Section> Sections;
+  unsigned NumShrunk = 0;
+  unsigned NumDropped = 0;
+};
+
+/// The token budget for the context part of a prompt with \p Preamble and an
+/// answer of \p MaxNewTokens tokens (0 for the default): the space left in
+/// the model's context, capped by \p ConfiguredBudget unless that is 0.
+size_t getPromptTokenBudget(const LLMEngine &Engine,
+                            const std::string &Preamble,
+                            size_t ConfiguredBudget, int MaxNewTokens = 0);
+
+} // end namespace seekbug
@@ -0,0 +1,82 @@
+#pragma once
+
+//===-------- ResponseCache.h ---------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace seekbug {
+
+/// LRU cache of model answers, in memory and on disk. Generation is
+/// deterministic for a given prompt, model and sampling setup, so asking
+/// the same question at the same program point again (e.g. across reruns)
+/// is answered without running the model.
+class ResponseCache {
+public:
+  struct Stats {
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+    size_t MemoryEntries = 0;
+    uint64_t DiskBytes = 0;
+  };
+
+  /// \p Directory may be empty to keep the cache in memory only.
+  ResponseCache(std::string Directory, size_t MaxMemoryEntries = 128,
+                uint64_t MaxDiskBytes = 32 << 20);
+
+  /// ~/.cache/seek-bug/responses, or empty if there is no cache directory.
+  static std::string getDefaultDirectory();
+
+  /// Key of \p Request as answered by \p Engine: its model and the way it
+  /// formats prompts are part of the key.
+  static uint64_t computeKey(const LLMRequest &Request,
+                             const LLMEngine &Engine);
+  static uint64_t computeKey(const LLMRequest &Request,
+                             uint64_t ModelFingerprint,
+                             llvm::StringRef PromptFormat);
+
+  /// \p Prompt without what changes from run to run at the same program
+  /// point: the ids on the Process and Thread lines, the load addresses of
+  /// disassembly without a symbol, and whitespace layout. Values, constants
+  /// and registers are kept, since they may be what the question is about.
+  static std::string normalizePrompt(llvm::StringRef Prompt);
+
+  bool lookup(uint64_t Key, std::string &Response);
+  void insert(uint64_t Key, const std::string &Response);
+  void clear();
+  Stats getStats();
+
+private:
+  std::string getEntryPath(uint64_t Key) const;
+  void touchMemoryEntry(uint64_t Key, const std::string &Response);
+  void computeDiskUsage();
+  void evictDiskEntries();
+
+  std::string Directory;
+  size_t MaxMemoryEntries;
+  uint64_t MaxDiskBytes;
+
+  std::mutex Mutex;
+  /// Most recently used entries first.
+  std::list<std::pair<uint64_t, std::string>> Entries;
+  std::unordered_map<uint64_t,
+                     std::list<std::pair<uint64_t, std::string>>::iterator>
+      Index;
+  Stats Counters;
+  bool DiskUsageKnown = false;
+};
+
+} // end namespace seekbug
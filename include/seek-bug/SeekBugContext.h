@@ -7,8 +7,76 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "seek-bug/ChatSession.h"
+#include "seek-bug/CrashIndex.h"
+#include "seek-bug/JobQueue.h"
+#include "seek-bug/ResponseCache.h"
+#include "seek-bug/SourceCache.h"
+#include "seek-bug/SpeculativePrefill.h"
+#include "seek-bug/Telemetry.h"
+#include "seek-bug/VariableCapture.h"
+#include "seek-bug/llm.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+
+/// State of `ai watch`, shared by the command that toggles it and the stop
+/// hook that runs it.
+struct WatchState {
+  std::mutex Mutex;
+  bool Enabled = false;
+  /// The background job annotating the latest stop, or 0.
+  unsigned JobID = 0;
+  /// The stop that job is about.
+  uint32_t StopID = 0;
+};
 
 struct SeekBugContext {
   std::string DeepSeekLLMPath;
+
+  /// Upper bound on the tokens of debugging context put into a prompt, or 0
+  /// to use whatever fits in the model's context.
+  size_t PromptTokenBudget = 0;
+
+  /// How answers are generated, unless a command says otherwise.
+  seekbug::SamplingOptions Sampling;
+  /// Most tokens of an answer, or 0 for the engine's default.
+  unsigned MaxNewTokens = 0;
+  /// Milliseconds an AI command may generate for, unless it gives
+  /// --deadline, or 0 for no limit.
+  unsigned DeadlineMs = 0;
+  /// Strings that end every answer.
+  std::vector<std::string> Stop;
+
+  /// The model loaded once per session, shared by all AI commands.
+  std::shared_ptr<seekbug::LLMEngine> Engine;
+
+  /// Background worker for `ai --async` requests.
+  std::shared_ptr<seekbug::JobQueue> Jobs;
+
+  /// Prefills the next likely prompt when the process stops.
+  std::shared_ptr<seekbug::SpeculativePrefill> Prefill;
+
+  /// Answers of earlier requests, in memory and on disk.
+  std::shared_ptr<seekbug::ResponseCache> Responses;
+
+  /// Annotates every stop in the background while `ai watch` is on.
+  std::shared_ptr<WatchState> Watch;
+
+  /// The conversation of `ai chat`.
+  std::shared_ptr<seekbug::ChatSession> Chat;
+
+  /// Crashes analyzed in earlier sessions.
+  std::shared_ptr<seekbug::CrashIndex> Crashes;
+
+  /// Source files read for snippets, mapped once per session.
+  std::shared_ptr<seekbug::SourceCache> Sources;
+  /// Frame variables put into prompts, formatted once per stop.
+  std::shared_ptr<seekbug::VariableCapture> Variables;
+  /// Where the time of the AI commands went, for `ai stats`.
+  std::shared_ptr<seekbug::Telemetry> Stats;
 };
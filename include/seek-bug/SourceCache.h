@@ -0,0 +1,74 @@
+#pragma once
+
+//===-------- SourceCache.h -----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace seekbug {
+
+/// A source file mapped into memory. Lines are served as views into the
+/// mapping; the line index is built the first time a line is asked for.
+class SourceFile {
+public:
+  SourceFile(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+             llvm::sys::TimePoint<> ModificationTime);
+
+  uint32_t getNumLines() const;
+
+  /// Text of the 1-based \p Line without its line terminator, or an empty
+  /// view if the file is shorter than that.
+  llvm::StringRef getLine(uint32_t Line) const;
+
+  llvm::sys::TimePoint<> getModificationTime() const {
+    return ModificationTime;
+  }
+  uint64_t getSize() const { return Buffer->getBufferSize(); }
+
+private:
+  void buildLineIndex() const;
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  llvm::sys::TimePoint<> ModificationTime;
+  mutable std::once_flag IndexOnce;
+  /// Offset of the first character of every line.
+  mutable std::vector<uint32_t> LineOffsets;
+};
+
+/// Session-wide cache of source files, so that gathering snippets for every
+/// frame of a deep stack reads each file once rather than once per frame.
+/// A file is mapped again when its modification time or size changes.
+class SourceCache {
+public:
+  /// The file at \p Path, or null if it cannot be read. The returned file
+  /// stays valid even if the cache drops it in the meantime.
+  std::shared_ptr<const SourceFile> getFile(const std::string &Path);
+
+  void clear();
+
+  /// Account \p Milliseconds spent reading snippets from the cached files.
+  void addReadTime(double Milliseconds);
+  /// Time spent reading snippets over the session, in milliseconds.
+  double getReadTime() const;
+
+private:
+  std::mutex Mutex;
+  std::atomic<uint64_t> ReadMicroseconds{0};
+  llvm::StringMap<std::shared_ptr<const SourceFile>> Files;
+};
+
+} // end namespace seekbug
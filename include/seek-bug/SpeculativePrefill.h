@@ -0,0 +1,61 @@
+#pragma once
+
+//===-------- SpeculativePrefill.h ----------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace seekbug {
+
+/// Prefills the prompt of the next likely AI command in the background
+/// whenever the process stops, so that the command itself only has to
+/// prefill the user's question and decode the answer.
+class SpeculativePrefill {
+public:
+  /// The command whose prompt is prefilled on every stop.
+  enum class Target { Off, Suggest, Fix };
+
+  explicit SpeculativePrefill(
+      std::shared_ptr<LLMEngine> Engine,
+      std::chrono::milliseconds Debounce = std::chrono::milliseconds(250));
+  ~SpeculativePrefill();
+
+  void setTarget(Target NewTarget) { CurrentTarget = NewTarget; }
+  Target getTarget() const { return CurrentTarget; }
+
+  /// Prefill \p Request once stops have settled for the debounce interval.
+  /// A newer request replaces a pending one and aborts one in progress.
+  void schedule(LLMRequest Request);
+
+  /// Abort any pending or running prefill and join the worker.
+  void stop();
+
+private:
+  void run();
+
+  std::shared_ptr<LLMEngine> Engine;
+  std::chrono::milliseconds Debounce;
+  std::atomic<Target> CurrentTarget{Target::Off};
+
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::optional<LLMRequest> Pending;
+  unsigned Generation = 0;
+  bool Stopping = false;
+  std::atomic<bool> Cancel{false};
+  std::thread Worker;
+};
+
+} // end namespace seekbug
@@ -0,0 +1,54 @@
+#pragma once
+
+//===-------- StackEncoder.h ----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/SourceCache.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace seekbug {
+
+/// What the encoder needs to know about one frame.
+struct StackFrameInfo {
+  uint32_t Index = 0;
+  std::string Function;
+  /// Full path of the source file, empty if there is no line information.
+  std::string Path;
+  uint32_t Line = 0;
+};
+
+/// A call stack in compact text form.
+struct EncodedStack {
+  /// One line per frame or per collapsed recursion, innermost first.
+  std::vector<std::string> Frames;
+  /// The source around the frames, one block per file, in the order the
+  /// files first appear on the stack.
+  std::vector<std::string> Sources;
+  /// Index into Sources of the innermost frame's file, or -1.
+  int CrashingSource = -1;
+};
+
+/// Encode \p Frames, innermost first, for a prompt. Repeated cycles of
+/// frames, as in deep recursion, become a single line. The snippets of all
+/// frames in the same file are merged, so each file and each source line is
+/// printed once, with every frame's line marked by "->". Paths and C++
+/// symbol names are shortened.
+EncodedStack encodeStack(SourceCache &Sources,
+                         llvm::ArrayRef<StackFrameInfo> Frames,
+                         unsigned ContextLines = 2);
+
+/// \p Name with long template argument lists replaced by "<...>" and
+/// library-internal inline namespaces removed.
+std::string shortenSymbolName(llvm::StringRef Name);
+
+} // end namespace seekbug
@@ -0,0 +1,75 @@
+#pragma once
+
+//===-------- Telemetry.h -------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace seekbug {
+
+/// Where the time of one AI command went. Times are in milliseconds.
+struct InvocationStats {
+  std::string Command;
+  /// When the command finished, in seconds since the epoch.
+  int64_t Timestamp = 0;
+  bool FromCache = false;
+  /// Gathering the debugging context: walking frames and threads through
+  /// the SB API, reading sources and building the prompt.
+  double ContextTime = 0;
+  /// The part of ContextTime spent reading source snippets.
+  double SourceTime = 0;
+  double FirstTokenTime = 0;
+  double TotalTime = 0;
+  GenerationStats Generation;
+};
+
+/// Performance telemetry of a session: the most recent invocations for
+/// `ai stats`, totals over the session and, optionally, a JSONL log of
+/// every invocation to track performance across releases and models.
+class Telemetry {
+public:
+  explicit Telemetry(std::shared_ptr<LLMEngine> Engine,
+                     size_t MaxHistory = 100);
+
+  /// Append every recorded invocation to the file at \p Path, one JSON
+  /// object per line.
+  bool openLog(const std::string &Path, std::string &Error);
+
+  /// Record a finished invocation. This may be called from any thread.
+  void record(const InvocationStats &Stats);
+
+  /// The last \p N invocations, oldest first.
+  std::vector<InvocationStats> getRecent(size_t N);
+
+  /// All invocations of the session summed up. \p NumInvocations is their
+  /// number, \p NumFromCache the number of them answered from the cache.
+  InvocationStats getTotals(unsigned &NumInvocations, unsigned &NumFromCache);
+
+  const LLMEngine &getEngine() const { return *Engine; }
+
+private:
+  std::shared_ptr<LLMEngine> Engine;
+  size_t MaxHistory;
+
+  std::mutex Mutex;
+  std::deque<InvocationStats> History;
+  InvocationStats Totals;
+  unsigned NumInvocations = 0;
+  unsigned NumFromCache = 0;
+  std::unique_ptr<llvm::raw_fd_ostream> Log;
+};
+
+} // end namespace seekbug
@@ -0,0 +1,45 @@
+#pragma once
+
+//===-------- Triage.h ----------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/SeekBugContext.h"
+
+#include <string>
+
+namespace seekbug {
+
+struct TriageOptions {
+  /// The executable the cores were produced by.
+  std::string Program;
+  /// A directory of cores, or a file listing one core path per line.
+  std::string Input;
+  /// Where the JSONL results go; empty or "-" for stdout.
+  std::string OutputPath;
+  /// Number of worker processes loading cores; 0 for one per hardware
+  /// thread.
+  unsigned Jobs = 0;
+  /// Milliseconds the model may take to analyze all crashes, or 0 for no
+  /// limit. Analyses still unfinished then are reported truncated.
+  unsigned DeadlineMs = 0;
+  /// This executable, started again as a worker for every core.
+  std::string SelfPath;
+};
+
+/// Triage all cores of \p Options without user interaction. Cores are
+/// loaded by a pool of worker processes, grouped by crash signature, and
+/// the model runs once per distinct crash. Writes one JSON object per crash
+/// and per core that could not be loaded. Returns the process exit code,
+/// which is 1 if no core could be loaded or the analysis failed.
+int runTriage(SeekBugContext &Context, const TriageOptions &Options);
+
+/// The worker side of runTriage: load \p CorePath for \p Program and write
+/// its crash signature and call stack as JSON to \p OutputPath.
+int runTriageWorker(const std::string &Program, const std::string &CorePath,
+                    const std::string &OutputPath);
+
+} // end namespace seekbug
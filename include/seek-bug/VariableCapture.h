@@ -0,0 +1,103 @@
+#pragma once
+
+//===-------- VariableCapture.h -------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <lldb/API/SBFrame.h>
+#include <lldb/API/SBValue.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace seekbug {
+
+/// How much of a frame's variables goes into a prompt. Reading a value may
+/// read target memory, and a container may have millions of elements, so
+/// every dimension is bounded.
+struct VariableCaptureLimits {
+  /// Most variables per frame.
+  unsigned MaxVariables = 32;
+  /// Levels of members, elements and pointees below a variable.
+  unsigned MaxDepth = 2;
+  /// Most members or elements shown per aggregate.
+  unsigned MaxChildren = 8;
+  /// Most characters of a single value or summary.
+  size_t MaxValueLength = 80;
+  /// Most characters of all variables together.
+  size_t MaxBytes = 2048;
+  /// Most pointers followed per capture.
+  unsigned MaxDereferences = 4;
+  /// Time after which the capture stops reading values.
+  std::chrono::milliseconds TimeBudget{50};
+};
+
+struct CapturedVariable {
+  std::string Name;
+  std::string Type;
+  std::string Value;
+
+  /// "name (type) = value" and a newline.
+  std::string format() const;
+};
+
+struct VariableSnapshot {
+  std::vector<CapturedVariable> Variables;
+  /// Whether variables were left out for one of the limits.
+  bool Truncated = false;
+
+  /// One line per variable.
+  std::string format() const;
+};
+
+/// Captures the arguments and locals of a frame within VariableCaptureLimits.
+/// Pointers are followed only while the depth and dereference budgets last,
+/// and never twice to the same address, so cyclic lists terminate. The
+/// formatted variables are cached until the process stops again, since the
+/// prompts built at one stop (prefill, watch, suggest, chat) all ask for
+/// the same frame.
+class VariableCapture {
+public:
+  explicit VariableCapture(VariableCaptureLimits Limits = {});
+
+  VariableSnapshot capture(lldb::SBFrame &Frame);
+
+  const VariableCaptureLimits &getLimits() const { return Limits; }
+
+private:
+  /// Budgets of a single capture.
+  struct CaptureState {
+    std::chrono::steady_clock::time_point Deadline;
+    unsigned Dereferences = 0;
+    std::set<uint64_t> VisitedAddresses;
+    bool OutOfTime = false;
+  };
+
+  std::string formatValue(lldb::SBValue &Value, unsigned Depth,
+                          CaptureState &State);
+  std::string formatChildren(lldb::SBValue &Value, unsigned Depth,
+                             CaptureState &State);
+  std::string clip(const char *Text) const;
+
+  VariableCaptureLimits Limits;
+
+  std::mutex Mutex;
+  /// The stop the cache is about, as process id and stop id.
+  uint64_t CachedProcessID = 0;
+  uint32_t CachedStopID = 0;
+  /// Variables by thread, canonical frame address and name.
+  std::map<std::tuple<uint64_t, uint64_t, std::string>, CapturedVariable>
+      Cache;
+};
+
+} // end namespace seekbug
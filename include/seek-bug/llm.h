@@ -1,6 +1,420 @@
 #pragma once
 
+//===-------- llm.h -------------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llama.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace seekbug {
+
+/// How the next token is picked. The defaults give the deterministic greedy
+/// decoding that makes answers cacheable.
+struct SamplingOptions {
+  /// 0 always picks the most likely token; higher values draw from an
+  /// increasingly flat distribution.
+  float Temperature = 0;
+  int TopK = 40;
+  float TopP = 0.95f;
+  /// Penalty for repeating any of the last RepeatLastN tokens; 1 is none.
+  float RepeatPenalty = 1.0f;
+  int RepeatLastN = 64;
+  /// Fixed, so that sampled answers are reproducible as well.
+  uint32_t Seed = 0;
+};
+
+/// Where the time of a request went, as measured by runLLM(). Times are in
+/// milliseconds.
+struct GenerationStats {
+  double TokenizeTime = 0;
+  /// Restoring or prefilling the preamble and prefilling the prompt.
+  double PrefillTime = 0;
+  /// Generating the answer, from the first sampled token to the last.
+  double DecodeTime = 0;
+  /// The slowest single decode step.
+  double MaxDecodeStepTime = 0;
+  unsigned PromptTokens = 0;
+  unsigned GeneratedTokens = 0;
+  /// llama.cpp's own counters (llama_perf_context) over the request.
+  double PerfPromptEvalTime = 0;
+  unsigned PerfPromptEvalTokens = 0;
+  double PerfEvalTime = 0;
+  unsigned PerfEvalTokens = 0;
+};
+
+/// A prompt split into the part that is the same for every invocation of a
+/// command and the part built from the current debugging context.
+struct LLMRequest {
+  /// Fixed instructions. Their KV state is cached across requests.
+  std::string Preamble;
+  /// The dynamic part: debugging context, user question, etc.
+  std::string Prompt;
+  /// Called with every piece of text as soon as it is generated.
+  std::function<void(const std::string &Piece)> OnToken;
+  /// When set, generation stops as soon as this becomes true.
+  const std::atomic<bool> *Cancel = nullptr;
+  /// Past this point, generation stops and the answer so far is returned,
+  /// marked as truncated.
+  std::chrono::steady_clock::time_point Deadline =
+      std::chrono::steady_clock::time_point::max();
+  SamplingOptions Sampling;
+  /// Most tokens the answer may have, or 0 for the default.
+  int MaxNewTokens = 0;
+  /// Generation ends as soon as the answer contains one of these. The stop
+  /// string itself is not part of the answer.
+  std::vector<std::string> Stop;
+  /// GBNF grammar the answer must match, or empty for free text.
+  std::string Grammar;
+  /// When set, runLLM() records where the time went here.
+  GenerationStats *Stats = nullptr;
+};
+
+/// Watches an answer as it is generated. It hides any <think> section the
+/// model still writes, and ends the answer before the token limit: at a
+/// stop string, or as soon as the model starts repeating itself, which
+/// greedy decoding is prone to.
+class GenerationMonitor {
+public:
+  /// \p DetectLoops is off for grammar-constrained answers, where cutting
+  /// the answer short would make it invalid.
+  explicit GenerationMonitor(std::vector<std::string> Stop = {},
+                             bool DetectLoops = true);
+
+  /// Account for \p Token, whose text is \p Piece, and return the text that
+  /// can be shown now. Text that may be the start of a stop string or of a
+  /// reasoning tag is held back until it is known not to be.
+  std::string add(llama_token Token, const std::string &Piece);
+
+  /// The text held back, once generation ended for another reason.
+  std::string flush();
+
+  /// Whether the answer is complete.
+  bool isDone() const { return Done; }
+
+private:
+  std::string filterReasoning(const std::string &Piece);
+  std::string release(const std::string &Text);
+
+  std::vector<std::string> Stop;
+  /// Visible text that may be the start of a stop string.
+  std::string Pending;
+  /// Generated text not yet known to be outside of a reasoning section.
+  std::string Unfiltered;
+  /// The text of the current reasoning section.
+  std::string Reasoning;
+  bool DetectLoops;
+  bool InReasoning = false;
+  bool SkipSpace = true;
+  bool AnythingShown = false;
+  std::vector<llama_token> History;
+  /// How often each n-gram of History was seen, by hash.
+  std::unordered_map<uint64_t, unsigned> NGramCounts;
+  bool Done = false;
+};
+
+/// How inference uses the machine. Zero (or empty) fields take the values
+/// tuned by `seek-bug --autotune` for the model on this host, if any, and
+/// llama.cpp's defaults otherwise.
+struct LLMEngineOptions {
+  /// Threads decoding generated tokens.
+  unsigned Threads = 0;
+  /// Threads decoding prompt batches.
+  unsigned BatchThreads = 0;
+  /// Most tokens submitted to a single decode. Raised to fit a token of
+  /// every parallel sequence, and a token and its draft.
+  unsigned BatchSize = 0;
+  /// Most tokens computed at once within a decode.
+  unsigned UBatchSize = 0;
+  /// CPUs to run on, as a list of ranges like "0-7,16-23".
+  std::string CPUAffinity;
+  /// Tokens the KV cache holds, shared by prompts and answers; 0 for 4096.
+  unsigned ContextSize = 0;
+  /// Store the KV cache as q8_0 rather than f16, which halves its size.
+  bool QuantizeKVCache = false;
+  /// Map the model file, so that the kernel can drop its pages under
+  /// memory pressure and read them again later, rather than reading it.
+  bool UseMMap = true;
+  /// Keep the model in RAM, so that it is never swapped out.
+  bool LockMemory = false;
+};
+
+/// Session-scoped inference engine. It loads the GGUF model once and keeps
+/// the model and a reusable llama context alive for the whole debugging
+/// session, so every AI command pays only prefill and decode cost.
+class LLMEngine {
+public:
+  /// How many requests generateBatch() decodes side by side. Sequence 0 is
+  /// kept for the regular requests, the others are used for the batch.
+  static constexpr unsigned MaxParallelSequences = 7;
+  /// The sequence holding the conversation of a ChatSession.
+  static constexpr llama_seq_id ChatSequence = MaxParallelSequences + 1;
+
+  ~LLMEngine();
+
+  LLMEngine(const LLMEngine &) = delete;
+  LLMEngine &operator=(const LLMEngine &) = delete;
+
+  /// Load the model at \p ModelPath and create the inference context.
+  /// Returns nullptr and sets \p Error on failure.
+  static std::unique_ptr<LLMEngine>
+  create(const std::string &ModelPath, std::string &Error,
+         const LLMEngineOptions &Options = LLMEngineOptions());
+
+  /// Like create(), but leave inference to the seek-bugd daemon listening
+  /// on \p SocketPath. Only the vocabulary of the model is loaded, for
+  /// counting prompt tokens and budgeting them for the daemon's context.
+  static std::unique_ptr<LLMEngine> createForDaemon(
+      const std::string &ModelPath, const std::string &SocketPath,
+      std::string &Error);
+
+  /// Whether requests are answered by the daemon rather than in-process.
+  bool isRemote() const { return !DaemonSocket.empty(); }
+  const std::string &getDaemonSocket() const { return DaemonSocket; }
+
+  llama_model *getModel() const { return Model; }
+  llama_context *getContext() const { return Ctx; }
+  /// Tokens the KV cache holds, or 0 with a daemon.
+  uint32_t getContextSize() const { return Ctx ? llama_n_ctx(Ctx) : 0; }
+  const llama_vocab *getVocab() const { return Vocab; }
+  const std::string &getModelPath() const { return ModelPath; }
+
+  /// The options the context was created with, after applying the tuned
+  /// profile.
+  const LLMEngineOptions &getOptions() const { return Options; }
+
+  /// How long loading the model and creating the context took, in
+  /// milliseconds.
+  double getLoadTime() const { return LoadTime; }
+
+  /// Identity of the model file (size, mtime and a hash of its header), used
+  /// to key anything derived from the model that outlives the session.
+  uint64_t getModelFingerprint() const { return ModelFingerprint; }
+
+  /// Number of tokens a prompt may have, leaving room for an answer of
+  /// \p MaxNewTokens tokens (0 for the default) and for the reserved part of
+  /// the context.
+  size_t getMaxPromptTokens(int MaxNewTokens = 0) const;
+
+  /// Keep \p Tokens cells of the KV cache for a sequence other than 0, such
+  /// as a chat, out of the reach of regular requests.
+  void reserveContext(size_t Tokens) { ReservedTokens = Tokens; }
+  size_t getReservedContext() const { return ReservedTokens; }
+
+  /// Tokenize \p Text with the model vocabulary. \p AddSpecial adds the BOS
+  /// token, so it is only wanted for the start of a prompt. This only reads
+  /// the vocabulary and does not need the lock below.
+  bool tokenize(const std::string &Text, bool AddSpecial,
+                std::vector<llama_token> &Tokens) const;
+
+  /// Number of tokens \p Text takes in the middle of a prompt.
+  size_t countTokens(const std::string &Text) const;
+
+  /// The context is not reentrant; hold this lock while using it and while
+  /// calling any of the methods below.
+  std::mutex &getMutex() { return Mutex; }
+
+  /// Make sequence 0 of the KV cache hold exactly \p Tokens. The longest
+  /// prefix that is already cached is kept and only the rest is decoded, in
+  /// chunks of at most the context's batch size. The decode is aborted as
+  /// soon as \p Cancel becomes true or \p Deadline passes; the chunks
+  /// decoded so far stay cached.
+  bool prefill(const std::vector<llama_token> &Tokens,
+               const std::atomic<bool> *Cancel = nullptr,
+               std::chrono::steady_clock::time_point Deadline =
+                   std::chrono::steady_clock::time_point::max());
+
+  /// Prefill the preamble and prompt of \p Request, leaving the engine
+  /// ready to sample the first answer token. On failure \p Error holds the
+  /// message to show instead of an answer. With a daemon there is nothing to
+  /// prefill locally, and this only checks for cancellation.
+  bool prefillRequest(const LLMRequest &Request, std::string &Error);
+
+  /// Decode a single generated token on top of sequence 0.
+  bool decodeToken(llama_token Token);
+
+  /// Drop everything sequence 0 holds past its first \p NumTokens tokens.
+  void truncateCache(size_t NumTokens);
+
+  /// Load a small model with the same vocabulary as the main one, to draft
+  /// tokens for decodeSpeculative(). It gets a context of its own.
+  bool loadDraftModel(const std::string &Path, std::string &Error);
+  bool hasDraftModel() const { return DraftCtx != nullptr; }
+
+  /// Like decodeToken(), but also decode up to \p MaxDraft tokens that the
+  /// draft model expects to follow \p Token, in the same batch. \p Sampler
+  /// then picks the tokens that follow from the logits of the batch, one by
+  /// one, for as long as they agree with the draft. \p Next receives the
+  /// picked tokens: the drafted ones that were confirmed, which stay cached,
+  /// and the first one that differs from the draft, which is not decoded
+  /// yet. The answer is thus exactly the one decodeToken() would give.
+  /// \p NumDrafted is the number of tokens the draft model proposed.
+  bool decodeSpeculative(llama_token Token, int MaxDraft,
+                         llama_sampler *Sampler,
+                         std::vector<llama_token> &Next, int &NumDrafted);
+
+  /// Bring the KV state of a fixed prompt preamble into sequence 0 and
+  /// return its tokens in \p Tokens. The state is prefilled only the first
+  /// time a preamble is seen; later it is restored from an in-memory
+  /// snapshot, or from disk if persistence is enabled.
+  bool restorePreamble(const std::string &Preamble,
+                       std::vector<llama_token> &Tokens);
+
+  /// Answer \p Prompts, which all follow \p Preamble, at once. The preamble
+  /// is prefilled once and shared by all of them, and the prompts and their
+  /// answers are decoded as parallel sequences of the same batches, so the
+  /// model weights are read once per step for all of them. At most
+  /// MaxParallelSequences prompts are taken at a time, and every answer
+  /// has at most \p MaxNewTokens tokens and is sampled with \p Sampling,
+  /// each from its own sampler. Answers[I] is the answer to
+  /// Prompts[I], or an error message in brackets. Once \p Deadline passes,
+  /// the answers so far are returned truncated, like those of generate().
+  /// With a daemon, the prompts are sent as concurrent requests, which it
+  /// batches the same way.
+  bool generateBatch(const std::string &Preamble,
+                     const std::vector<std::string> &Prompts,
+                     int MaxNewTokens, const SamplingOptions &Sampling,
+                     std::vector<std::string> &Answers,
+                     const std::atomic<bool> *Cancel,
+                     std::chrono::steady_clock::time_point Deadline,
+                     std::string &Error);
+
+  /// Render prompts through the model's chat template, starting the
+  /// assistant turn after an empty reasoning block when \p SkipReasoning is
+  /// set, so that decoding starts right at the answer. This only takes
+  /// effect for models whose template knows about reasoning.
+  void setSkipReasoning(bool Skip) { SkipReasoning = Skip; }
+
+  /// \p Request with its preamble and prompt rendered as the system and
+  /// user turns of the model's chat template, followed by the header of the
+  /// assistant turn. Without a template, \p Request is returned as is.
+  LLMRequest formatRequest(const LLMRequest &Request) const;
+
+  /// The text that continues a conversation started by formatRequest(),
+  /// once the model answered: \p Closing ends the assistant turn and opens
+  /// the next user turn, and \p Turn holds \p Message and the header of the
+  /// next assistant turn.
+  void formatFollowUp(const std::string &Message, std::string &Closing,
+                      std::string &Turn) const;
+
+  /// How formatRequest() renders prompts, in a form suitable for cache keys.
+  std::string getPromptFormat() const;
+
+  /// Persist preamble snapshots next to the model file, so later sessions
+  /// skip their prefill as well.
+  void enablePersistentPrefixCache();
+
+private:
+  LLMEngine() = default;
+
+  /// Snapshot of sequence 0 right after a preamble was prefilled.
+  struct PrefixSnapshot {
+    std::vector<llama_token> Tokens;
+    std::vector<uint8_t> State;
+  };
+
+  void resetCache();
+  bool generateGroup(size_t PreambleSize,
+                     const std::vector<std::vector<llama_token>> &Prompts,
+                     int MaxNewTokens, const SamplingOptions &Sampling,
+                     std::vector<std::string> &Answers,
+                     const std::atomic<bool> *Cancel,
+                     std::chrono::steady_clock::time_point Deadline);
+  static bool shouldAbortDecode(void *Data);
+  void snapshotPreamble(uint64_t Key, const std::vector<llama_token> &Tokens);
+  std::string getPrefixFilePath(uint64_t Key) const;
+  bool loadPrefixFile(uint64_t Key, const std::vector<llama_token> &Tokens);
+  bool draftTokens(const std::vector<llama_token> &Context, int MaxDraft,
+                   std::vector<llama_token> &Draft);
+
+  std::string ModelPath;
+  std::string DaemonSocket;
+  /// The size of the daemon's context, which prompts are budgeted for.
+  uint32_t RemoteContextSize = 0;
+  LLMEngineOptions Options;
+  bool SkipReasoning = true;
+  uint64_t ModelFingerprint = 0;
+  double LoadTime = 0;
+  size_t ReservedTokens = 0;
+  llama_model *Model = nullptr;
+  llama_context *Ctx = nullptr;
+  const llama_vocab *Vocab = nullptr;
+  std::mutex Mutex;
+
+  /// The draft model and the tokens its context holds.
+  llama_model *DraftModel = nullptr;
+  llama_context *DraftCtx = nullptr;
+  std::vector<llama_token> DraftCachedTokens;
+
+  /// Checked by llama.cpp while a prefill is being computed.
+  const std::atomic<bool> *ActiveCancel = nullptr;
+  std::chrono::steady_clock::time_point ActiveDeadline =
+      std::chrono::steady_clock::time_point::max();
+
+  /// Tokens currently held by sequence 0 of the KV cache.
+  std::vector<llama_token> CachedTokens;
+  std::unordered_map<uint64_t, PrefixSnapshot> Prefixes;
+  std::string PrefixCacheDir;
+};
+
+/// Everything besides the prompt that decides what the model answers, in a
+/// form suitable for cache keys.
+std::string getSamplingDescription(const LLMRequest &Request);
+
+/// Same as the engine's model fingerprint, without loading the model.
+uint64_t computeModelFingerprint(const std::string &ModelPath);
+
+/// Set the fields of \p Params that \p Options specifies.
+void applyEngineOptions(const LLMEngineOptions &Options,
+                        llama_context_params &Params);
+
+/// Make \p Options use as little memory as possible: a context just large
+/// enough for prompts of \p PromptTokenBudget tokens (0 for the default)
+/// and answers of \p MaxNewTokens tokens (0 for the default), and a
+/// quantized KV cache.
+void applyLowMemoryProfile(LLMEngineOptions &Options, size_t PromptTokenBudget,
+                           int MaxNewTokens);
+
+/// The memory the process has in RAM, in bytes, or 0 if unknown.
+size_t getResidentMemory();
+
+/// What the engine uses memory for, and how much the process has in RAM.
+std::string getMemoryReport(const LLMEngine &Engine);
+
+/// Restrict the calling thread, and the threads it starts from now on, to
+/// the CPUs listed in \p Spec ("0-7,16-23").
+bool setCPUAffinity(const std::string &Spec, std::string &Error);
+
+/// A sampler chain implementing \p Options, restricted to the GBNF
+/// \p Grammar if it is not empty. Free it with llama_sampler_free. Returns
+/// nullptr if the grammar is invalid.
+llama_sampler *createSampler(const SamplingOptions &Options,
+                             const llama_vocab *Vocab,
+                             const std::string &Grammar = "");
+
+/// The token limit of \p Request, with the default applied.
+int getMaxNewTokens(const LLMRequest &Request);
+
+/// The text of \p Token, or false if it cannot be converted.
+bool tokenToPiece(const llama_vocab *Vocab, llama_token Token,
+                  std::string &Piece);
+
+} // end namespace seekbug
 
-// This function will handle prompt creation, model loading, inference, etc.
-std::string runLLM(const std::string &prompt, const std::string &modelPath);
+// This function will handle tokenization, inference, etc. on the already
+// loaded model.
+std::string runLLM(const seekbug::LLMRequest &request,
+                   seekbug::LLMEngine &engine);
+std::string runLLM(const std::string &prompt, seekbug::LLMEngine &engine);
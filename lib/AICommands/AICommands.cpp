@@ -6,6 +6,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "seek-bug/AICommands.h"
+#include "seek-bug/CrashSignature.h"
+#include "seek-bug/MachineContext.h"
+#include "seek-bug/PromptBuilder.h"
+#include "seek-bug/StackEncoder.h"
+#include "seek-bug/VariableCapture.h"
 #include "seek-bug/llm.h"
 
 #include <lldb/API/SBAddress.h>
@@ -36,14 +41,23 @@
 #include <lldb/API/SBTarget.h>
 #include <lldb/API/SBThread.h>
 
+#include "llvm/Support/Format.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace seekbug {
 
@@ -85,8 +99,7 @@ static std::string StopReasonToString(lldb::SBThread &thread) {
   }
 }
 
-static std::string GetSourceSnippet(const lldb::SBFileSpec &fileSpec,
-                                    uint32_t centerLine, int contextLines = 2) {
+static std::string GetFilePath(const lldb::SBFileSpec &fileSpec) {
   // Build the full path from the SBFileSpec
   // (SBFileSpec can separate directory and filename)
   std::string path;
@@ -100,81 +113,274 @@ static std::string GetSourceSnippet(const lldb::SBFileSpec &fileSpec,
   if (fileSpec.GetFilename() && *fileSpec.GetFilename()) {
     path += fileSpec.GetFilename();
   }
+  return path;
+}
 
-  // Attempt to open the file
-  std::ifstream infile(path);
-  if (!infile.is_open()) {
+/// Adds the time from its construction to its destruction to the source
+/// reading time of \p sources.
+class SourceReadTimer {
+  SourceCache &sources;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+public:
+  explicit SourceReadTimer(SourceCache &sources) : sources(sources) {}
+  ~SourceReadTimer() {
+    sources.addReadTime(std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+  }
+};
+
+/// Lines [startLine, endLine] of \p fileSpec, numbered, with \p markedLine
+/// marked by an arrow.
+static std::string FormatSourceLines(SourceCache &sources,
+                                     const lldb::SBFileSpec &fileSpec,
+                                     uint32_t startLine, uint32_t endLine,
+                                     uint32_t markedLine) {
+  SourceReadTimer timer(sources);
+  std::shared_ptr<const SourceFile> file =
+      sources.getFile(GetFilePath(fileSpec));
+  if (!file) {
     return ""; // Couldn’t read the file
   }
 
+  std::ostringstream snippet;
+  endLine = std::min(endLine, file->getNumLines());
+  for (uint32_t currentLine = std::max(1u, startLine);
+       currentLine <= endLine; currentLine++) {
+    llvm::StringRef lineText = file->getLine(currentLine);
+    snippet << (currentLine == markedLine ? "-> " : "   ") << currentLine
+            << ": ";
+    snippet.write(lineText.data(), lineText.size());
+    snippet << "\n";
+  }
+  return snippet.str();
+}
+
+static std::string GetSourceSnippet(SourceCache &sources,
+                                    const lldb::SBFileSpec &fileSpec,
+                                    uint32_t centerLine, int contextLines = 2) {
   // We’ll grab lines in [startLine, endLine], inclusive
   int startLine = std::max(1, (int)centerLine - contextLines);
   int endLine = (int)centerLine + contextLines;
+  return FormatSourceLines(sources, fileSpec, startLine, endLine, centerLine);
+}
 
-  std::ostringstream snippet;
-  std::string lineText;
-  int currentLine = 1;
-
-  // Read until we pass endLine or reach EOF
-  while (std::getline(infile, lineText)) {
-    if (currentLine >= startLine && currentLine <= endLine) {
-      // Mark the “current line” with a pointer or arrow, if you like
-      if (currentLine == (int)centerLine) {
-        snippet << "-> " << currentLine << ": " << lineText << "\n";
-      } else {
-        snippet << "   " << currentLine << ": " << lineText << "\n";
-      }
-    }
-    if (currentLine > endLine) {
-      break;
-    }
-    currentLine++;
-  }
+static std::string GetSourceSnippetRange(SourceCache &sources,
+                                         const lldb::SBFileSpec &fileSpec,
+                                         uint32_t startLine, uint32_t endLine) {
+  return FormatSourceLines(sources, fileSpec, startLine, endLine, startLine);
+}
 
-  return snippet.str();
+// The fixed instructions of every command go first, so that their KV state
+// can be cached and only the debugging context is prefilled per request.
+static const char *const SuggestPreamble =
+    "You are a helpful AI assistant integrated with LLDB. Answer carefully "
+    "and concisely. Focus on control flow. You can do it! And the answer "
+    "should not be too large, use a few sentences. Use up to 5 sentences.\n "
+    "If the question is not related "
+    "to this program or program point, just say that you are here to answer "
+    "questions about this program, and that you cannot think about something "
+    "else. Take a breath, relax and do it!\n\n"
+    "You have the following debugging context:\n\n";
+
+static const char *const CrashElaboratePreamble =
+    "You are a helpful AI assistant integrated with LLDB for crash analysis. "
+    "You are expert for C/C++ as well. Analyze the crash in detail and "
+    "provide potential causes and debugging suggestions.\n\n";
+
+static const char *const ExplainPreamble =
+    "You are an expert C/C++ code analyst. Please explain what the following "
+    "code does, and highlight any potential issues. Answer carefully and "
+    "concisely. You can do it! And the answer should not be too large, use a "
+    "few sentences. Use up to 5 sentences. You can do it!\n\n";
+
+static const char *const StackSummaryPreamble =
+    "You are an expert debugger assistant. You are C/C++ expert as well. "
+    "Provide a summary of the following call stack, including potential "
+    "causes for errors and suggestions for further investigation. Answer "
+    "carefully and concisely. You can do it! And the answer should not be too "
+    "large, use a few sentences. Use up to 5 sentences.\n\n";
+
+static const char *const FixPreamble =
+    "You are an expert C/C++ engineer. The following code snippet may contain "
+    "a bug. Please suggest a fix along with an explanation. Answer carefully "
+    "and concisely. You can do it! And the answer should not be too large, "
+    "use a few sentences. Use up to 5 sentences.\n\n";
+
+/// Most tokens a `--json` answer may have. The grammar bounds every field,
+/// so that a complete answer fits.
+static constexpr int JsonAnswerTokens = 512;
+
+static const char *const JsonAnswerInstructions =
+    "Answer with a single JSON object only, with the fields \"cause\" (the "
+    "most likely cause, in one or two sentences), \"evidence_frames\" (the "
+    "numbers of the stack frames that show it), \"suggested_fix\" (in one or "
+    "two sentences) and \"confidence\" (\"low\", \"medium\" or "
+    "\"high\").\n\n";
+
+/// GBNF grammar of `--json` answers. Every string and list is bounded, so
+/// the answer cannot run away and always closes.
+static const char *const CrashReportGrammar = R"gbnf(
+root       ::= "{" ws "\"cause\":" ws string "," ws
+               "\"evidence_frames\":" ws frames "," ws
+               "\"suggested_fix\":" ws string "," ws
+               "\"confidence\":" ws confidence ws "}"
+frames     ::= "[" ( frame ( "," ws frame ){0,7} )? "]"
+frame      ::= [0-9]{1,4}
+confidence ::= "\"low\"" | "\"medium\"" | "\"high\""
+string     ::= "\"" char{1,200} "\""
+char       ::= [^"\\\x00-\x1F] | "\\" ["\\/nt]
+ws         ::= [ \n]?
+)gbnf";
+
+/// Make \p request answer with a JSON crash report instead of prose. The
+/// instructions go into the preamble, so that their KV state is cached too.
+static void RequestJsonAnswer(LLMRequest &request) {
+  request.Preamble += JsonAnswerInstructions;
+  request.Grammar = CrashReportGrammar;
+  request.MaxNewTokens = JsonAnswerTokens;
 }
 
-static std::string GetSourceSnippetRange(const lldb::SBFileSpec &fileSpec,
-                                         uint32_t startLine, uint32_t endLine) {
-  std::string path;
-  if (fileSpec.GetDirectory() && *fileSpec.GetDirectory()) {
-    path = fileSpec.GetDirectory();
-    if (!path.empty() && path.back() != '/' && path.back() != '\\') {
-      path.push_back('/');
+std::vector<StackFrameInfo> collectStackFrames(lldb::SBThread &thread) {
+  std::vector<StackFrameInfo> frames;
+  int numFrames = thread.GetNumFrames();
+  for (int i = 0; i < numFrames; i++) {
+    lldb::SBFrame currFrame = thread.GetFrameAtIndex(i);
+    if (!currFrame.IsValid())
+      continue;
+
+    StackFrameInfo info;
+    info.Index = i;
+    info.Function =
+        currFrame.GetFunctionName() ? currFrame.GetFunctionName() : "??";
+    lldb::SBLineEntry lineEntry = currFrame.GetLineEntry();
+    if (lineEntry.IsValid()) {
+      info.Path = GetFilePath(lineEntry.GetFileSpec());
+      info.Line = lineEntry.GetLine();
     }
+    frames.push_back(std::move(info));
   }
-  if (fileSpec.GetFilename() && *fileSpec.GetFilename()) {
-    path += fileSpec.GetFilename();
-  }
-  std::ifstream infile(path);
-  if (!infile.is_open()) {
-    return ""; // Couldn’t read the file
-  }
+  return frames;
+}
 
-  std::ostringstream snippet;
-  std::string lineText;
-  int currentLine = 1;
-  while (std::getline(infile, lineText)) {
-    if (currentLine >= (int)startLine && currentLine <= (int)endLine) {
-      // Optionally mark the first line
-      if (currentLine == (int)startLine)
-        snippet << "-> " << currentLine << ": " << lineText << "\n";
-      else
-        snippet << "   " << currentLine << ": " << lineText << "\n";
-    }
-    if (currentLine > (int)endLine)
-      break;
-    currentLine++;
+/// Most tokens of the disassembly and registers that stand in for the
+/// source of a frame without line information.
+static constexpr size_t MachineContextTokens = 160;
+
+/// The disassembly and registers of \p frame if it has no source, for a
+/// budget of \p maxTokens (0 for no budget), or an empty string.
+static std::string DescribeMachineContext(SeekBugContext &context,
+                                          lldb::SBFrame &frame,
+                                          size_t maxTokens = 0) {
+  if (!frame.IsValid() || frame.GetLineEntry().IsValid())
+    return "";
+  size_t allowance = MachineContextTokens;
+  if (maxTokens)
+    allowance = std::min(allowance, maxTokens / 4);
+  return encodeMachineContext(frame, *context.Engine, allowance);
+}
+
+/// \p frames, innermost first, followed by the source around them, within
+/// the prompt token budget left by the preamble and the answer of
+/// \p request. The innermost frame is always kept; outer frames and then
+/// source are dropped when space is short. \p machineContext, if any, stands
+/// in for the innermost frame's source.
+static std::string DescribeFrames(SeekBugContext &context,
+                                  llvm::ArrayRef<StackFrameInfo> frames,
+                                  const LLMRequest &request,
+                                  size_t maxTokens = 0,
+                                  const std::string &machineContext = "") {
+  // Deep recursion repeats the same frames thousands of times; encode the
+  // stack compactly before fitting it into the budget.
+  EncodedStack stack;
+  {
+    SourceReadTimer timer(*context.Sources);
+    stack = encodeStack(*context.Sources, frames);
   }
-  return snippet.str();
+  size_t budget =
+      getPromptTokenBudget(*context.Engine, request.Preamble,
+                           context.PromptTokenBudget, getMaxNewTokens(request));
+  if (maxTokens)
+    budget = std::min(budget, maxTokens);
+  PromptBuilder builder(*context.Engine, budget);
+  for (size_t i = 0; i < stack.Frames.size(); i++)
+    builder.add(i == 0 ? PromptBuilder::Priority::CrashingFrame
+                       : PromptBuilder::Priority::OuterFrames,
+                stack.Frames[i]);
+  if (!machineContext.empty())
+    builder.add(PromptBuilder::Priority::CrashingFrame, "\n" + machineContext,
+                /* Shrinkable = */ true);
+  if (!stack.Sources.empty())
+    builder.add(PromptBuilder::Priority::Snippets, "\nSource:\n");
+  for (size_t i = 0; i < stack.Sources.size(); i++)
+    builder.add((int)i == stack.CrashingSource
+                    ? PromptBuilder::Priority::CrashingFrame
+                    : PromptBuilder::Priority::Snippets,
+                stack.Sources[i], /* Shrinkable = */ true);
+  return builder.build();
 }
 
-std::string createRichPrompt(lldb::SBDebugger &debugger,
-                             const std::string &userQuery) {
+/// The call stack of \p thread as described by DescribeFrames, with the
+/// machine context of the innermost frame if it has no source.
+static std::string DescribeCallStack(SeekBugContext &context,
+                                     lldb::SBThread &thread,
+                                     const LLMRequest &request,
+                                     size_t maxTokens = 0) {
+  lldb::SBFrame innermost = thread.GetFrameAtIndex(0);
+  return DescribeFrames(context, collectStackFrames(thread), request,
+                        maxTokens,
+                        DescribeMachineContext(context, innermost, maxTokens));
+}
+
+LLMRequest createCrashElaboratePrompt(SeekBugContext &context,
+                                      llvm::ArrayRef<StackFrameInfo> frames,
+                                      const std::string &machineContext,
+                                      LLMRequest request) {
+  request.Preamble = CrashElaboratePreamble + request.Preamble;
+
+  // Build the prompt for the LLM.
   std::ostringstream promptStream;
+  promptStream << "Program crashed with Call Stack:\n"
+               << DescribeFrames(context, frames, request,
+                                 /* maxTokens = */ 0, machineContext)
+               << "\n";
+  request.Prompt = promptStream.str();
+  return request;
+}
+
+/// How many tokens the per-thread verdicts of `--all-threads` may have.
+static constexpr int ThreadVerdictTokens = 128;
+
+static const char *const ThreadVerdictPreamble =
+    "You are an expert C/C++ crash analyst integrated with LLDB. You get the "
+    "call stack of one thread of a crashed process. In at most two sentences, "
+    "say what the thread was doing and whether it is likely involved in the "
+    "crash.\n\n";
+
+static const char *const AllThreadsSummaryPreamble =
+    "You are an expert C/C++ crash analyst integrated with LLDB. You get the "
+    "call stack of the crashing thread and a short verdict for the other "
+    "interesting threads of the process. Explain the most likely cause of the "
+    "crash, including any interaction between the threads, and suggest how to "
+    "debug it further. Use up to 5 sentences.\n\n";
+
+/// The arguments and locals of \p frame, as much of them as the limits of
+/// \p variables allow.
+static std::string DescribeVariables(VariableCapture &variables,
+                                     lldb::SBFrame &frame) {
+  VariableSnapshot snapshot = variables.capture(frame);
+  if (snapshot.Variables.empty())
+    return "";
+  return "Variables in scope:\n" + snapshot.format();
+}
 
-  promptStream << "You are a helpful AI assistant integrated with LLDB. "
-               << "You have the following debugging context:\n\n";
+/// The program, process, thread and frame of the current stop, the source
+/// around it, and the variables in scope.
+static std::string DescribeStop(SeekBugContext &context,
+                                lldb::SBDebugger &debugger) {
+  std::ostringstream promptStream;
 
   lldb::SBTarget target = debugger.GetSelectedTarget();
   if (target.IsValid()) {
@@ -223,83 +429,567 @@ std::string createRichPrompt(lldb::SBDebugger &debugger,
 
             // Optionally gather a snippet of the source code around this line
             std::string snippet =
-                GetSourceSnippet(fileSpec, line, /* contextLines = */ 2);
+                GetSourceSnippet(*context.Sources, fileSpec, line,
+                                 /* contextLines = */ 2);
             if (!snippet.empty()) {
               promptStream << "Source snippet around line " << line << ":\n";
               promptStream << snippet << "\n";
             }
+          } else {
+            promptStream << DescribeMachineContext(context, frame);
           }
+          promptStream << DescribeVariables(*context.Variables, frame);
         }
       }
     }
   }
 
-  promptStream
-      << "\n---\n"
-      << "User Question: " << userQuery << "\n"
-      << "Answer carefully and concisely. Focus on control flow. You "
-         "can do it! And the answer should not be too large, use a "
-         "few sentences. Do not print </think> and things after it. "
-         "Use up to 5 sentences.\n If the question is not related to "
-         "this program or program point, just say that you are here "
-         "to answer questions about this program, and that you cannot "
-         "think about something else. Do not print duplicated answers. Take a "
-         "breath, relax and do it!\n\n"
-         "Print answer only, DO NOT print thinking process. Print answer only! "
-         "Do not print </think> and all things before it!\n\n";
-
   return promptStream.str();
 }
 
+/// Everything `ai suggest` tells the model about the current stop, up to
+/// (but not including) the user's question. This part is known as soon as the
+/// process stops, so it can be prefilled speculatively.
+static LLMRequest createStopContextPrompt(SeekBugContext &context,
+                                          lldb::SBDebugger &debugger) {
+  LLMRequest request;
+  request.Preamble = SuggestPreamble;
+  request.Prompt = DescribeStop(context, debugger) + "\n---\n" +
+                   "User Question:";
+  return request;
+}
+
+LLMRequest createRichPrompt(SeekBugContext &context, lldb::SBDebugger &debugger,
+                            const std::string &userQuery) {
+  LLMRequest request = createStopContextPrompt(context, debugger);
+  request.Prompt += " " + userQuery + "\n";
+  return request;
+}
+
+/// The prompt of `ai fix` for \p frame.
+static LLMRequest createFixPrompt(SourceCache &sources,
+                                  VariableCapture &variables,
+                                  lldb::SBFrame &frame) {
+  lldb::SBLineEntry lineEntry = frame.GetLineEntry();
+  lldb::SBFileSpec fileSpec = lineEntry.GetFileSpec();
+  uint32_t line = lineEntry.GetLine();
+
+  // Retrieve a snippet with 5 lines of context.
+  std::string snippet = GetSourceSnippet(sources, fileSpec, line, 5);
+
+  // Build prompt asking for a suggested fix.
+  std::ostringstream promptStream;
+  promptStream << "File: " << fileSpec.GetFilename() << " at line " << line
+               << "\n";
+  promptStream << snippet << "\n";
+  promptStream << DescribeVariables(variables, frame);
+
+  LLMRequest request;
+  request.Preamble = FixPreamble;
+  request.Prompt = promptStream.str();
+  return request;
+}
+
+/// Options accepted by every `ai` subcommand in front of its own arguments.
+struct CommonOptions {
+  /// When the command started, and how much time had been spent reading
+  /// sources by then, for `ai stats`.
+  std::chrono::steady_clock::time_point Start =
+      std::chrono::steady_clock::now();
+  double SourceTimeAtStart = 0;
+  /// Queue the request on the background worker and return a job id.
+  bool Async = false;
+  /// Ignore cached answers and ask the model again.
+  bool NoCache = false;
+  /// Most tokens of the answer, or 0 for the session's default.
+  unsigned MaxTokens = 0;
+  /// Milliseconds after the start of the command to stop generating, or 0
+  /// for no limit. The session's default unless --deadline is given.
+  unsigned DeadlineMs = 0;
+  /// Extra strings that end the answer.
+  std::vector<std::string> Stop;
+};
+
+/// Split \p command into the leading common options and the remaining
+/// arguments. Option parsing stops at the first non-option or at `--`.
+static bool ParseCommonOptions(SeekBugContext &context, char **command,
+                               CommonOptions &options,
+                               std::vector<std::string> &args,
+                               lldb::SBCommandReturnObject &result) {
+  options.SourceTimeAtStart = context.Sources->getReadTime();
+  options.DeadlineMs = context.DeadlineMs;
+  bool parsingOptions = true;
+  for (int i = 0; command && command[i] != nullptr; i++) {
+    std::string arg = command[i];
+    if (parsingOptions) {
+      if (arg == "--") {
+        parsingOptions = false;
+        continue;
+      }
+      if (arg == "--async") {
+        options.Async = true;
+        continue;
+      }
+      if (arg == "--no-cache") {
+        options.NoCache = true;
+        continue;
+      }
+      if (arg == "--max-tokens" || arg == "--deadline" || arg == "--stop") {
+        if (command[i + 1] == nullptr) {
+          result.Printf("error: %s needs a value\n", arg.c_str());
+          result.SetStatus(lldb::eReturnStatusFailed);
+          return false;
+        }
+        std::string value = command[++i];
+        if (arg == "--stop") {
+          options.Stop.push_back(value);
+          continue;
+        }
+        unsigned &number =
+            arg == "--deadline" ? options.DeadlineMs : options.MaxTokens;
+        if (llvm::StringRef(value).getAsInteger(10, number) || number == 0) {
+          result.Printf("error: invalid %s value '%s'\n", arg.c_str(),
+                        value.c_str());
+          result.SetStatus(lldb::eReturnStatusFailed);
+          return false;
+        }
+        continue;
+      }
+    }
+    parsingOptions = false;
+    args.push_back(arg);
+  }
+  return true;
+}
+
+/// Write \p text to the debugger's output outside of any command, e.g. when
+/// a background job finishes.
+static void PrintAsync(lldb::SBFile &out, const std::string &text) {
+  size_t written = 0;
+  out.Write(reinterpret_cast<const uint8_t *>(text.data()), text.size(),
+            written);
+  out.Flush();
+}
+
+/// Errors, cancelled and truncated answers must not be served from the
+/// cache later.
+static bool IsCacheable(const std::string &answer) {
+  return !answer.empty() && answer.rfind("[Error", 0) != 0 &&
+         answer.find("[cancelled]") == std::string::npos &&
+         answer.find("[truncated") == std::string::npos;
+}
+
+/// While alive, turns Ctrl-C into a cancellation. LLDB records Ctrl-C as an
+/// interrupt request on the debugger, which nothing would look at while the
+/// model is generating; this polls it and raises the flag runLLM() checks
+/// between decode steps and prefill chunks.
+class InterruptWatcher {
+  std::mutex mutex;
+  std::condition_variable wakeUp;
+  bool done = false;
+  std::atomic<bool> interrupted{false};
+  std::thread thread;
+
+public:
+  explicit InterruptWatcher(lldb::SBDebugger debugger)
+      : thread([this, debugger]() mutable {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!wakeUp.wait_for(lock, std::chrono::milliseconds(50),
+                                  [this] { return done; })) {
+            if (debugger.InterruptRequested()) {
+              interrupted = true;
+              return;
+            }
+          }
+        }) {}
+  ~InterruptWatcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    wakeUp.notify_one();
+    thread.join();
+  }
+
+  const std::atomic<bool> *getFlag() const { return &interrupted; }
+};
+
+/// Set the most tokens of the answer to \p request: --max-tokens, else what
+/// the request asks for, else the session's default. Prompts are fitted to
+/// the answer length, so commands that budget their prompt call this before
+/// building it; applying it again is harmless.
+static void ApplyAnswerLength(SeekBugContext &context,
+                              const CommonOptions &options,
+                              LLMRequest &request) {
+  if (options.MaxTokens)
+    // Cutting a grammar-constrained answer short would leave it invalid.
+    request.MaxNewTokens =
+        request.Grammar.empty()
+            ? (int)options.MaxTokens
+            : std::max<int>(options.MaxTokens, request.MaxNewTokens);
+  else if (!request.MaxNewTokens)
+    request.MaxNewTokens = context.MaxNewTokens;
+}
+
+/// Run \p request on the session's model and stream the answer to the
+/// console as it is generated. The return object still ends up with the
+/// complete text, so scripted callers can read it from there. With --async
+/// the request is queued instead and the answer is printed when it is ready.
+/// Answers are cached, so asking the same thing again is instant.
+/// \p onAnswer, if set, gets every complete answer that is worth keeping.
+/// \p generate, if set, answers instead of runLLM(). Its answers depend on
+/// more than the request, so they are not cached.
+static bool
+RunModel(SeekBugContext &context, lldb::SBDebugger &debugger,
+         const CommonOptions &options, const std::string &description,
+         LLMRequest &request, lldb::SBCommandReturnObject &result,
+         std::function<void(const std::string &)> onAnswer = nullptr,
+         std::function<std::string(const LLMRequest &)> generate = nullptr) {
+  lldb::SBFile out = debugger.GetOutputFile();
+
+  // Session-wide sampling settings, then the ones of this invocation. They
+  // are part of the cache key, so apply them first.
+  request.Sampling = context.Sampling;
+  ApplyAnswerLength(context, options, request);
+  // Not part of the cache key: only complete answers are cached.
+  if (options.DeadlineMs)
+    request.Deadline =
+        options.Start + std::chrono::milliseconds(options.DeadlineMs);
+  // Cutting a grammar-constrained answer short would leave it invalid.
+  if (request.Grammar.empty()) {
+    request.Stop.insert(request.Stop.end(), context.Stop.begin(),
+                        context.Stop.end());
+    request.Stop.insert(request.Stop.end(), options.Stop.begin(),
+                        options.Stop.end());
+  }
+
+  // Everything up to here gathered the debugging context.
+  auto millisecondsSince = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+  auto stats = std::make_shared<InvocationStats>();
+  stats->Command = description;
+  stats->ContextTime = millisecondsSince(options.Start);
+  stats->SourceTime =
+      context.Sources->getReadTime() - options.SourceTimeAtStart;
+  std::shared_ptr<Telemetry> telemetry = context.Stats;
+  auto record = [telemetry, stats, millisecondsSince,
+                 start = options.Start] {
+    stats->TotalTime = millisecondsSince(start);
+    stats->Timestamp = std::time(nullptr);
+    telemetry->record(*stats);
+  };
+
+  std::shared_ptr<ResponseCache> cache = context.Responses;
+  uint64_t cacheKey = ResponseCache::computeKey(request, *context.Engine);
+  std::string cached;
+  if (!options.NoCache && !generate && cache->lookup(cacheKey, cached)) {
+    stats->FromCache = true;
+    record();
+    if (onAnswer)
+      onAnswer(cached);
+    result.Printf("%s\n", cached.c_str());
+    llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+        << "[answer from cache]\n";
+    result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+    return true;
+  }
+
+  if (options.Async) {
+    // The stats outlive this command; the job fills them in and records
+    // them when it is done.
+    request.Stats = &stats->Generation;
+    unsigned id = context.Jobs->submit(
+        description, request,
+        [out, cache, cacheKey, onAnswer,
+         record](unsigned id, const std::string &description,
+                 const std::string &answer, bool waited) mutable {
+          record();
+          if (IsCacheable(answer)) {
+            cache->insert(cacheKey, answer);
+            if (onAnswer)
+              onAnswer(answer);
+          }
+          // `ai wait` prints the answer itself.
+          if (!waited)
+            PrintAsync(out, "\n[ai job " + std::to_string(id) + "] " +
+                                description + ":\n" + answer + "\n");
+        });
+    result.Printf("Job %u queued. Use 'ai wait %u' to block on it.\n", id,
+                  id);
+    result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+    return true;
+  }
+
+  llvm::WithColor(llvm::outs(), llvm::HighlightColor::String)
+      << "DeepSeek is thinking...\n";
+  result.SetImmediateOutputFile(out);
+
+  auto start = std::chrono::steady_clock::now();
+  bool streamed = false;
+  double timeToFirstToken = 0;
+  request.OnToken = [&](const std::string &piece) {
+    if (!streamed) {
+      streamed = true;
+      timeToFirstToken = millisecondsSince(start);
+    }
+    result.Printf("%s", piece.c_str());
+    out.Flush();
+  };
+
+  request.Stats = &stats->Generation;
+  std::string response;
+  {
+    InterruptWatcher watcher(debugger);
+    request.Cancel = watcher.getFlag();
+    response = generate ? generate(request) : runLLM(request, *context.Engine);
+  }
+  request.OnToken = nullptr;
+  request.Stats = nullptr;
+  request.Cancel = nullptr;
+  stats->FirstTokenTime = timeToFirstToken;
+  record();
+  if (IsCacheable(response)) {
+    if (!generate)
+      cache->insert(cacheKey, response);
+    if (onAnswer)
+      onAnswer(response);
+  }
+
+  // Errors are reported before any token is produced.
+  if (!streamed)
+    result.Printf("%s", response.c_str());
+  result.Printf("\n");
+  out.Flush();
+
+  if (streamed)
+    llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+        << "[first token after " << llvm::format("%.0f", timeToFirstToken)
+        << " ms]\n";
+
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
 bool AISuggestCommand::DoExecute(lldb::SBDebugger debugger, char **command,
                                  lldb::SBCommandReturnObject &result) {
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+
   std::ostringstream oss;
-  if (command) {
-    bool first = true;
-    for (int i = 0; command[i] != nullptr; i++) {
-      if (!first)
-        oss << " ";
-      oss << command[i];
-      first = false;
-    }
+  bool first = true;
+  for (const std::string &arg : args) {
+    if (!first)
+      oss << " ";
+    oss << arg;
+    first = false;
   }
 
   std::string userInput = oss.str();
   if (userInput.empty()) {
     result.SetStatus(lldb::eReturnStatusFailed);
-    result.Printf("Usage: ai suggest <your question or context>\n");
+    result.Printf("Usage: ai suggest [--async] [--no-cache] <your question or context>\n");
     return false;
   }
 
-  // Hardcode or configure the model path somewhere:
-  // You could read from environment variable or a config file:
-  // std::string modelPath = "/Users/djtodorovic/projects/SeekBug/"
-  //                         "DeepSeek-R1-Distill-Llama-8B-Q8_0.gguf";
-  std::string prompt = createRichPrompt(debugger, userInput);
-  std::string response = runLLM(prompt, context.DeepSeekLLMPath);
+  LLMRequest request = createRichPrompt(context, debugger, userInput);
+  return RunModel(context, debugger, options, "suggest " + userInput, request,
+                  result);
+}
 
-  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
-  // result.Printf("[AI Suggestion] You asked: %s\n", userInput.c_str());
-  // result.Printf("[AI Suggestion] prompt: %s\n", prompt.c_str());
-  result.Printf("%s\n", response.c_str());
+/// Identity of the call stack of \p thread, to group threads that are
+/// doing the same thing, like the idle workers of a pool.
+static std::string GetStackKey(lldb::SBThread &thread) {
+  std::string key;
+  int numFrames = thread.GetNumFrames();
+  for (int i = 0; i < numFrames; i++) {
+    lldb::SBFrame frame = thread.GetFrameAtIndex(i);
+    const char *name = frame.GetFunctionName();
+    key += name ? name : "??";
+    key += ":" + std::to_string(frame.GetLineEntry().GetLine()) + "\n";
+  }
+  return key;
+}
 
-  return true;
+/// `ai crash-elaborate --all-threads`: a short verdict for every distinct
+/// thread of the crashed \p process, all decoded together in one batch,
+/// followed by a summary of the crash.
+static bool ElaborateAllThreads(SeekBugContext &context,
+                                lldb::SBDebugger &debugger,
+                                const CommonOptions &options,
+                                const std::string &coreFilePath,
+                                lldb::SBProcess &process, bool json,
+                                lldb::SBCommandReturnObject &result) {
+  struct ThreadGroup {
+    lldb::SBThread Thread;
+    std::vector<uint32_t> IndexIDs;
+  };
+
+  // Threads with the same stack are analyzed once. The crashing thread comes
+  // first, then the other threads that stopped for a reason.
+  std::vector<ThreadGroup> groups;
+  std::vector<std::string> keys;
+  lldb::SBThread selected = process.GetSelectedThread();
+  std::vector<lldb::SBThread> threads;
+  if (selected.IsValid())
+    threads.push_back(selected);
+  for (uint32_t i = 0; i < process.GetNumThreads(); i++) {
+    lldb::SBThread thread = process.GetThreadAtIndex(i);
+    if (thread.IsValid() && thread.GetThreadID() != selected.GetThreadID())
+      threads.push_back(thread);
+  }
+  std::stable_partition(threads.begin() + (selected.IsValid() ? 1 : 0),
+                        threads.end(), [](lldb::SBThread &thread) {
+                          return thread.GetStopReason() !=
+                                 lldb::eStopReasonNone;
+                        });
+  for (lldb::SBThread &thread : threads) {
+    std::string key = GetStackKey(thread);
+    auto it = std::find(keys.begin(), keys.end(), key);
+    if (it != keys.end()) {
+      groups[it - keys.begin()].IndexIDs.push_back(thread.GetIndexID());
+      continue;
+    }
+    keys.push_back(key);
+    groups.push_back({thread, {thread.GetIndexID()}});
+  }
+  if (groups.empty()) {
+    result.Printf("No valid thread in the loaded core file.\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  // All verdicts are decoded side by side, so the threads share the space.
+  size_t numOmitted = 0;
+  if (groups.size() > LLMEngine::MaxParallelSequences) {
+    numOmitted = groups.size() - LLMEngine::MaxParallelSequences;
+    groups.resize(LLMEngine::MaxParallelSequences);
+  }
+  LLMRequest verdictRequest;
+  verdictRequest.Preamble = ThreadVerdictPreamble;
+  verdictRequest.MaxNewTokens = ThreadVerdictTokens;
+  // The summary repeats the crashing thread's prompt and all verdicts.
+  LLMRequest request;
+  request.Preamble = AllThreadsSummaryPreamble;
+  if (json)
+    RequestJsonAnswer(request);
+  ApplyAnswerLength(context, options, request);
+  size_t available = std::min(
+      getPromptTokenBudget(*context.Engine, verdictRequest.Preamble, 0,
+                           ThreadVerdictTokens),
+      getPromptTokenBudget(*context.Engine, request.Preamble, 0,
+                           getMaxNewTokens(request)));
+  size_t perThread = available / groups.size();
+  perThread = perThread > ThreadVerdictTokens ? perThread - ThreadVerdictTokens
+                                              : 1;
+
+  std::vector<std::string> prompts;
+  std::vector<std::string> labels;
+  for (ThreadGroup &group : groups) {
+    std::ostringstream label;
+    label << "Thread #" << group.IndexIDs.front();
+    if (group.IndexIDs.size() > 1)
+      label << " (and " << group.IndexIDs.size() - 1
+            << " more with the same stack)";
+    labels.push_back(label.str());
+
+    std::ostringstream promptStream;
+    promptStream << labels.back() << ", ID=" << group.Thread.GetThreadID()
+                 << ", Name="
+                 << (group.Thread.GetName() ? group.Thread.GetName() : "")
+                 << ", StopReason=" << StopReasonToString(group.Thread)
+                 << "\nCall stack:\n"
+                 << DescribeCallStack(context, group.Thread, verdictRequest,
+                                      perThread)
+                 << "\n";
+    prompts.push_back(promptStream.str());
+  }
+
+  // Everything below goes straight to the console, in order with the
+  // streamed summary.
+  result.SetImmediateOutputFile(debugger.GetOutputFile());
+  llvm::WithColor(llvm::outs(), llvm::HighlightColor::String)
+      << "DeepSeek is looking at " << groups.size() << " threads...\n";
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::string> verdicts;
+  std::string error;
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (options.DeadlineMs)
+    deadline = options.Start + std::chrono::milliseconds(options.DeadlineMs);
+  {
+    std::lock_guard<std::mutex> lock(context.Engine->getMutex());
+    InterruptWatcher watcher(debugger);
+    if (!context.Engine->generateBatch(verdictRequest.Preamble, prompts,
+                                       ThreadVerdictTokens, context.Sampling,
+                                       verdicts, watcher.getFlag(), deadline,
+                                       error)) {
+      result.Printf("%s\n", error.c_str());
+      result.SetStatus(lldb::eReturnStatusFailed);
+      return false;
+    }
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::ostringstream summaryStream;
+  summaryStream << "Crashing thread:\n" << prompts.front() << "Verdicts:\n";
+  for (size_t i = 0; i < groups.size(); i++) {
+    result.Printf("%s: %s\n", labels[i].c_str(), verdicts[i].c_str());
+    summaryStream << "- " << labels[i] << ": " << verdicts[i] << "\n";
+  }
+  if (numOmitted) {
+    result.Printf("(%zu more distinct threads not analyzed)\n", numOmitted);
+    summaryStream << "(" << numOmitted
+                  << " more distinct threads not analyzed)\n";
+  }
+  llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+      << "[" << groups.size() << " verdicts in "
+      << llvm::format("%.1f", elapsed) << " s]\n";
+
+  request.Prompt = summaryStream.str();
+  return RunModel(context, debugger, options,
+                  std::string("crash-elaborate --all-threads ") +
+                      (json ? "--json " : "") + coreFilePath,
+                  request, result);
 }
 
 bool AICrashElaborateCommand::DoExecute(lldb::SBDebugger debugger,
                                         char **command,
                                         lldb::SBCommandReturnObject &result) {
-  int argCount = 0;
-  for (int i = 0; command[i] != nullptr; ++i) {
-    argCount++;
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+  bool allThreads = false;
+  bool refresh = false;
+  bool json = false;
+  while (!args.empty() && (args[0] == "--all-threads" ||
+                           args[0] == "--refresh" || args[0] == "--json")) {
+    if (args[0] == "--all-threads")
+      allThreads = true;
+    else if (args[0] == "--json")
+      json = true;
+    else
+      refresh = true;
+    args.erase(args.begin());
   }
-  if (argCount != 1) {
-    result.Printf("Usage: ai crash-elaborate <path to corefile>\n");
+  // A cached answer would only repeat the analysis being refreshed.
+  if (refresh)
+    options.NoCache = true;
+  if (args.size() != 1) {
+    result.Printf("Usage: ai crash-elaborate [--async] [--no-cache] "
+                  "[--all-threads] [--refresh] [--json] <path to corefile>\n");
     result.SetStatus(lldb::eReturnStatusFailed);
     return false;
   }
 
-  std::string coreFilePath = command[0];
+  std::string coreFilePath = args[0];
   // Retrieve the current target.
   lldb::SBTarget target = debugger.GetSelectedTarget();
   if (!target.IsValid()) {
@@ -316,6 +1006,10 @@ bool AICrashElaborateCommand::DoExecute(lldb::SBDebugger debugger,
     return false;
   }
 
+  if (allThreads)
+    return ElaborateAllThreads(context, debugger, options, coreFilePath,
+                               process, json, result);
+
   // Get the selected thread from the loaded process.
   lldb::SBThread thread = process.GetSelectedThread();
   if (!thread.IsValid()) {
@@ -324,67 +1018,45 @@ bool AICrashElaborateCommand::DoExecute(lldb::SBDebugger debugger,
     return false;
   }
 
-  // TODO: This takes more tokens in prompt!
-  // Gather register information from the first frame.
-  // std::ostringstream registersStream;
-  // lldb::SBFrame frame = thread.GetFrameAtIndex(0);
-  // if (frame.IsValid()) {
-  //   lldb::SBValueList regGroups = frame.GetRegisters();
-  //   for (uint32_t i = 0; i < regGroups.GetSize(); i++) {
-  //     lldb::SBValue regSet = regGroups.GetValueAtIndex(i);
-  //     registersStream << "Register set: " << regSet.GetName() << "\n";
-  //     for (uint32_t j = 0; j < regSet.GetNumChildren(); j++) {
-  //       lldb::SBValue reg = regSet.GetChildAtIndex(j);
-  //       registersStream << "  " << reg.GetName() << " = "
-  //                       << (reg.GetValue() ? reg.GetValue() : "N/A") <<
-  //                       "\n";
-  //     }
-  //     break;
-  //   }
-  // } else {
-  //   registersStream << "No valid frame available to retrieve registers.\n";
-  // }
-
-  // Gather the call stack information and corresponding source snippets.
-  std::ostringstream callStackStream;
-  int numFrames = thread.GetNumFrames();
-  for (int i = 0; i < numFrames; i++) {
-    lldb::SBFrame currFrame = thread.GetFrameAtIndex(i);
-    if (currFrame.IsValid()) {
-      lldb::SBLineEntry lineEntry = currFrame.GetLineEntry();
-      lldb::SBFileSpec fileSpec = lineEntry.GetFileSpec();
-      uint32_t line = lineEntry.GetLine();
-
-      callStackStream << "#" << i << " " << currFrame.GetFunctionName()
-                      << " at " << fileSpec.GetFilename() << ":" << line
-                      << "\n";
-
-      // Retrieve a snippet of the source around the current line.
-      std::string snippet =
-          GetSourceSnippet(fileSpec, line, /* contextLines = */ 2);
-      if (!snippet.empty()) {
-        callStackStream << "Source snippet:\n" << snippet << "\n";
-      }
-    }
+  // The same crash in the same build was most likely analyzed before.
+  CrashSignature signature = computeCrashSignature(thread);
+  uint64_t indexKey = signature.getBuildHash();
+  CrashIndex::Entry known;
+  // The index keeps prose analyses; JSON reports are cached by RunModel.
+  if (!refresh && !json &&
+      context.Crashes->recordOccurrence(indexKey, known)) {
+    char firstSeen[32];
+    std::time_t firstSeenTime = known.FirstSeen;
+    std::strftime(firstSeen, sizeof(firstSeen), "%Y-%m-%d",
+                  std::localtime(&firstSeenTime));
+    result.Printf("%s\n", known.Analysis.c_str());
+    llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+        << "[known crash " << signature.getHashString() << ", seen "
+        << known.Count << " times since " << firstSeen
+        << "; use --refresh to analyze it again]\n";
+    result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+    return true;
   }
 
-  // Build the prompt for the LLM.
-  std::ostringstream promptStream;
-  promptStream << "You are a helpful AI assistant integrated with LLDB for "
-                  "crash analysis. You are expert for C/C++ as well.\n";
-  // promptStream << "Registers:\n" << registersStream.str() << "\n";
-  promptStream << "Program crashed with Call Stack:\n"
-               << callStackStream.str() << "\n";
-  promptStream << "---\n\n\n";
-  promptStream << "Analyze the crash in detail and provide potential causes "
-                  "and debugging suggestions.\n";
-
-  std::string prompt = promptStream.str();
-  std::string response = runLLM(prompt, context.DeepSeekLLMPath);
-
-  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
-  result.Printf("%s\n", response.c_str());
-  return true;
+  // Gather the call stack information and corresponding source snippets.
+  lldb::SBFrame innermost = thread.GetFrameAtIndex(0);
+  LLMRequest answer;
+  if (json)
+    RequestJsonAnswer(answer);
+  ApplyAnswerLength(context, options, answer);
+  LLMRequest request = createCrashElaboratePrompt(
+      context, collectStackFrames(thread),
+      DescribeMachineContext(context, innermost), answer);
+  if (json)
+    return RunModel(context, debugger, options,
+                    "crash-elaborate --json " + coreFilePath, request, result);
+  std::shared_ptr<CrashIndex> crashes = context.Crashes;
+  std::string signatureText = signature.Text;
+  return RunModel(context, debugger, options,
+                  "crash-elaborate " + coreFilePath, request, result,
+                  [crashes, indexKey, signatureText](const std::string &answer) {
+                    crashes->store(indexKey, signatureText, answer);
+                  });
 }
 
 //----------------------------------------------------------------------------//
@@ -424,17 +1096,17 @@ bool AIExplainCommand::DoExecute(lldb::SBDebugger debugger, char **command,
   lldb::SBFileSpec fileSpec = lineEntry.GetFileSpec();
 
   // Expect exactly two arguments: start line and end line
-  int argCount = 0;
-  while (command[argCount] != nullptr) {
-    argCount++;
-  }
-  if (argCount != 2) {
-    result.Printf("Usage: ai explain <start line> <end line>\n");
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+  if (args.size() != 2) {
+    result.Printf("Usage: ai explain [--async] [--no-cache] <start line> <end line>\n");
     result.SetStatus(lldb::eReturnStatusFailed);
     return false;
   }
-  uint32_t startLine = std::atoi(command[0]);
-  uint32_t endLine = std::atoi(command[1]);
+  uint32_t startLine = std::atoi(args[0].c_str());
+  uint32_t endLine = std::atoi(args[1].c_str());
   if (startLine == 0 || endLine == 0 || endLine < startLine) {
     result.Printf("Invalid line range provided.\n");
     result.SetStatus(lldb::eReturnStatusFailed);
@@ -442,7 +1114,8 @@ bool AIExplainCommand::DoExecute(lldb::SBDebugger debugger, char **command,
   }
 
   // Get snippet from the specified range.
-  std::string snippet = GetSourceSnippetRange(fileSpec, startLine, endLine);
+  std::string snippet = GetSourceSnippetRange(*context.Sources, fileSpec,
+                                              startLine, endLine);
   if (snippet.empty()) {
     result.Printf("Failed to retrieve code snippet for the given range.\n");
     result.SetStatus(lldb::eReturnStatusFailed);
@@ -451,23 +1124,15 @@ bool AIExplainCommand::DoExecute(lldb::SBDebugger debugger, char **command,
 
   // Build the prompt for the LLM.
   std::ostringstream promptStream;
-  promptStream << "You are an expert C/C++ code analyst. Please explain what "
-                  "the following code does, "
-               << "and highlight any potential issues:\n";
   promptStream << "File: " << fileSpec.GetFilename() << " from line "
                << startLine << " to " << endLine << "\n";
   promptStream << snippet << "\n";
-  promptStream
-      << "\n---\nAnswer carefully and concisely. You can do it! And the answer "
-         "should not be too large, use a few sentences. Do not print </think> "
-         "and things after it. Use up to 5 sentences. You can do it!\n";
-
-  std::string prompt = promptStream.str();
-  std::string response = runLLM(prompt, context.DeepSeekLLMPath);
 
-  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
-  result.Printf("%s\n", response.c_str());
-  return true;
+  LLMRequest request;
+  request.Preamble = ExplainPreamble;
+  request.Prompt = promptStream.str();
+  return RunModel(context, debugger, options,
+                  "explain " + args[0] + " " + args[1], request, result);
 }
 
 //----------------------------------------------------------------------------//
@@ -479,6 +1144,11 @@ AIStackSummaryCommand::AIStackSummaryCommand(SeekBugContext &ctx)
 
 bool AIStackSummaryCommand::DoExecute(lldb::SBDebugger debugger, char **command,
                                       lldb::SBCommandReturnObject &result) {
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+
   // Retrieve the current target, process, and thread.
   lldb::SBTarget target = debugger.GetSelectedTarget();
   if (!target.IsValid()) {
@@ -499,47 +1169,21 @@ bool AIStackSummaryCommand::DoExecute(lldb::SBDebugger debugger, char **command,
     return false;
   }
 
+  LLMRequest request;
+  request.Preamble = StackSummaryPreamble;
+  ApplyAnswerLength(context, options, request);
+
   // Build a call stack string with source snippets.
-  std::ostringstream callStackStream;
-  int numFrames = thread.GetNumFrames();
-  for (int i = 0; i < numFrames; i++) {
-    lldb::SBFrame currFrame = thread.GetFrameAtIndex(i);
-    if (currFrame.IsValid()) {
-      lldb::SBLineEntry lineEntry = currFrame.GetLineEntry();
-      lldb::SBFileSpec fileSpec = lineEntry.GetFileSpec();
-      uint32_t line = lineEntry.GetLine();
-      callStackStream << "#" << i << " " << currFrame.GetFunctionName()
-                      << " at " << fileSpec.GetFilename() << ":" << line
-                      << "\n";
-
-      // Retrieve a snippet with 2 lines of context.
-      std::string snippet = GetSourceSnippet(fileSpec, line, 2);
-      if (!snippet.empty()) {
-        callStackStream << "Snippet:\n" << snippet << "\n";
-      }
-    }
-  }
+  std::string callStack = DescribeCallStack(context, thread, request);
 
   // Build prompt for stack summary.
   std::ostringstream promptStream;
-  promptStream << "You are an expert debugger assistant. You are C/C++ expert "
-                  "as well. Provide a summary of the following call stack, "
-               << "including potential causes for errors and suggestions for "
-                  "further investigation:\n\n";
-  promptStream << callStackStream.str() << "\n";
-  promptStream
-      << "\n---\nAnswer carefully and concisely. You can do it! And the answer "
-         "should not be too large, use a few sentences. Do not print </think> "
-         "and things after it. Use up to 5 sentences.\n";
-
-  std::string prompt = promptStream.str();
+  promptStream << "Call stack:\n" << callStack << "\n";
+  request.Prompt = promptStream.str();
 
   // Run the LLM on the prompt.
-  std::string response = runLLM(prompt, context.DeepSeekLLMPath);
-
-  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
-  result.Printf("%s\n", response.c_str());
-  return true;
+  return RunModel(context, debugger, options, "stack-summary", request,
+                  result);
 }
 
 //----------------------------------------------------------------------------//
@@ -550,6 +1194,22 @@ AIFixCommand::AIFixCommand(SeekBugContext &ctx) : context(ctx) {}
 
 bool AIFixCommand::DoExecute(lldb::SBDebugger debugger, char **command,
                              lldb::SBCommandReturnObject &result) {
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+  bool json = false;
+  while (!args.empty() && args[0] == "--json") {
+    json = true;
+    args.erase(args.begin());
+  }
+  if (!args.empty()) {
+    result.Printf("Usage: ai fix [--async] [--no-cache] [--max-tokens <n>] "
+                  "[--deadline <ms>] [--stop <text>] [--json]\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
   // Retrieve the current frame.
   lldb::SBTarget target = debugger.GetSelectedTarget();
   if (!target.IsValid()) {
@@ -575,38 +1235,629 @@ bool AIFixCommand::DoExecute(lldb::SBDebugger debugger, char **command,
     result.SetStatus(lldb::eReturnStatusFailed);
     return false;
   }
+  LLMRequest request =
+      createFixPrompt(*context.Sources, *context.Variables, frame);
+  if (json)
+    RequestJsonAnswer(request);
+
+  // Run the LLM on the prompt.
+  return RunModel(context, debugger, options, json ? "fix --json" : "fix",
+                  request, result);
+}
+
+//----------------------------------------------------------------------------//
+// AIChatCommand: A conversation that stays in the KV cache.
+//----------------------------------------------------------------------------//
+
+static const char *const ChatPreamble =
+    "You are a helpful AI assistant integrated with LLDB, in a conversation "
+    "with a programmer who is debugging a program. The first message "
+    "describes where the program stopped; later messages say what changed "
+    "when it stops again. Answer carefully and concisely. Use up to 5 "
+    "sentences.\n\n";
+
+/// The stop, location and variables of the selected frame.
+static ChatStopState CaptureChatStop(VariableCapture &variables,
+                                     lldb::SBDebugger &debugger) {
+  ChatStopState state;
+  lldb::SBProcess process = debugger.GetSelectedTarget().GetProcess();
+  if (!process.IsValid())
+    return state;
+  state.StopID = process.GetStopID();
+
+  lldb::SBFrame frame = process.GetSelectedThread().GetSelectedFrame();
+  if (!frame.IsValid())
+    return state;
+  const char *function = frame.GetDisplayFunctionName();
+  state.Function = function ? function : "";
   lldb::SBLineEntry lineEntry = frame.GetLineEntry();
-  lldb::SBFileSpec fileSpec = lineEntry.GetFileSpec();
-  uint32_t line = lineEntry.GetLine();
+  if (lineEntry.IsValid()) {
+    const char *fileName = lineEntry.GetFileSpec().GetFilename();
+    state.Location = std::string(fileName ? fileName : "") + ":" +
+                     std::to_string(lineEntry.GetLine());
+  }
 
-  // Retrieve a snippet with 5 lines of context.
-  std::string snippet = GetSourceSnippet(fileSpec, line, 5);
+  for (CapturedVariable &variable : variables.capture(frame).Variables)
+    state.Variables.emplace_back(std::move(variable.Name),
+                                 std::move(variable.Value));
+  return state;
+}
 
-  // Build prompt asking for a suggested fix.
-  std::ostringstream promptStream;
-  promptStream << "You are an expert C/C++ engineer. The following code "
-                  "snippet may contain a bug. "
-               << "Please suggest a fix along with an explanation:\n";
-  promptStream << "File: " << fileSpec.GetFilename() << " at line " << line
-               << "\n";
-  promptStream << snippet << "\n";
-  promptStream
-      << "\n---\nAnswer carefully and concisely. You can do it! And the answer "
-         "should not be too large, use a few sentences. Do not print </think> "
-         "and things after it. Use up to 5 sentences.\n";
+static std::string FormatChatVariables(
+    const std::vector<std::pair<std::string, std::string>> &variables) {
+  std::string text;
+  for (const auto &variable : variables) {
+    if (!text.empty())
+      text += ", ";
+    text += variable.first + " = " + variable.second;
+  }
+  return text;
+}
 
-  std::string prompt = promptStream.str();
+/// What changed between \p before and \p now: the new location and the
+/// source around it, and the variables that changed. Empty if the process
+/// did not run in between.
+static std::string DescribeChatChanges(SourceCache &sources,
+                                       lldb::SBDebugger &debugger,
+                                       const ChatStopState &before,
+                                       const ChatStopState &now) {
+  if (now.StopID == before.StopID)
+    return "";
+
+  std::ostringstream changes;
+  changes << "The program ran and stopped again";
+  bool moved =
+      now.Function != before.Function || now.Location != before.Location;
+  if (moved) {
+    changes << " in " << now.Function;
+    if (!now.Location.empty())
+      changes << " at " << now.Location;
+  }
+  changes << ".\n";
+
+  if (moved) {
+    lldb::SBLineEntry lineEntry = debugger.GetSelectedTarget()
+                                      .GetProcess()
+                                      .GetSelectedThread()
+                                      .GetSelectedFrame()
+                                      .GetLineEntry();
+    if (lineEntry.IsValid()) {
+      std::string snippet = GetSourceSnippet(
+          sources, lineEntry.GetFileSpec(), lineEntry.GetLine(),
+          /* contextLines = */ 2);
+      if (!snippet.empty())
+        changes << "Source snippet:\n" << snippet << "\n";
+    }
+  }
 
-  // Run the LLM on the prompt.
-  std::string response = runLLM(prompt, context.DeepSeekLLMPath);
+  // In another function, every variable is new.
+  if (now.Function != before.Function) {
+    if (!now.Variables.empty())
+      changes << "Variables: " << FormatChatVariables(now.Variables) << "\n";
+    return changes.str();
+  }
+  std::vector<std::pair<std::string, std::string>> changed;
+  for (const auto &variable : now.Variables) {
+    auto old = std::find_if(
+        before.Variables.begin(), before.Variables.end(),
+        [&](const auto &other) { return other.first == variable.first; });
+    if (old == before.Variables.end())
+      changed.emplace_back(variable.first, variable.second + " (new)");
+    else if (old->second != variable.second)
+      changed.emplace_back(variable.first,
+                           variable.second + " (was " + old->second + ")");
+  }
+  if (changed.empty())
+    changes << "No variable changed.\n";
+  else
+    changes << "Changed variables: " << FormatChatVariables(changed) << "\n";
+  return changes.str();
+}
+
+AIChatCommand::AIChatCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIChatCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                              lldb::SBCommandReturnObject &result) {
+  CommonOptions options;
+  std::vector<std::string> args;
+  if (!ParseCommonOptions(context, command, options, args, result))
+    return false;
+
+  if (args.size() == 1 && args[0] == "--reset") {
+    context.Chat->reset();
+    lastStop = ChatStopState();
+    result.Printf("Chat history cleared.\n");
+    result.SetStatus(lldb::eReturnStatusSuccessFinishNoResult);
+    return true;
+  }
+  if (options.Async) {
+    result.Printf("error: ai chat cannot run in the background\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  std::string message;
+  for (const std::string &arg : args)
+    message += (message.empty() ? "" : " ") + arg;
+  if (message.empty()) {
+    result.Printf("Usage: ai chat [--max-tokens <n>] [--deadline <ms>] "
+                  "[--stop <text>] <message> | ai chat --reset\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  // The first turn describes the stop in full, later ones only what changed
+  // since the previous turn. Should the first turn leave the window, the
+  // full description is given again.
+  ChatStopState now = CaptureChatStop(*context.Variables, debugger);
+  std::string fullContext = "Debugging context:\n" +
+                            DescribeStop(context, debugger) +
+                            "\nQuestion: " + message + "\n";
+
+  LLMRequest request;
+  request.Preamble = ChatPreamble;
+  if (context.Chat->isEmpty()) {
+    request.Prompt = fullContext;
+  } else {
+    std::string changes =
+        DescribeChatChanges(*context.Sources, debugger, lastStop, now);
+    request.Prompt = changes.empty()
+                         ? message + "\n"
+                         : changes + "\nQuestion: " + message + "\n";
+  }
+
+  unsigned evictedBefore = context.Chat->getNumEvictedTurns();
+  std::shared_ptr<ChatSession> chat = context.Chat;
+  bool succeeded = RunModel(
+      context, debugger, options, "chat " + message, request, result,
+      [&](const std::string &) { lastStop = now; },
+      [&](const LLMRequest &turn) { return chat->ask(turn, fullContext); });
+
+  unsigned evicted = chat->getNumEvictedTurns() - evictedBefore;
+  if (evicted)
+    llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+        << "[chat: dropped the " << evicted
+        << (evicted == 1 ? " oldest turn" : " oldest turns")
+        << " to make room]\n";
+  llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+      << "[chat: " << chat->getNumTurns() << " turns, "
+      << chat->getNumTokens() << " of " << chat->getWindowSize()
+      << " tokens]\n";
+  return succeeded;
+}
+
+//----------------------------------------------------------------------------//
+// AIJobsCommand, AIWaitCommand, AICancelCommand: Manage --async jobs.
+//----------------------------------------------------------------------------//
+
+AIJobsCommand::AIJobsCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIJobsCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                              lldb::SBCommandReturnObject &result) {
+  std::vector<JobQueue::JobInfo> jobs = context.Jobs->list();
+  if (jobs.empty()) {
+    result.Printf("No AI jobs.\n");
+  } else {
+    result.Printf("%-5s %-10s %8s  %s\n", "ID", "STATE", "TIME", "COMMAND");
+    for (const JobQueue::JobInfo &job : jobs)
+      result.Printf("%-5u %-10s %7.1fs  %s\n", job.ID,
+                    JobQueue::stateToString(job.State), job.ElapsedSeconds,
+                    job.Description.c_str());
+  }
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+/// Parse the single job id argument of `ai wait` and `ai cancel`.
+static bool ParseJobID(char **command, const char *usage, unsigned &id,
+                       lldb::SBCommandReturnObject &result) {
+  id = 0;
+  if (command && command[0] && !command[1])
+    id = std::strtoul(command[0], nullptr, 10);
+  if (id == 0) {
+    result.Printf("Usage: %s\n", usage);
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+  return true;
+}
+
+AIWaitCommand::AIWaitCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIWaitCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                              lldb::SBCommandReturnObject &result) {
+  unsigned id = 0;
+  if (!ParseJobID(command, "ai wait <job id>", id, result))
+    return false;
+
+  std::string answer;
+  InterruptWatcher watcher(debugger);
+  JobQueue::WaitResult waited =
+      context.Jobs->wait(id, answer, watcher.getFlag());
+  if (waited == JobQueue::WaitResult::NoSuchJob) {
+    result.Printf("No AI job with id %u.\n", id);
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+  if (waited == JobQueue::WaitResult::Interrupted) {
+    result.Printf("Stopped waiting for job %u; its answer is printed when it "
+                  "is done.\n",
+                  id);
+    result.SetStatus(lldb::eReturnStatusSuccessFinishNoResult);
+    return true;
+  }
+  result.Printf("%s\n", answer.c_str());
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+AICancelCommand::AICancelCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AICancelCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                                lldb::SBCommandReturnObject &result) {
+  unsigned id = 0;
+  if (!ParseJobID(command, "ai cancel <job id>", id, result))
+    return false;
+
+  if (!context.Jobs->cancel(id)) {
+    result.Printf("No pending AI job with id %u.\n", id);
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+  result.Printf("Cancelled job %u.\n", id);
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+// AICacheCommand: Inspect or clear the response cache.
+//----------------------------------------------------------------------------//
+
+AICacheCommand::AICacheCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AICacheCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                               lldb::SBCommandReturnObject &result) {
+  std::string action = (command && command[0]) ? command[0] : "stats";
+  if ((command && command[0] && command[1]) ||
+      (action != "stats" && action != "clear")) {
+    result.Printf("Usage: ai cache [stats|clear]\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  if (action == "clear") {
+    context.Responses->clear();
+    result.Printf("Response cache cleared.\n");
+    result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+    return true;
+  }
+
+  ResponseCache::Stats stats = context.Responses->getStats();
+  uint64_t lookups = stats.Hits + stats.Misses;
+  result.Printf("Hits: %llu, misses: %llu (%.0f%% hit rate)\n",
+                (unsigned long long)stats.Hits,
+                (unsigned long long)stats.Misses,
+                lookups ? 100.0 * stats.Hits / lookups : 0.0);
+  result.Printf("In memory: %zu answers, on disk: %llu KiB\n",
+                stats.MemoryEntries,
+                (unsigned long long)(stats.DiskBytes / 1024));
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+// AIStatsCommand: Shows where the time of the AI commands went.
+//----------------------------------------------------------------------------//
 
+AIStatsCommand::AIStatsCommand(SeekBugContext &ctx) : context(ctx) {}
+
+/// How many invocations `ai stats` shows by default.
+static constexpr unsigned DefaultStatsInvocations = 10;
+
+bool AIStatsCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                               lldb::SBCommandReturnObject &result) {
+  unsigned count = DefaultStatsInvocations;
+  if ((command && command[0] && command[1]) ||
+      (command && command[0] &&
+       (llvm::StringRef(command[0]).getAsInteger(10, count) || !count))) {
+    result.Printf("Usage: ai stats [number of invocations]\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  const LLMEngine &engine = context.Stats->getEngine();
+  result.Printf("Model: %s, loaded in %.1f s\n",
+                engine.getModelPath().c_str(), engine.getLoadTime() / 1000);
+
+  std::vector<InvocationStats> recent = context.Stats->getRecent(count);
+  unsigned numInvocations = 0;
+  unsigned numFromCache = 0;
+  InvocationStats totals =
+      context.Stats->getTotals(numInvocations, numFromCache);
+  if (!numInvocations) {
+    result.Printf("No AI command run yet.\n");
+    result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+    return true;
+  }
+
+  result.Printf("Last %zu of %u invocations (times in ms):\n", recent.size(),
+                numInvocations);
+  result.Printf("  %-28s %8s %8s %8s %8s %8s %8s %8s %11s\n", "command",
+                "context", "source", "tokenize", "prefill", "decode",
+                "first", "total", "tokens");
+  for (const InvocationStats &stats : recent) {
+    std::string command = stats.Command.substr(0, 28);
+    if (stats.FromCache) {
+      result.Printf("  %-28s %8.0f %8.0f %8s %8s %8s %8s %8.0f %11s\n",
+                    command.c_str(), stats.ContextTime, stats.SourceTime, "-",
+                    "-", "-", "-", stats.TotalTime, "(cached)");
+      continue;
+    }
+    const GenerationStats &generation = stats.Generation;
+    std::string tokens = std::to_string(generation.PromptTokens) + "/" +
+                         std::to_string(generation.GeneratedTokens);
+    result.Printf("  %-28s %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f %11s\n",
+                  command.c_str(), stats.ContextTime, stats.SourceTime,
+                  generation.TokenizeTime, generation.PrefillTime,
+                  generation.DecodeTime, stats.FirstTokenTime,
+                  stats.TotalTime, tokens.c_str());
+  }
+
+  const GenerationStats &generation = totals.Generation;
+  auto perSecond = [](unsigned tokens, double milliseconds) {
+    return milliseconds > 0 ? tokens * 1000.0 / milliseconds : 0.0;
+  };
+  result.Printf("Session: %u invocations, %u answered from the cache\n",
+                numInvocations, numFromCache);
+  result.Printf("  context:  %.1f s, of which %.1f s reading sources\n",
+                totals.ContextTime / 1000, totals.SourceTime / 1000);
+  result.Printf("  tokenize: %.1f s for %u prompt tokens\n",
+                generation.TokenizeTime / 1000, generation.PromptTokens);
+  result.Printf("  prefill:  %.1f s\n", generation.PrefillTime / 1000);
+  result.Printf("  decode:   %.1f s for %u tokens (%.1f tokens/s, slowest "
+                "step %.0f ms)\n",
+                generation.DecodeTime / 1000, generation.GeneratedTokens,
+                perSecond(generation.GeneratedTokens, generation.DecodeTime),
+                generation.MaxDecodeStepTime);
+  result.Printf("  llama.cpp: prompt eval %.1f s for %u tokens (%.1f "
+                "tokens/s), eval %.1f s for %u tokens (%.1f tokens/s)\n",
+                generation.PerfPromptEvalTime / 1000,
+                generation.PerfPromptEvalTokens,
+                perSecond(generation.PerfPromptEvalTokens,
+                          generation.PerfPromptEvalTime),
+                generation.PerfEvalTime / 1000, generation.PerfEvalTokens,
+                perSecond(generation.PerfEvalTokens, generation.PerfEvalTime));
   result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
-  result.Printf("%s\n", response.c_str());
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+// AIPrefillCommand, AIOnStopCommand: Speculative prefill on process stops.
+//----------------------------------------------------------------------------//
+
+/// The command the stop hook runs. It is registered as `ai on-stop`.
+static const char *const OnStopCommand = "ai on-stop";
+
+/// Make sure the selected (or dummy) target runs `ai on-stop` whenever the
+/// process stops. A stop hook is used rather than a process listener,
+/// because synchronous execution hijacks the process events while stepping,
+/// and it runs on the interpreter thread where reading frames is safe.
+static bool EnsureStopHook(lldb::SBDebugger &debugger,
+                           lldb::SBCommandReturnObject &result) {
+  lldb::SBCommandInterpreter interpreter = debugger.GetCommandInterpreter();
+  lldb::SBCommandReturnObject listResult;
+  interpreter.HandleCommand("target stop-hook list", listResult);
+  if (listResult.GetOutput() &&
+      std::strstr(listResult.GetOutput(), OnStopCommand))
+    return true;
+
+  lldb::SBCommandReturnObject addResult;
+  std::string addCommand =
+      std::string("target stop-hook add --one-liner \"") + OnStopCommand + "\"";
+  interpreter.HandleCommand(addCommand.c_str(), addResult);
+  if (!addResult.Succeeded()) {
+    result.Printf("Failed to install the AI stop hook.\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+  return true;
+}
+
+/// Build the speculative prompt for the current stop and hand it to the
+/// background prefiller.
+static void ScheduleSpeculativePrefill(SeekBugContext &context,
+                                       lldb::SBDebugger &debugger) {
+  SpeculativePrefill::Target target = context.Prefill->getTarget();
+  if (target == SpeculativePrefill::Target::Suggest) {
+    context.Prefill->schedule(createStopContextPrompt(context, debugger));
+    return;
+  }
+  if (target == SpeculativePrefill::Target::Fix) {
+    lldb::SBFrame frame = debugger.GetSelectedTarget()
+                              .GetProcess()
+                              .GetSelectedThread()
+                              .GetSelectedFrame();
+    if (frame.IsValid())
+      context.Prefill->schedule(
+          createFixPrompt(*context.Sources, *context.Variables, frame));
+  }
+}
+
+AIPrefillCommand::AIPrefillCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIPrefillCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                                 lldb::SBCommandReturnObject &result) {
+  std::vector<std::string> args;
+  for (int i = 0; command && command[i] != nullptr; i++)
+    args.push_back(command[i]);
+
+  SpeculativePrefill::Target target;
+  if (args.size() == 1 && args[0] == "off") {
+    target = SpeculativePrefill::Target::Off;
+  } else if (!args.empty() && args.size() <= 2 && args[0] == "on" &&
+             (args.size() == 1 || args[1] == "suggest")) {
+    target = SpeculativePrefill::Target::Suggest;
+  } else if (args.size() == 2 && args[0] == "on" && args[1] == "fix") {
+    target = SpeculativePrefill::Target::Fix;
+  } else {
+    result.Printf("Usage: ai prefill on [suggest|fix] | off\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  if (target != SpeculativePrefill::Target::Off &&
+      !EnsureStopHook(debugger, result))
+    return false;
+  context.Prefill->setTarget(target);
+
+  // Do not wait for the next stop if we are already stopped.
+  lldb::SBProcess process = debugger.GetSelectedTarget().GetProcess();
+  if (process.IsValid() && process.GetState() == lldb::eStateStopped)
+    ScheduleSpeculativePrefill(context, debugger);
+
+  result.Printf("Speculative prefill is %s.\n",
+                target == SpeculativePrefill::Target::Off ? "off" : "on");
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+/// Most tokens of an `ai watch` annotation, which is a single line.
+static constexpr int WatchAnswerTokens = 48;
+
+static const char *const WatchQuestion =
+    "In one short sentence, what is the program doing at this point?";
+
+/// Queue the annotation of the current stop, replacing the one of the
+/// previous stop: when stepping quickly, only the latest stop is worth an
+/// answer, and at most one annotation is ever waiting for the model.
+static void AnnotateStop(SeekBugContext &context, lldb::SBDebugger &debugger) {
+  lldb::SBProcess process = debugger.GetSelectedTarget().GetProcess();
+  if (!process.IsValid() || process.GetState() != lldb::eStateStopped)
+    return;
+  uint32_t stopID = process.GetStopID();
+
+  LLMRequest request = createStopContextPrompt(context, debugger);
+  request.Prompt += std::string(" ") + WatchQuestion + "\n";
+  request.Sampling = context.Sampling;
+  request.MaxNewTokens = WatchAnswerTokens;
+  request.Stop = {"\n"};
+
+  lldb::SBFile out = debugger.GetOutputFile();
+  auto print = [out](const std::string &answer) mutable {
+    PrintAsync(out, "[ai watch] " +
+                        llvm::StringRef(answer).trim().str() + "\n");
+  };
+
+  // Stepping through a loop comes back to the same stops.
+  std::shared_ptr<ResponseCache> cache = context.Responses;
+  uint64_t cacheKey = ResponseCache::computeKey(request, *context.Engine);
+  std::string cached;
+  std::shared_ptr<WatchState> watch = context.Watch;
+  std::lock_guard<std::mutex> lock(watch->Mutex);
+  // Whatever is queued or running is about an older stop.
+  if (watch->JobID)
+    context.Jobs->cancel(watch->JobID);
+  watch->JobID = 0;
+  watch->StopID = stopID;
+  if (cache->lookup(cacheKey, cached)) {
+    print(cached);
+    return;
+  }
+
+  watch->JobID = context.Jobs->submit(
+      "watch", request,
+      [watch, stopID, cache, cacheKey,
+       print](unsigned id, const std::string &description,
+              const std::string &answer, bool waited) mutable {
+        if (IsCacheable(answer))
+          cache->insert(cacheKey, answer);
+        {
+          std::lock_guard<std::mutex> lock(watch->Mutex);
+          if (watch->JobID == id)
+            watch->JobID = 0;
+          if (waited || !watch->Enabled || watch->StopID != stopID)
+            return;
+        }
+        if (IsCacheable(answer))
+          print(answer);
+      });
+}
+
+AIWatchCommand::AIWatchCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIWatchCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                               lldb::SBCommandReturnObject &result) {
+  std::vector<std::string> args;
+  for (int i = 0; command && command[i] != nullptr; i++)
+    args.push_back(command[i]);
+  if (args.size() != 1 || (args[0] != "on" && args[0] != "off")) {
+    result.Printf("Usage: ai watch on|off\n");
+    result.SetStatus(lldb::eReturnStatusFailed);
+    return false;
+  }
+
+  bool enable = args[0] == "on";
+  if (enable && !EnsureStopHook(debugger, result))
+    return false;
+  {
+    std::lock_guard<std::mutex> lock(context.Watch->Mutex);
+    context.Watch->Enabled = enable;
+    if (!enable && context.Watch->JobID) {
+      context.Jobs->cancel(context.Watch->JobID);
+      context.Watch->JobID = 0;
+    }
+  }
+  if (enable)
+    AnnotateStop(context, debugger);
+
+  result.Printf("AI watch is %s.\n", enable ? "on" : "off");
+  result.SetStatus(lldb::eReturnStatusSuccessFinishResult);
+  return true;
+}
+
+AIOnStopCommand::AIOnStopCommand(SeekBugContext &ctx) : context(ctx) {}
+
+bool AIOnStopCommand::DoExecute(lldb::SBDebugger debugger, char **command,
+                                lldb::SBCommandReturnObject &result) {
+  if (context.Prefill->getTarget() != SpeculativePrefill::Target::Off)
+    ScheduleSpeculativePrefill(context, debugger);
+  bool watching;
+  {
+    std::lock_guard<std::mutex> lock(context.Watch->Mutex);
+    watching = context.Watch->Enabled;
+  }
+  if (watching)
+    AnnotateStop(context, debugger);
+
+  // Stay silent, the stop hook output is shown with every stop.
+  result.SetStatus(lldb::eReturnStatusSuccessFinishNoResult);
   return true;
 }
 
 bool RegisterAICommands(lldb::SBCommandInterpreter &interpreter,
                         SeekBugContext &context) {
+  // Every command shares the background worker for --async requests.
+  if (!context.Jobs)
+    context.Jobs = std::make_shared<JobQueue>(context.Engine);
+  if (!context.Prefill)
+    context.Prefill = std::make_shared<SpeculativePrefill>(context.Engine);
+  if (!context.Sources)
+    context.Sources = std::make_shared<SourceCache>();
+  if (!context.Variables)
+    context.Variables = std::make_shared<VariableCapture>();
+  if (!context.Crashes)
+    context.Crashes =
+        std::make_shared<CrashIndex>(CrashIndex::getDefaultDirectory());
+  if (!context.Responses)
+    context.Responses =
+        std::make_shared<ResponseCache>(ResponseCache::getDefaultDirectory());
+  if (!context.Stats)
+    context.Stats = std::make_shared<Telemetry>(context.Engine);
+  if (!context.Chat)
+    context.Chat = std::make_shared<ChatSession>(context.Engine);
+  if (!context.Watch)
+    context.Watch = std::make_shared<WatchState>();
+
   // Add the main 'ai' multiword command, which groups sub-commands.
   lldb::SBCommand aiCmd =
       interpreter.AddMultiwordCommand("ai", "AI-based commands");
@@ -619,7 +1870,8 @@ bool RegisterAICommands(lldb::SBCommandInterpreter &interpreter,
   lldb::SBCommand suggestCmd =
       aiCmd.AddCommand("suggest", suggestCmdImpl,
                        "Ask the AI for suggestions about your program. Usage: "
-                       "ai suggest <question>");
+                       "ai suggest [--async] [--no-cache] [--max-tokens <n>] "
+                       "[--deadline <ms>] [--stop <text>] <question>");
   if (!suggestCmd.IsValid()) {
     return false;
   }
@@ -630,7 +1882,8 @@ bool RegisterAICommands(lldb::SBCommandInterpreter &interpreter,
   lldb::SBCommand crashElabCmd =
       aiCmd.AddCommand("crash-elaborate", crashElaborateCmd,
                        "Analyze a crash by loading a core file. Usage: ai "
-                       "crash-elaborate <path to corefile>");
+                       "crash-elaborate [--all-threads] [--refresh] [--json] "
+                       "<path to corefile>");
   if (!crashElabCmd.IsValid()) {
     return false;
   }
@@ -658,11 +1911,95 @@ bool RegisterAICommands(lldb::SBCommandInterpreter &interpreter,
   static AIFixCommand *fixCmd = new AIFixCommand(context);
   lldb::SBCommand fixSB = aiCmd.AddCommand(
       "fix", fixCmd,
-      "Suggest a fix for the current code snippet. Usage: ai fix");
+      "Suggest a fix for the current code snippet. Usage: ai fix [--json]");
   if (!fixSB.IsValid()) {
     return false;
   }
 
+  // Add the "chat" sub-command.
+  static AIChatCommand *chatCmd = new AIChatCommand(context);
+  lldb::SBCommand chatSB = aiCmd.AddCommand(
+      "chat", chatCmd,
+      "Talk about the program with the model, which remembers the "
+      "conversation. Usage: ai chat [--max-tokens <n>] [--deadline <ms>] "
+      "[--stop <text>] <message> | ai chat --reset");
+  if (!chatSB.IsValid()) {
+    return false;
+  }
+
+  // Add the "jobs", "wait" and "cancel" sub-commands.
+  static AIJobsCommand *jobsCmd = new AIJobsCommand(context);
+  lldb::SBCommand jobsSB = aiCmd.AddCommand(
+      "jobs", jobsCmd, "List background AI jobs. Usage: ai jobs");
+  if (!jobsSB.IsValid()) {
+    return false;
+  }
+
+  static AIWaitCommand *waitCmd = new AIWaitCommand(context);
+  lldb::SBCommand waitSB = aiCmd.AddCommand(
+      "wait", waitCmd,
+      "Wait for a background AI job and print its answer. Usage: ai wait ID");
+  if (!waitSB.IsValid()) {
+    return false;
+  }
+
+  static AICancelCommand *cancelCmd = new AICancelCommand(context);
+  lldb::SBCommand cancelSB = aiCmd.AddCommand(
+      "cancel", cancelCmd, "Cancel a background AI job. Usage: ai cancel ID");
+  if (!cancelSB.IsValid()) {
+    return false;
+  }
+
+  // Add the "cache" sub-command.
+  static AICacheCommand *cacheCmd = new AICacheCommand(context);
+  lldb::SBCommand cacheSB = aiCmd.AddCommand(
+      "cache", cacheCmd,
+      "Show response cache hits and misses, or clear it. Usage: ai cache "
+      "[stats|clear]");
+  if (!cacheSB.IsValid()) {
+    return false;
+  }
+
+  // Add the "stats" sub-command.
+  static AIStatsCommand *statsCmd = new AIStatsCommand(context);
+  lldb::SBCommand statsSB = aiCmd.AddCommand(
+      "stats", statsCmd,
+      "Show where the time of the last AI commands went, and totals for the "
+      "session. Usage: ai stats [N]");
+  if (!statsSB.IsValid()) {
+    return false;
+  }
+
+  // Add the "prefill" sub-command and the "on-stop" command its stop hook
+  // runs.
+  static AIPrefillCommand *prefillCmd = new AIPrefillCommand(context);
+  lldb::SBCommand prefillSB = aiCmd.AddCommand(
+      "prefill", prefillCmd,
+      "Prefill the next AI prompt in the background whenever the process "
+      "stops. Usage: ai prefill on [suggest|fix] | off");
+  if (!prefillSB.IsValid()) {
+    return false;
+  }
+
+  // Add the "watch" sub-command, which shares the stop hook.
+  static AIWatchCommand *watchCmd = new AIWatchCommand(context);
+  lldb::SBCommand watchSB = aiCmd.AddCommand(
+      "watch", watchCmd,
+      "Annotate every stop with a one-line AI analysis, in the background. "
+      "Usage: ai watch on|off");
+  if (!watchSB.IsValid()) {
+    return false;
+  }
+
+  static AIOnStopCommand *onStopCmd = new AIOnStopCommand(context);
+  lldb::SBCommand onStopSB = aiCmd.AddCommand(
+      "on-stop", onStopCmd,
+      "Run by the stop hook that 'ai prefill' and 'ai watch' install. Usage: "
+      "ai on-stop");
+  if (!onStopSB.IsValid()) {
+    return false;
+  }
+
   return true;
 }
 
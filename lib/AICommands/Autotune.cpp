@@ -0,0 +1,254 @@
+//===-------- Autotune.cpp ------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/Autotune.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace seekbug {
+
+// Prompt tokens decoded per prefill measurement, and generated tokens per
+// decode measurement. Large enough to hide the setup, small enough to keep
+// the whole probe within a few minutes on a laptop.
+static constexpr int ProbePromptTokens = 1024;
+static constexpr int ProbeDecodeTokens = 32;
+
+// Batch and micro-batch sizes tried with the fastest prefill threads. A
+// batch larger than the probe prompt would measure the same as the prompt.
+static constexpr std::pair<unsigned, unsigned> BatchSizes[] = {
+    {256, 256},  {512, 128},  {512, 512},
+    {1024, 256}, {1024, 512}, {1024, 1024}};
+// The sizes the thread counts are measured with.
+static constexpr unsigned ThreadProbeBatchSize = 1024;
+static constexpr unsigned ThreadProbeUBatchSize = 512;
+
+/// Identity of this machine: the same model runs at different speeds on
+/// different hosts, and a home directory may be shared between them.
+static uint64_t computeHostFingerprint() {
+  char Name[256] = {0};
+  ::gethostname(Name, sizeof(Name) - 1);
+  return llvm::xxHash64(std::string(Name) + ":" +
+                        std::to_string(std::thread::hardware_concurrency()));
+}
+
+std::string getTunedProfilePath(uint64_t ModelFingerprint) {
+  llvm::SmallString<128> Path;
+  if (!llvm::sys::path::cache_directory(Path))
+    return "";
+  llvm::sys::path::append(Path, "seek-bug", "profiles",
+                          llvm::utohexstr(ModelFingerprint) + "-" +
+                              llvm::utohexstr(computeHostFingerprint()) +
+                              ".json");
+  return std::string(Path);
+}
+
+bool loadTunedProfile(uint64_t ModelFingerprint, LLMEngineOptions &Options) {
+  std::string Path = getTunedProfilePath(ModelFingerprint);
+  if (Path.empty())
+    return false;
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer)
+    return false;
+  llvm::Expected<llvm::json::Value> Value =
+      llvm::json::parse((*Buffer)->getBuffer());
+  if (!Value) {
+    llvm::consumeError(Value.takeError());
+    return false;
+  }
+  const llvm::json::Object *Object = Value->getAsObject();
+  if (!Object)
+    return false;
+  auto get = [&](llvm::StringRef Key) {
+    auto Number = Object->getInteger(Key);
+    return Number && *Number > 0 ? (unsigned)*Number : 0u;
+  };
+  Options.Threads = get("threads");
+  Options.BatchThreads = get("batch_threads");
+  Options.BatchSize = get("batch_size");
+  Options.UBatchSize = get("ubatch_size");
+  return true;
+}
+
+static bool storeTunedProfile(uint64_t ModelFingerprint,
+                              const LLMEngineOptions &Options,
+                              double PrefillSpeed, double DecodeSpeed) {
+  std::string Path = getTunedProfilePath(ModelFingerprint);
+  if (Path.empty() ||
+      llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+    return false;
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC);
+  if (EC)
+    return false;
+  OS << llvm::json::Value(llvm::json::Object{
+      {"threads", Options.Threads},
+      {"batch_threads", Options.BatchThreads},
+      {"batch_size", Options.BatchSize},
+      {"ubatch_size", Options.UBatchSize},
+      {"prefill_tokens_per_second", PrefillSpeed},
+      {"decode_tokens_per_second", DecodeSpeed}});
+  OS << "\n";
+  return true;
+}
+
+namespace {
+
+/// Speeds measured for one set of options, in tokens per second.
+struct Measurement {
+  double Prefill = 0;
+  double Decode = 0;
+};
+
+} // end anonymous namespace
+
+static bool measure(llama_model *Model, const LLMEngineOptions &Options,
+                    bool MeasureDecode, Measurement &Result) {
+  llama_context_params Params = llama_context_default_params();
+  // llama.cpp cuts the batch down to the context size.
+  Params.n_ctx = std::max<uint32_t>(ProbePromptTokens + ProbeDecodeTokens,
+                                    Options.BatchSize);
+  applyEngineOptions(Options, Params);
+  llama_context *Ctx = llama_init_from_model(Model, Params);
+  if (!Ctx)
+    return false;
+
+  // The content of the prompt does not matter for the speed.
+  int32_t NumVocab = llama_vocab_n_tokens(llama_model_get_vocab(Model));
+  std::vector<llama_token> Tokens(ProbePromptTokens);
+  for (int I = 0; I < ProbePromptTokens; ++I)
+    Tokens[I] = (llama_token)((I * 7919 + 13) % NumVocab);
+
+  using Clock = std::chrono::steady_clock;
+  auto seconds = [](Clock::duration D) {
+    return std::chrono::duration<double>(D).count();
+  };
+  bool Ok = true;
+  size_t ChunkSize = std::max<uint32_t>(1, llama_n_batch(Ctx));
+  Clock::time_point Start = Clock::now();
+  for (size_t Begin = 0; Begin < Tokens.size() && Ok; Begin += ChunkSize) {
+    int32_t Size = (int32_t)std::min(ChunkSize, Tokens.size() - Begin);
+    Ok = llama_decode(Ctx, llama_batch_get_one(Tokens.data() + Begin, Size)) ==
+         0;
+  }
+  Result.Prefill = Tokens.size() / seconds(Clock::now() - Start);
+
+  if (Ok && MeasureDecode) {
+    Start = Clock::now();
+    for (int I = 0; I < ProbeDecodeTokens && Ok; ++I)
+      Ok = llama_decode(Ctx, llama_batch_get_one(&Tokens[I], 1)) == 0;
+    Result.Decode = ProbeDecodeTokens / seconds(Clock::now() - Start);
+  }
+  llama_free(Ctx);
+  return Ok;
+}
+
+bool runAutotune(const std::string &ModelPath, LLMEngineOptions &Best,
+                 std::string &Error) {
+  llama_model_params ModelParams = llama_model_default_params();
+  llama_model *Model =
+      llama_load_model_from_file(ModelPath.c_str(), ModelParams);
+  if (!Model) {
+    Error = "Could not load model from " + ModelPath;
+    return false;
+  }
+
+  unsigned NumCPUs = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned> ThreadCounts;
+  for (unsigned Threads : {NumCPUs / 4, NumCPUs / 2, NumCPUs * 3 / 4, NumCPUs})
+    if (Threads && std::find(ThreadCounts.begin(), ThreadCounts.end(),
+                             Threads) == ThreadCounts.end())
+      ThreadCounts.push_back(Threads);
+
+  auto report = [](const LLMEngineOptions &Options, const Measurement &M) {
+    llvm::errs() << llvm::format("  threads=%-3u batch-threads=%-3u "
+                                 "batch=%-5u ubatch=%-5u prefill %8.1f tok/s",
+                                 Options.Threads, Options.BatchThreads,
+                                 Options.BatchSize, Options.UBatchSize,
+                                 M.Prefill);
+    if (M.Decode > 0)
+      llvm::errs() << llvm::format("  decode %6.1f tok/s", M.Decode);
+    llvm::errs() << "\n";
+  };
+
+  // Decoding one token at a time is bound by memory bandwidth, prefill by
+  // compute, so the two thread counts are tuned separately: first both
+  // together, then the batch sizes with the fastest prefill threads.
+  Best = LLMEngineOptions();
+  Best.BatchSize = ThreadProbeBatchSize;
+  Best.UBatchSize = ThreadProbeUBatchSize;
+  Measurement BestSpeed;
+  for (unsigned Threads : ThreadCounts) {
+    LLMEngineOptions Options = Best;
+    Options.Threads = Threads;
+    Options.BatchThreads = Threads;
+    Measurement M;
+    if (!measure(Model, Options, /*MeasureDecode=*/true, M))
+      continue;
+    report(Options, M);
+    if (M.Decode > BestSpeed.Decode) {
+      BestSpeed.Decode = M.Decode;
+      Best.Threads = Threads;
+    }
+    if (M.Prefill > BestSpeed.Prefill) {
+      BestSpeed.Prefill = M.Prefill;
+      Best.BatchThreads = Threads;
+    }
+  }
+  if (!Best.Threads || !Best.BatchThreads) {
+    llama_free_model(Model);
+    Error = "Could not run the model with any of the candidate settings.";
+    return false;
+  }
+
+  // The sizes of the thread sweep are measured again among the others: the
+  // speeds of one sweep only compare to each other, as the machine warms up
+  // and caches fill between them.
+  double BestPrefill = 0;
+  for (const auto &Sizes : BatchSizes) {
+    LLMEngineOptions Options = Best;
+    Options.BatchSize = Sizes.first;
+    Options.UBatchSize = Sizes.second;
+    Measurement M;
+    if (!measure(Model, Options, /*MeasureDecode=*/false, M))
+      continue;
+    report(Options, M);
+    if (M.Prefill > BestPrefill) {
+      BestPrefill = M.Prefill;
+      Best.BatchSize = Sizes.first;
+      Best.UBatchSize = Sizes.second;
+    }
+  }
+  if (BestPrefill > 0)
+    BestSpeed.Prefill = BestPrefill;
+
+  uint64_t Fingerprint = computeModelFingerprint(ModelPath);
+  llama_free_model(Model);
+  if (!storeTunedProfile(Fingerprint, Best, BestSpeed.Prefill,
+                         BestSpeed.Decode)) {
+    Error = "Cannot write " + getTunedProfilePath(Fingerprint);
+    return false;
+  }
+  return true;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,280 @@
+//===-------- ChatSession.cpp ---------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/ChatSession.h"
+
+#include <algorithm>
+#include <chrono>
+
+// The conversation may take up to 1/ChatWindowShare of the context. The rest
+// is left to regular requests, which keep working during a chat.
+static constexpr unsigned ChatWindowShare = 2;
+
+namespace seekbug {
+
+using Clock = std::chrono::steady_clock;
+
+ChatSession::ChatSession(std::shared_ptr<LLMEngine> Engine)
+    : Engine(std::move(Engine)) {}
+
+ChatSession::~ChatSession() { reset(); }
+
+size_t ChatSession::getWindowSize() const {
+  return Engine->getContextSize() / ChatWindowShare;
+}
+
+void ChatSession::reset() {
+  std::lock_guard<std::mutex> Lock(Engine->getMutex());
+  if (!Tokens.empty())
+    llama_kv_cache_seq_rm(Engine->getContext(), LLMEngine::ChatSequence, -1,
+                          -1);
+  Tokens.clear();
+  Turns.clear();
+  PreambleSize = 0;
+  NumEvicted = 0;
+  Engine->reserveContext(0);
+}
+
+bool ChatSession::start(const LLMRequest &Formatted, std::string &Error) {
+  // The system turn comes from the prefix cache of sequence 0, like the
+  // preamble of any other request, and is shared with the chat's sequence.
+  std::vector<llama_token> Preamble;
+  if (!Engine->restorePreamble(Formatted.Preamble, Preamble)) {
+    Error = "[Error] Failed to prefill prompt preamble.";
+    return false;
+  }
+  // From now on, sequence 0 only gets what the chat leaves of the context.
+  Engine->truncateCache(Preamble.size());
+  Engine->reserveContext(getWindowSize());
+
+  llama_context *Ctx = Engine->getContext();
+  llama_kv_cache_seq_rm(Ctx, LLMEngine::ChatSequence, -1, -1);
+  llama_kv_cache_seq_cp(Ctx, 0, LLMEngine::ChatSequence, 0,
+                        (llama_pos)Preamble.size());
+  Tokens = std::move(Preamble);
+  PreambleSize = Tokens.size();
+  return true;
+}
+
+bool ChatSession::decode(const std::vector<llama_token> &NewTokens,
+                         const LLMRequest &Request) {
+  llama_context *Ctx = Engine->getContext();
+  size_t ChunkSize = std::max<uint32_t>(1, llama_n_batch(Ctx));
+  llama_batch Batch = llama_batch_init((int32_t)ChunkSize, 0, 1);
+  bool Decoded = true;
+  for (size_t Begin = 0; Begin < NewTokens.size(); Begin += ChunkSize) {
+    if ((Request.Cancel && *Request.Cancel) ||
+        Clock::now() >= Request.Deadline) {
+      Decoded = false;
+      break;
+    }
+
+    size_t End = std::min(NewTokens.size(), Begin + ChunkSize);
+    Batch.n_tokens = 0;
+    for (size_t I = Begin; I < End; ++I) {
+      int32_t N = Batch.n_tokens++;
+      Batch.token[N] = NewTokens[I];
+      Batch.pos[N] = (llama_pos)(Tokens.size() + I - Begin);
+      Batch.n_seq_id[N] = 1;
+      Batch.seq_id[N][0] = LLMEngine::ChatSequence;
+      Batch.logits[N] = I + 1 == NewTokens.size();
+    }
+    if (llama_decode(Ctx, Batch) != 0) {
+      Decoded = false;
+      break;
+    }
+    Tokens.insert(Tokens.end(), NewTokens.begin() + Begin,
+                  NewTokens.begin() + End);
+  }
+  llama_batch_free(Batch);
+  return Decoded;
+}
+
+void ChatSession::evictOldestTurn() {
+  llama_context *Ctx = Engine->getContext();
+  size_t Begin = Turns.front();
+  size_t End = Turns.size() > 1 ? Turns[1] : Tokens.size();
+  // Without K-shift the later turns cannot move down, so they go as well.
+  if (!llama_kv_cache_can_shift(Ctx))
+    End = Tokens.size();
+
+  size_t Removed = End - Begin;
+  llama_kv_cache_seq_rm(Ctx, LLMEngine::ChatSequence, (llama_pos)Begin,
+                        (llama_pos)End);
+  if (End < Tokens.size())
+    llama_kv_cache_seq_add(Ctx, LLMEngine::ChatSequence, (llama_pos)End, -1,
+                           -(llama_pos)Removed);
+  Tokens.erase(Tokens.begin() + Begin, Tokens.begin() + End);
+
+  auto FirstKept = std::lower_bound(Turns.begin(), Turns.end(), End);
+  NumEvicted += FirstKept - Turns.begin();
+  Turns.erase(Turns.begin(), FirstKept);
+  for (size_t &Start : Turns)
+    Start -= Removed;
+}
+
+std::string ChatSession::ask(const LLMRequest &Request,
+                             const std::string &Restate) {
+  if (Engine->isRemote())
+    return "[Error] Chats need the model in this process; they are not "
+           "available with seek-bugd.";
+  if (Request.Cancel && *Request.Cancel)
+    return "[cancelled]";
+
+  std::lock_guard<std::mutex> Lock(Engine->getMutex());
+  llama_context *Ctx = Engine->getContext();
+  const llama_vocab *Vocab = Engine->getVocab();
+  auto millisecondsSince = [](Clock::time_point Start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - Start)
+        .count();
+  };
+
+  std::string Error;
+  auto PrefillStart = Clock::now();
+  if (Tokens.empty() && !start(Engine->formatRequest(Request), Error))
+    return Error;
+
+  // The end of the previous answer, if it is still in the window, and the
+  // new user turn.
+  std::vector<llama_token> Closing, Turn;
+  auto tokenizeTurn = [&](const std::string &Message) {
+    std::string ClosingText, TurnText;
+    Engine->formatFollowUp(Message, ClosingText, TurnText);
+    return Engine->tokenize(ClosingText, /* AddSpecial */ false, Closing) &&
+           Engine->tokenize(TurnText, /* AddSpecial */ false, Turn);
+  };
+  if (!tokenizeTurn(Request.Prompt))
+    return "[Error] Failed to tokenize prompt.";
+
+  const size_t MaxNewTokens = getMaxNewTokens(Request);
+  auto getTurnSize = [&] {
+    return (Turns.empty() ? 0 : Closing.size()) + Turn.size() + MaxNewTokens;
+  };
+  // Do not give up the history for a message that would not fit anyway.
+  auto getTooLongError = [&] {
+    size_t MaxTurnSize = getWindowSize() - std::min(getWindowSize(),
+                                                    PreambleSize + MaxNewTokens);
+    return "[Error] Message is too long: " + std::to_string(Turn.size()) +
+           " tokens, at most " + std::to_string(MaxTurnSize) +
+           " fit in the chat.";
+  };
+  if (PreambleSize + Turn.size() + MaxNewTokens > getWindowSize())
+    return getTooLongError();
+  bool Evicted = false;
+  while (Tokens.size() + getTurnSize() > getWindowSize() && !Turns.empty()) {
+    evictOldestTurn();
+    Evicted = true;
+  }
+  if (Evicted && !Restate.empty()) {
+    if (!tokenizeTurn(Restate))
+      return "[Error] Failed to tokenize prompt.";
+    while (Tokens.size() + getTurnSize() > getWindowSize() && !Turns.empty())
+      evictOldestTurn();
+  }
+  if (Tokens.size() + getTurnSize() > getWindowSize())
+    return getTooLongError();
+
+  // Only the new turn is decoded; the history is in the KV cache already.
+  size_t HistorySize = Tokens.size();
+  std::vector<llama_token> NewTokens;
+  if (!Turns.empty())
+    NewTokens = Closing;
+  Turns.push_back(HistorySize + NewTokens.size());
+  NewTokens.insert(NewTokens.end(), Turn.begin(), Turn.end());
+  auto rollBack = [&] {
+    llama_kv_cache_seq_rm(Ctx, LLMEngine::ChatSequence, (llama_pos)HistorySize,
+                          -1);
+    Tokens.resize(HistorySize);
+    Turns.pop_back();
+  };
+  bool Decoded = decode(NewTokens, Request);
+  if (Request.Stats) {
+    Request.Stats->PrefillTime += millisecondsSince(PrefillStart);
+    Request.Stats->PromptTokens = NewTokens.size();
+  }
+  if (!Decoded) {
+    rollBack();
+    if (Request.Cancel && *Request.Cancel)
+      return "[cancelled]";
+    if (Clock::now() >= Request.Deadline)
+      return "[truncated: deadline reached before the answer started]";
+    return "[Error] Failed to decode prompt tokens.";
+  }
+
+  llama_sampler *Sampler =
+      createSampler(Request.Sampling, Vocab, Request.Grammar);
+  if (!Sampler) {
+    rollBack();
+    return "[Error] Invalid grammar.";
+  }
+  GenerationMonitor Monitor(Request.Stop, Request.Grammar.empty());
+
+  std::string Answer;
+  auto emit = [&](const std::string &Piece) {
+    if (Piece.empty())
+      return;
+    Answer += Piece;
+    if (Request.OnToken)
+      Request.OnToken(Piece);
+  };
+  auto getInterruption = [&]() -> std::string {
+    if (Request.Cancel && *Request.Cancel)
+      return "\n[cancelled]";
+    if (Clock::now() >= Request.Deadline)
+      return "\n[truncated: deadline reached]";
+    return "";
+  };
+
+  // The answer stays in the window as it is generated, so the next turn
+  // only has to close it.
+  auto GenerationStart = Clock::now();
+  double MaxStepTime = 0;
+  unsigned NumGenerated = 0;
+  for (size_t I = 0; I < MaxNewTokens; ++I) {
+    std::string Interruption = getInterruption();
+    if (!Interruption.empty()) {
+      emit(Monitor.flush());
+      emit(Interruption);
+      break;
+    }
+
+    llama_token Token = llama_sampler_sample(Sampler, Ctx, -1);
+    if (llama_token_is_eog(Vocab, Token))
+      break;
+    std::string Piece;
+    if (!tokenToPiece(Vocab, Token, Piece)) {
+      emit(Monitor.flush());
+      emit("[Error: failed to convert token to piece]\n");
+      break;
+    }
+    ++NumGenerated;
+    emit(Monitor.add(Token, Piece));
+    if (Monitor.isDone())
+      break;
+
+    auto StepStart = Clock::now();
+    if (!decode({Token}, Request)) {
+      Interruption = getInterruption();
+      emit(Monitor.flush());
+      emit(Interruption.empty() ? "[Error: decode failure in generation loop]\n"
+                                : Interruption);
+      break;
+    }
+    MaxStepTime = std::max(MaxStepTime, millisecondsSince(StepStart));
+  }
+  emit(Monitor.flush());
+  llama_sampler_free(Sampler);
+
+  if (GenerationStats *Stats = Request.Stats) {
+    Stats->DecodeTime += millisecondsSince(GenerationStart);
+    Stats->MaxDecodeStepTime = std::max(Stats->MaxDecodeStepTime, MaxStepTime);
+    Stats->GeneratedTokens += NumGenerated;
+  }
+  return Answer;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,136 @@
+//===-------- CrashIndex.cpp ----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/CrashIndex.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+
+namespace seekbug {
+
+static int64_t now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+CrashIndex::CrashIndex(std::string Directory)
+    : Directory(std::move(Directory)) {}
+
+std::string CrashIndex::getDefaultDirectory() {
+  llvm::SmallString<128> Path;
+  if (!llvm::sys::path::cache_directory(Path))
+    return "";
+  llvm::sys::path::append(Path, "seek-bug", "crashes");
+  return std::string(Path);
+}
+
+std::string CrashIndex::getEntryPath(uint64_t Key) const {
+  std::string Name = llvm::utohexstr(Key, /*LowerCase=*/true);
+  Name.insert(0, 16 - Name.size(), '0');
+  llvm::SmallString<128> Path(Directory);
+  llvm::sys::path::append(Path, Name.substr(0, 2), Name + ".json");
+  return std::string(Path);
+}
+
+bool CrashIndex::lookup(uint64_t Key, Entry &Result) const {
+  if (Directory.empty())
+    return false;
+  auto Buffer = llvm::MemoryBuffer::getFile(getEntryPath(Key));
+  if (!Buffer)
+    return false;
+  llvm::Expected<llvm::json::Value> Parsed =
+      llvm::json::parse((*Buffer)->getBuffer());
+  if (!Parsed) {
+    llvm::consumeError(Parsed.takeError());
+    return false;
+  }
+  const llvm::json::Object *Object = Parsed->getAsObject();
+  if (!Object)
+    return false;
+
+  Entry E;
+  if (auto Signature = Object->getString("signature"))
+    E.Signature = Signature->str();
+  if (auto Analysis = Object->getString("analysis"))
+    E.Analysis = Analysis->str();
+  if (auto FirstSeen = Object->getInteger("first_seen"))
+    E.FirstSeen = *FirstSeen;
+  if (auto LastSeen = Object->getInteger("last_seen"))
+    E.LastSeen = *LastSeen;
+  if (auto Count = Object->getInteger("count"))
+    E.Count = *Count;
+  if (E.Analysis.empty())
+    return false;
+  Result = std::move(E);
+  return true;
+}
+
+bool CrashIndex::write(uint64_t Key, const Entry &E) {
+  std::string Path = getEntryPath(Key);
+  if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path)))
+    return false;
+
+  // Write a temporary file and rename it over the entry, so that readers in
+  // other processes never see a partial entry.
+  int FD;
+  llvm::SmallString<128> TempPath;
+  if (llvm::sys::fs::createUniqueFile(Path + "-%%%%%%.tmp", FD, TempPath))
+    return false;
+  {
+    // Model output is not guaranteed to be valid UTF-8, which JSON requires.
+    std::string Analysis = llvm::json::isUTF8(E.Analysis)
+                               ? E.Analysis
+                               : llvm::json::fixUTF8(E.Analysis);
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << llvm::json::Value(llvm::json::Object{
+        {"signature", E.Signature},
+        {"analysis", std::move(Analysis)},
+        {"first_seen", E.FirstSeen},
+        {"last_seen", E.LastSeen},
+        {"count", (int64_t)E.Count}});
+  }
+  if (llvm::sys::fs::rename(TempPath, Path)) {
+    llvm::sys::fs::remove(TempPath);
+    return false;
+  }
+  return true;
+}
+
+bool CrashIndex::recordOccurrence(uint64_t Key, Entry &Result,
+                                  unsigned NumOccurrences) {
+  if (!lookup(Key, Result))
+    return false;
+  Result.LastSeen = now();
+  Result.Count += NumOccurrences;
+  write(Key, Result);
+  return true;
+}
+
+bool CrashIndex::store(uint64_t Key, const std::string &Signature,
+                       const std::string &Analysis,
+                       unsigned NumOccurrences) {
+  if (Directory.empty())
+    return false;
+  Entry E;
+  if (!lookup(Key, E))
+    E.FirstSeen = now();
+  E.Signature = Signature;
+  E.Analysis = Analysis;
+  E.LastSeen = now();
+  E.Count += NumOccurrences;
+  return write(Key, E);
+}
+
+} // end namespace seekbug
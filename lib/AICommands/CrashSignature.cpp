@@ -0,0 +1,110 @@
+//===-------- CrashSignature.cpp ------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/CrashSignature.h"
+
+#include <lldb/API/SBAddress.h>
+#include <lldb/API/SBFileSpec.h>
+#include <lldb/API/SBFrame.h>
+#include <lldb/API/SBModule.h>
+#include <lldb/API/SBSymbol.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+namespace seekbug {
+
+/// Frames that every crash of the same kind has on top, whatever the cause.
+static bool isSignalMachinery(llvm::StringRef Symbol) {
+  return llvm::StringSwitch<bool>(Symbol)
+      .Cases("raise", "abort", "gsignal", "pthread_kill", true)
+      .Cases("__pthread_kill_implementation", "__pthread_kill_internal", true)
+      .Cases("__assert_fail", "__assert_fail_base", "__assert_rtn", true)
+      .Cases("__GI_raise", "__GI_abort", "__abort_with_payload", true)
+      .Default(false);
+}
+
+std::string CrashSignature::getHashString() const {
+  return llvm::utohexstr(Hash, /*LowerCase=*/true);
+}
+
+uint64_t CrashSignature::getBuildHash() const {
+  return llvm::xxHash64(Text + '\0' + BuildIDs);
+}
+
+CrashSignature computeCrashSignature(llvm::ArrayRef<SignatureFrame> Frames,
+                                     unsigned NumFrames) {
+  CrashSignature Signature;
+  std::set<std::string> BuildIDs;
+  size_t Begin = 0;
+  while (Begin < Frames.size() && isSignalMachinery(Frames[Begin].Symbol))
+    ++Begin;
+  size_t End = std::min<size_t>(Frames.size(), Begin + NumFrames);
+  for (const SignatureFrame &Frame : Frames.slice(Begin, End - Begin)) {
+    if (!Frame.Module.empty() && !Frame.UUID.empty())
+      BuildIDs.insert(Frame.Module + " " + Frame.UUID);
+
+    std::string Line = Frame.Module.empty() ? "??" : Frame.Module;
+    Line += "!";
+    if (!Frame.Symbol.empty())
+      Line += Frame.Symbol + "+0x";
+    else
+      Line += "0x";
+    Line += llvm::utohexstr(Frame.Offset, /*LowerCase=*/true);
+    Signature.Text += Line + "\n";
+  }
+  Signature.Hash = llvm::xxHash64(Signature.Text);
+  for (const std::string &BuildID : BuildIDs)
+    Signature.BuildIDs += BuildID + "\n";
+  return Signature;
+}
+
+CrashSignature computeCrashSignature(lldb::SBThread &Thread,
+                                     unsigned NumFrames) {
+  // Only unwind as far as the signature reaches.
+  std::vector<SignatureFrame> Frames;
+  unsigned NumTaken = 0;
+  for (uint32_t I = 0, E = Thread.GetNumFrames(); I < E && NumTaken < NumFrames;
+       ++I) {
+    lldb::SBFrame Frame = Thread.GetFrameAtIndex(I);
+    if (!Frame.IsValid())
+      continue;
+
+    SignatureFrame Entry;
+    lldb::SBModule Module = Frame.GetModule();
+    if (Module.IsValid()) {
+      if (const char *Name = Module.GetFileSpec().GetFilename())
+        Entry.Module = Name;
+      if (const char *UUID = Module.GetUUIDString())
+        Entry.UUID = UUID;
+    }
+    // File addresses are relative to the module, so they are the same in
+    // every run of the same build.
+    uint64_t PC = Frame.GetPCAddress().GetFileAddress();
+    lldb::SBSymbol Symbol = Frame.GetSymbol();
+    const char *SymbolName = Symbol.IsValid() ? Symbol.GetName() : nullptr;
+    if (SymbolName) {
+      Entry.Symbol = SymbolName;
+      Entry.Offset = PC - Symbol.GetStartAddress().GetFileAddress();
+    } else {
+      Entry.Offset = PC;
+    }
+
+    if (NumTaken || !isSignalMachinery(Entry.Symbol))
+      ++NumTaken;
+    Frames.push_back(std::move(Entry));
+  }
+  return computeCrashSignature(Frames, NumFrames);
+}
+
+} // end namespace seekbug
@@ -0,0 +1,239 @@
+//===-------- DaemonProtocol.cpp ------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/DaemonProtocol.h"
+
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace seekbug {
+
+// Frames bigger than this are treated as a protocol error.
+static constexpr uint32_t MaxFrameSize = 16 << 20;
+
+#ifdef MSG_NOSIGNAL
+static constexpr int SendFlags = MSG_NOSIGNAL;
+#else
+static constexpr int SendFlags = 0;
+#endif
+
+std::string getDefaultDaemonSocketPath() {
+  // The runtime directory is private to the user by specification.
+  const char *RuntimeDir = std::getenv("XDG_RUNTIME_DIR");
+  if (RuntimeDir && RuntimeDir[0] == '/')
+    return std::string(RuntimeDir) + "/seek-bugd.sock";
+  return "/tmp/seek-bugd-" + std::to_string(::getuid()) + "/seek-bugd.sock";
+}
+
+bool getPeerUID(int FD, uid_t &UID) {
+#ifdef SO_PEERCRED
+  ucred Credentials;
+  socklen_t Size = sizeof(Credentials);
+  if (::getsockopt(FD, SOL_SOCKET, SO_PEERCRED, &Credentials, &Size) != 0)
+    return false;
+  UID = Credentials.uid;
+  return true;
+#else
+  gid_t GID;
+  return ::getpeereid(FD, &UID, &GID) == 0;
+#endif
+}
+
+static bool writeAll(int FD, const char *Data, size_t Size) {
+  while (Size) {
+    ssize_t N = ::send(FD, Data, Size, SendFlags);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool readAll(int FD, char *Data, size_t Size) {
+  while (Size) {
+    ssize_t N = ::read(FD, Data, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data += N;
+    Size -= N;
+  }
+  return true;
+}
+
+bool writeFrame(int FD, FrameType Type, llvm::StringRef Payload) {
+  char Header[5];
+  Header[0] = static_cast<char>(Type);
+  uint32_t Size = Payload.size();
+  for (int I = 0; I < 4; ++I)
+    Header[1 + I] = static_cast<char>((Size >> (8 * I)) & 0xff);
+  return writeAll(FD, Header, sizeof(Header)) &&
+         writeAll(FD, Payload.data(), Payload.size());
+}
+
+bool readFrame(int FD, FrameType &Type, std::string &Payload) {
+  unsigned char Header[5];
+  if (!readAll(FD, reinterpret_cast<char *>(Header), sizeof(Header)))
+    return false;
+  uint32_t Size = 0;
+  for (int I = 0; I < 4; ++I)
+    Size |= uint32_t(Header[1 + I]) << (8 * I);
+  if (Size > MaxFrameSize)
+    return false;
+  Type = static_cast<FrameType>(Header[0]);
+  Payload.resize(Size);
+  return readAll(FD, &Payload[0], Size);
+}
+
+int connectToDaemon(const std::string &SocketPath, std::string &Error) {
+  sockaddr_un Address;
+  std::memset(&Address, 0, sizeof(Address));
+  Address.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Address.sun_path)) {
+    Error = "Socket path is too long: " + SocketPath;
+    return -1;
+  }
+  std::memcpy(Address.sun_path, SocketPath.c_str(), SocketPath.size());
+
+  int FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (FD < 0) {
+    Error = std::strerror(errno);
+    return -1;
+  }
+  if (::connect(FD, reinterpret_cast<sockaddr *>(&Address),
+                sizeof(Address)) != 0) {
+    Error = "Cannot connect to seek-bugd at " + SocketPath + ": " +
+            std::strerror(errno);
+    ::close(FD);
+    return -1;
+  }
+  uid_t PeerUID;
+  if (!getPeerUID(FD, PeerUID) || PeerUID != ::getuid()) {
+    Error = "seek-bugd at " + SocketPath + " is not run by this user";
+    ::close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+bool requestDaemonInfo(int FD, uint32_t &ContextSize) {
+  FrameType Type;
+  std::string Payload;
+  if (!writeFrame(FD, FrameType::Info, "") || !readFrame(FD, Type, Payload) ||
+      Type != FrameType::Info)
+    return false;
+  llvm::Expected<llvm::json::Value> Value = llvm::json::parse(Payload);
+  if (!Value) {
+    llvm::consumeError(Value.takeError());
+    return false;
+  }
+  const llvm::json::Object *Object = Value->getAsObject();
+  auto Size = Object ? Object->getInteger("context_size") : llvm::None;
+  if (!Size || *Size <= 0 || *Size > UINT32_MAX)
+    return false;
+  ContextSize = (uint32_t)*Size;
+  return true;
+}
+
+bool answerDaemonInfo(int FD, uint32_t ContextSize) {
+  std::string Payload;
+  llvm::raw_string_ostream OS(Payload);
+  OS << llvm::json::Value(
+      llvm::json::Object{{"context_size", (int64_t)ContextSize}});
+  OS.flush();
+  return writeFrame(FD, FrameType::Info, Payload);
+}
+
+std::string generateRemote(const std::string &SocketPath,
+                           const LLMRequest &Request, int MaxNewTokens) {
+  std::string Error;
+  int FD = connectToDaemon(SocketPath, Error);
+  if (FD < 0)
+    return "[Error] " + Error;
+
+  const SamplingOptions &Sampling = Request.Sampling;
+  llvm::json::Array Stop;
+  for (const std::string &S : Request.Stop)
+    Stop.push_back(S);
+  std::string Payload;
+  llvm::raw_string_ostream OS(Payload);
+  OS << llvm::json::Value(llvm::json::Object{
+      {"preamble", Request.Preamble},
+      {"prompt", Request.Prompt},
+      {"max_tokens", MaxNewTokens},
+      {"stop", std::move(Stop)},
+      {"grammar", Request.Grammar},
+      {"sampling",
+       llvm::json::Object{{"temperature", Sampling.Temperature},
+                          {"top_k", Sampling.TopK},
+                          {"top_p", Sampling.TopP},
+                          {"repeat_penalty", Sampling.RepeatPenalty},
+                          {"repeat_last_n", Sampling.RepeatLastN},
+                          {"seed", (int64_t)Sampling.Seed}}}});
+  OS.flush();
+  if (!writeFrame(FD, FrameType::Request, Payload)) {
+    ::close(FD);
+    return "[Error] Lost connection to seek-bugd.";
+  }
+
+  std::string Answer;
+  bool CancelSent = false;
+  bool DeadlineReached = false;
+  while (true) {
+    // Wake up regularly to pass on a cancellation or an expired deadline.
+    pollfd PollFD = {FD, POLLIN, 0};
+    int Ready = ::poll(&PollFD, 1, 100);
+    if (Ready < 0 && errno != EINTR)
+      break;
+    if (!CancelSent && Request.Cancel && *Request.Cancel) {
+      writeFrame(FD, FrameType::Cancel, "");
+      CancelSent = true;
+    } else if (!CancelSent &&
+               std::chrono::steady_clock::now() >= Request.Deadline) {
+      writeFrame(FD, FrameType::Cancel, "");
+      CancelSent = DeadlineReached = true;
+    }
+    if (Ready <= 0)
+      continue;
+
+    FrameType Type;
+    std::string Frame;
+    if (!readFrame(FD, Type, Frame)) {
+      Answer += "\n[Error] Lost connection to seek-bugd.";
+      break;
+    }
+    if (Type == FrameType::Token) {
+      Answer += Frame;
+      if (Request.OnToken)
+        Request.OnToken(Frame);
+      continue;
+    }
+    if (Type == FrameType::Error)
+      Answer = "[Error] " + Frame;
+    else if (DeadlineReached)
+      Answer += "\n[truncated: deadline reached]";
+    else if (CancelSent)
+      Answer += "\n[cancelled]";
+    break;
+  }
+  ::close(FD);
+  return Answer;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,471 @@
+//===-------- DaemonServer.cpp --------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/DaemonServer.h"
+#include "seek-bug/DaemonProtocol.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace seekbug {
+
+namespace {
+
+/// A request of one connection.
+struct Job {
+  int FD = -1;
+  std::string Preamble;
+  std::string Prompt;
+  int MaxNewTokens = 0;
+  SamplingOptions Sampling;
+  std::vector<std::string> Stop;
+  std::string Grammar;
+  std::atomic<bool> Cancel{false};
+  /// Set once the last frame has been sent, after which the connection may
+  /// be closed.
+  std::promise<void> Finished;
+
+  // Scheduler state.
+  std::vector<llama_token> Tokens;
+  size_t NumFed = 0;
+  size_t PreambleSize = 0;
+  llama_seq_id Seq = 0;
+  llama_pos NextPos = 0;
+  llama_token Next = 0;
+  int32_t LogitsIndex = -1;
+  int NumGenerated = 0;
+  /// Sampling is per request, and samplers with penalties have state.
+  llama_sampler *Sampler = nullptr;
+  std::unique_ptr<GenerationMonitor> Monitor;
+
+  ~Job() {
+    if (Sampler)
+      llama_sampler_free(Sampler);
+  }
+};
+
+class Scheduler {
+public:
+  explicit Scheduler(LLMEngine &Engine) : Engine(Engine) {}
+
+  void submit(std::shared_ptr<Job> J) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Queue.push_back(std::move(J));
+    Changed.notify_all();
+  }
+
+  void run();
+
+private:
+  void admit();
+  bool step();
+  void finish(Job &J, FrameType Type, const std::string &Payload);
+  size_t getUsedCells(const Job &New) const;
+
+  LLMEngine &Engine;
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::deque<std::shared_ptr<Job>> Queue;
+
+  // Only used by the scheduler thread.
+  std::vector<std::shared_ptr<Job>> Running;
+  std::vector<bool> SeqInUse =
+      std::vector<bool>(LLMEngine::MaxParallelSequences + 1, false);
+};
+
+} // end anonymous namespace
+
+void Scheduler::finish(Job &J, FrameType Type, const std::string &Payload) {
+  // Text held back for a stop string that never completed.
+  if (Type == FrameType::Done && J.Monitor) {
+    std::string Rest = J.Monitor->flush();
+    if (!Rest.empty())
+      writeFrame(J.FD, FrameType::Token, Rest);
+  }
+  writeFrame(J.FD, Type, Payload);
+  // Wakes up the reader of the connection.
+  ::shutdown(J.FD, SHUT_RDWR);
+  if (J.Seq) {
+    llama_kv_cache_seq_rm(Engine.getContext(), J.Seq, -1, -1);
+    SeqInUse[J.Seq] = false;
+  }
+  J.Finished.set_value();
+}
+
+size_t Scheduler::getUsedCells(const Job &New) const {
+  // Requests with the same preamble share its cells, and sequence 0 only
+  // ever holds the preamble of the last admitted request.
+  std::map<llvm::StringRef, size_t> Preambles;
+  size_t Used = 0;
+  auto add = [&](const Job &J) {
+    Used += J.Tokens.size() + J.MaxNewTokens;
+    Preambles[J.Preamble] = J.PreambleSize;
+  };
+  for (const std::shared_ptr<Job> &J : Running)
+    add(*J);
+  add(New);
+  for (const auto &Preamble : Preambles)
+    Used += Preamble.second;
+  return Used;
+}
+
+void Scheduler::admit() {
+  llama_context *Ctx = Engine.getContext();
+  size_t NumCtx = llama_n_ctx(Ctx);
+  while (true) {
+    std::shared_ptr<Job> J;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      if (Queue.empty())
+        return;
+      J = Queue.front();
+    }
+    auto FreeSeq = std::find(SeqInUse.begin() + 1, SeqInUse.end(), false);
+    if (FreeSeq == SeqInUse.end())
+      return;
+
+    auto pop = [&] {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Queue.pop_front();
+    };
+    if (J->Cancel) {
+      pop();
+      finish(*J, FrameType::Done, "{\"tokens\":0}");
+      continue;
+    }
+
+    std::vector<llama_token> PreambleTokens;
+    if (!J->Preamble.empty() &&
+        !Engine.tokenize(J->Preamble, /* AddSpecial */ true, PreambleTokens)) {
+      pop();
+      finish(*J, FrameType::Error, "Failed to tokenize prompt preamble.");
+      continue;
+    }
+    // Tokenized once, even if the request has to wait for room.
+    if (J->Tokens.empty() &&
+        (!Engine.tokenize(J->Prompt, /* AddSpecial */ J->Preamble.empty(),
+                          J->Tokens) ||
+         J->Tokens.empty())) {
+      pop();
+      finish(*J, FrameType::Error, "Failed to tokenize prompt.");
+      continue;
+    }
+    J->PreambleSize = PreambleTokens.size();
+    size_t PromptSize = J->PreambleSize + J->Tokens.size();
+    size_t MaxPromptTokens = Engine.getMaxPromptTokens(J->MaxNewTokens);
+    if (PromptSize > MaxPromptTokens) {
+      pop();
+      finish(*J, FrameType::Error,
+             "Prompt is too long: " + std::to_string(PromptSize) +
+                 " tokens, at most " + std::to_string(MaxPromptTokens) +
+                 " fit in the context.");
+      continue;
+    }
+    J->MaxNewTokens =
+        std::max(1, std::min<int>(J->MaxNewTokens, NumCtx - PromptSize));
+
+    // Wait for running requests to make room, keeping the arrival order.
+    if (!Running.empty() && getUsedCells(*J) > NumCtx)
+      return;
+    pop();
+
+    // The preamble is prefilled (or restored) once in sequence 0 and shared
+    // with the request's sequence.
+    if (!J->Preamble.empty() &&
+        !Engine.restorePreamble(J->Preamble, PreambleTokens)) {
+      finish(*J, FrameType::Error, "Failed to prefill prompt preamble.");
+      continue;
+    }
+    J->Seq = FreeSeq - SeqInUse.begin();
+    *FreeSeq = true;
+    llama_kv_cache_seq_rm(Ctx, J->Seq, -1, -1);
+    if (!PreambleTokens.empty())
+      llama_kv_cache_seq_cp(Ctx, 0, J->Seq, 0,
+                            (llama_pos)PreambleTokens.size());
+    J->NextPos = J->PreambleSize;
+    J->Sampler = createSampler(J->Sampling, Engine.getVocab(), J->Grammar);
+    if (!J->Sampler) {
+      finish(*J, FrameType::Error, "Invalid grammar.");
+      continue;
+    }
+    J->Monitor =
+        std::make_unique<GenerationMonitor>(J->Stop, J->Grammar.empty());
+    Running.push_back(J);
+  }
+}
+
+bool Scheduler::step() {
+  llama_context *Ctx = Engine.getContext();
+  // Drop cancelled requests before spending a decode on them.
+  auto Cancelled = std::stable_partition(
+      Running.begin(), Running.end(),
+      [](const std::shared_ptr<Job> &J) { return !J->Cancel; });
+  for (auto It = Cancelled; It != Running.end(); ++It)
+    finish(**It, FrameType::Done,
+           "{\"tokens\":" + std::to_string((*It)->NumGenerated) + "}");
+  Running.erase(Cancelled, Running.end());
+  if (Running.empty())
+    return true;
+
+  // At least one token of every running request, see LLMEngine::create().
+  int32_t BatchSize = llama_n_batch(Ctx);
+  llama_batch Batch = llama_batch_init(BatchSize, 0, 1);
+  auto addToken = [&](Job &J, llama_token Token, bool Logits) {
+    int32_t N = Batch.n_tokens++;
+    Batch.token[N] = Token;
+    Batch.pos[N] = J.NextPos++;
+    Batch.n_seq_id[N] = 1;
+    Batch.seq_id[N][0] = J.Seq;
+    Batch.logits[N] = Logits;
+    if (Logits)
+      J.LogitsIndex = N;
+  };
+
+  // Generating requests first, so that a long new prompt does not stall
+  // them; prompt tokens fill whatever is left of the batch.
+  for (const std::shared_ptr<Job> &J : Running)
+    if (J->NumFed == J->Tokens.size())
+      addToken(*J, J->Next, true);
+  for (const std::shared_ptr<Job> &J : Running) {
+    while (J->NumFed < J->Tokens.size() && Batch.n_tokens < BatchSize) {
+      bool Last = J->NumFed + 1 == J->Tokens.size();
+      addToken(*J, J->Tokens[J->NumFed++], Last);
+    }
+  }
+
+  bool Ok = llama_decode(Ctx, Batch) == 0;
+  llama_batch_free(Batch);
+  if (!Ok) {
+    for (const std::shared_ptr<Job> &J : Running)
+      finish(*J, FrameType::Error, "Failed to decode batch.");
+    Running.clear();
+    return false;
+  }
+
+  std::vector<std::shared_ptr<Job>> StillRunning;
+  for (const std::shared_ptr<Job> &J : Running) {
+    if (J->LogitsIndex < 0) {
+      StillRunning.push_back(J);
+      continue;
+    }
+    llama_token Token = llama_sampler_sample(J->Sampler, Ctx, J->LogitsIndex);
+    J->LogitsIndex = -1;
+    std::string Piece;
+    bool Done = J->Cancel || llama_token_is_eog(Engine.getVocab(), Token) ||
+                !tokenToPiece(Engine.getVocab(), Token, Piece);
+    if (!Done) {
+      ++J->NumGenerated;
+      std::string Text = J->Monitor->add(Token, Piece);
+      // A failed write means the session went away.
+      Done = (!Text.empty() && !writeFrame(J->FD, FrameType::Token, Text)) ||
+             J->Monitor->isDone() || J->NumGenerated >= J->MaxNewTokens;
+    }
+    if (Done) {
+      finish(*J, FrameType::Done,
+             "{\"tokens\":" + std::to_string(J->NumGenerated) + "}");
+      continue;
+    }
+    J->Next = Token;
+    StillRunning.push_back(J);
+  }
+  Running = std::move(StillRunning);
+  return true;
+}
+
+void Scheduler::run() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      Changed.wait(Lock, [&] { return !Queue.empty() || !Running.empty(); });
+    }
+    std::lock_guard<std::mutex> EngineLock(Engine.getMutex());
+    admit();
+    if (!Running.empty())
+      step();
+  }
+}
+
+/// Read the request of a connection, hand it to the scheduler and watch for
+/// cancellation until the answer is complete. Sessions ask for the
+/// \p ContextSize of the daemon to budget their prompts.
+static void serveConnection(int FD, Scheduler &S, uint32_t ContextSize) {
+  FrameType Type;
+  std::string Payload;
+  if (!readFrame(FD, Type, Payload) ||
+      (Type != FrameType::Request && Type != FrameType::Info)) {
+    ::close(FD);
+    return;
+  }
+  if (Type == FrameType::Info) {
+    answerDaemonInfo(FD, ContextSize);
+    ::close(FD);
+    return;
+  }
+
+  auto J = std::make_shared<Job>();
+  J->FD = FD;
+  llvm::Expected<llvm::json::Value> Value = llvm::json::parse(Payload);
+  if (!Value)
+    llvm::consumeError(Value.takeError());
+  const llvm::json::Object *Object = Value ? Value->getAsObject() : nullptr;
+  if (!Object || !Object->getString("prompt") ||
+      !Object->getInteger("max_tokens")) {
+    writeFrame(FD, FrameType::Error, "Malformed request.");
+    ::close(FD);
+    return;
+  }
+  if (auto Preamble = Object->getString("preamble"))
+    J->Preamble = Preamble->str();
+  J->Prompt = Object->getString("prompt")->str();
+  J->MaxNewTokens =
+      (int)std::max<int64_t>(1, *Object->getInteger("max_tokens"));
+  if (const llvm::json::Array *Stop = Object->getArray("stop"))
+    for (const llvm::json::Value &S : *Stop)
+      if (auto Text = S.getAsString())
+        J->Stop.push_back(Text->str());
+  if (auto Grammar = Object->getString("grammar"))
+    J->Grammar = Grammar->str();
+  if (const llvm::json::Object *Sampling = Object->getObject("sampling")) {
+    SamplingOptions &Options = J->Sampling;
+    if (auto Temperature = Sampling->getNumber("temperature"))
+      Options.Temperature = *Temperature;
+    if (auto TopK = Sampling->getInteger("top_k"))
+      Options.TopK = *TopK;
+    if (auto TopP = Sampling->getNumber("top_p"))
+      Options.TopP = *TopP;
+    if (auto RepeatPenalty = Sampling->getNumber("repeat_penalty"))
+      Options.RepeatPenalty = *RepeatPenalty;
+    if (auto RepeatLastN = Sampling->getInteger("repeat_last_n"))
+      Options.RepeatLastN = *RepeatLastN;
+    if (auto Seed = Sampling->getInteger("seed"))
+      Options.Seed = *Seed;
+  }
+  std::future<void> Finished = J->Finished.get_future();
+  S.submit(J);
+
+  // Anything but more frames (a cancel, or the session closing the
+  // connection) stops the request.
+  while (readFrame(FD, Type, Payload) && Type != FrameType::Cancel)
+    ;
+  J->Cancel = true;
+  Finished.wait();
+  ::close(FD);
+}
+
+/// Make sure only this user can use \p Directory, creating it if needed.
+/// Whoever may write to the directory of the socket can replace it.
+static bool preparePrivateDirectory(const std::string &Directory,
+                                    std::string &Error) {
+  if (::mkdir(Directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    Error = "Cannot create " + Directory + ": " + std::strerror(errno);
+    return false;
+  }
+  struct stat Status;
+  if (::lstat(Directory.c_str(), &Status) != 0 || !S_ISDIR(Status.st_mode) ||
+      Status.st_uid != ::getuid() || (Status.st_mode & 077) != 0) {
+    Error = Directory + " is not a directory private to this user";
+    return false;
+  }
+  return true;
+}
+
+bool runDaemon(LLMEngine &Engine, const std::string &SocketPath,
+               std::string &Error) {
+  if (SocketPath == getDefaultDaemonSocketPath() &&
+      !preparePrivateDirectory(
+          llvm::sys::path::parent_path(SocketPath).str(), Error))
+    return false;
+
+  // Never take over the socket of a daemon that is still running, but do
+  // replace one left behind by a daemon that was killed.
+  std::string ConnectError;
+  int Existing = connectToDaemon(SocketPath, ConnectError);
+  if (Existing >= 0) {
+    ::close(Existing);
+    Error = "seek-bugd is already running at " + SocketPath;
+    return false;
+  }
+  llvm::sys::fs::file_status Status;
+  if (!llvm::sys::fs::status(SocketPath, Status, /*follow=*/false) &&
+      Status.type() == llvm::sys::fs::file_type::socket_file)
+    llvm::sys::fs::remove(SocketPath);
+
+  sockaddr_un Address;
+  std::memset(&Address, 0, sizeof(Address));
+  Address.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Address.sun_path)) {
+    Error = "Socket path is too long: " + SocketPath;
+    return false;
+  }
+  std::memcpy(Address.sun_path, SocketPath.c_str(), SocketPath.size());
+
+  int Listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Listener < 0) {
+    Error = std::strerror(errno);
+    return false;
+  }
+  // Only the owner may connect, also where --socket is in a shared
+  // directory.
+  mode_t OldMask = ::umask(0077);
+  int Bound =
+      ::bind(Listener, reinterpret_cast<sockaddr *>(&Address), sizeof(Address));
+  ::umask(OldMask);
+  if (Bound != 0 || ::listen(Listener, 16) != 0) {
+    Error = "Cannot listen on " + SocketPath + ": " + std::strerror(errno);
+    ::close(Listener);
+    return false;
+  }
+
+  llvm::WithColor(llvm::errs(), llvm::HighlightColor::String)
+      << "seek-bugd is serving " << Engine.getModelPath() << " on "
+      << SocketPath << "\n";
+
+  // Lives as long as the process, like the threads using it.
+  Scheduler *S = new Scheduler(Engine);
+  std::thread(&Scheduler::run, S).detach();
+  while (true) {
+    int FD = ::accept(Listener, nullptr, nullptr);
+    if (FD < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      Error = std::strerror(errno);
+      break;
+    }
+    // Not every system enforces the mode of a socket.
+    uid_t PeerUID;
+    if (!getPeerUID(FD, PeerUID) || PeerUID != ::getuid()) {
+      ::close(FD);
+      continue;
+    }
+    std::thread(serveConnection, FD, std::ref(*S), Engine.getContextSize())
+        .detach();
+  }
+  ::close(Listener);
+  ::unlink(SocketPath.c_str());
+  return false;
+}
+
+} // end namespace seekbug
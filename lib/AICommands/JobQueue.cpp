@@ -0,0 +1,198 @@
+//===-------- JobQueue.cpp ------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/JobQueue.h"
+
+namespace seekbug {
+
+// Finished jobs are kept around for `ai jobs` and `ai wait`, but only the
+// most recent ones.
+static constexpr size_t MaxFinishedJobs = 64;
+
+// How often a waiter checks whether it was interrupted.
+static constexpr std::chrono::milliseconds InterruptPollInterval(50);
+
+JobQueue::JobQueue(std::shared_ptr<LLMEngine> Engine)
+    : Engine(std::move(Engine)) {}
+
+JobQueue::~JobQueue() { stop(); }
+
+const char *JobQueue::stateToString(JobState State) {
+  switch (State) {
+  case JobState::Queued:
+    return "queued";
+  case JobState::Running:
+    return "running";
+  case JobState::Done:
+    return "done";
+  case JobState::Cancelled:
+    return "cancelled";
+  }
+  return "unknown";
+}
+
+unsigned JobQueue::submit(const std::string &Description, LLMRequest Request,
+                          FinishedCallback OnFinished) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto NewJob = std::make_shared<Job>();
+  NewJob->ID = NextID++;
+  NewJob->Description = Description;
+  NewJob->Request = std::move(Request);
+  NewJob->Request.Cancel = &NewJob->Cancel;
+  NewJob->OnFinished = std::move(OnFinished);
+  NewJob->Submitted = std::chrono::steady_clock::now();
+
+  Jobs[NewJob->ID] = NewJob;
+  Pending.push_back(NewJob);
+  pruneFinished();
+
+  // The worker is started lazily, so sessions that never use --async do
+  // not pay for an idle thread.
+  if (!Worker.joinable())
+    Worker = std::thread(&JobQueue::run, this);
+  Changed.notify_all();
+  return NewJob->ID;
+}
+
+std::vector<JobQueue::JobInfo> JobQueue::list() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Now = std::chrono::steady_clock::now();
+  std::vector<JobInfo> Result;
+  for (auto &Entry : Jobs) {
+    const Job &J = *Entry.second;
+    bool IsFinished =
+        J.State == JobState::Done || J.State == JobState::Cancelled;
+    auto End = IsFinished ? J.Finished : Now;
+    Result.push_back(
+        {J.ID, J.Description, J.State,
+         std::chrono::duration<double>(End - J.Submitted).count()});
+  }
+  return Result;
+}
+
+JobQueue::WaitResult JobQueue::wait(unsigned ID, std::string &Answer,
+                                    const std::atomic<bool> *Interrupt) {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  auto It = Jobs.find(ID);
+  if (It == Jobs.end())
+    return WaitResult::NoSuchJob;
+
+  std::shared_ptr<Job> J = It->second;
+  J->HasWaiter = true;
+  auto isFinished = [&] {
+    return J->State == JobState::Done || J->State == JobState::Cancelled;
+  };
+  // Waiting for the callback too means that whatever it records, like the
+  // cached answer, is in place when the waiter goes on.
+  while (!Changed.wait_for(Lock, InterruptPollInterval,
+                           [&] { return isFinished() && J->Delivered; })) {
+    // Once the job is finished, the callback was told about the waiter
+    // already, and will return shortly.
+    if (Interrupt && *Interrupt && !isFinished()) {
+      J->HasWaiter = false;
+      return WaitResult::Interrupted;
+    }
+  }
+  Answer = J->Answer;
+  return WaitResult::Finished;
+}
+
+bool JobQueue::cancel(unsigned ID) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Jobs.find(ID);
+  if (It == Jobs.end())
+    return false;
+
+  Job &J = *It->second;
+  if (J.State == JobState::Done || J.State == JobState::Cancelled)
+    return false;
+
+  J.Cancel = true;
+  if (J.State == JobState::Queued) {
+    J.State = JobState::Cancelled;
+    J.Delivered = true;
+    J.Finished = std::chrono::steady_clock::now();
+    Changed.notify_all();
+  }
+  return true;
+}
+
+void JobQueue::stop() {
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stopping = true;
+    for (auto &Entry : Jobs)
+      Entry.second->Cancel = true;
+    Changed.notify_all();
+  }
+  if (Worker.joinable())
+    Worker.join();
+}
+
+void JobQueue::pruneFinished() {
+  size_t NumFinished = 0;
+  for (auto &Entry : Jobs)
+    if (Entry.second->State == JobState::Done ||
+        Entry.second->State == JobState::Cancelled)
+      ++NumFinished;
+
+  // Jobs are keyed by increasing id, so this drops the oldest first.
+  for (auto It = Jobs.begin();
+       It != Jobs.end() && NumFinished > MaxFinishedJobs;) {
+    JobState State = It->second->State;
+    if ((State == JobState::Done || State == JobState::Cancelled) &&
+        !It->second->HasWaiter) {
+      It = Jobs.erase(It);
+      --NumFinished;
+    } else {
+      ++It;
+    }
+  }
+}
+
+void JobQueue::run() {
+  while (true) {
+    std::shared_ptr<Job> J;
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      Changed.wait(Lock, [&] { return Stopping || !Pending.empty(); });
+      if (Stopping)
+        return;
+      J = Pending.front();
+      Pending.pop_front();
+      // Cancelled while it was still queued.
+      if (J->State != JobState::Queued)
+        continue;
+      J->State = JobState::Running;
+    }
+
+    std::string Answer = runLLM(J->Request, *Engine);
+
+    FinishedCallback Deliver;
+    bool Waited;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      J->Answer = std::move(Answer);
+      J->State = J->Cancel ? JobState::Cancelled : JobState::Done;
+      J->Finished = std::chrono::steady_clock::now();
+      Waited = J->HasWaiter;
+      if (!Stopping)
+        Deliver = J->OnFinished;
+    }
+    // The callback runs whether or not someone waits, since it does more
+    // than show the answer; the waiter is released once it returns.
+    if (Deliver)
+      Deliver(J->ID, J->Description, J->Answer, Waited);
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      J->Delivered = true;
+      Changed.notify_all();
+    }
+  }
+}
+
+} // end namespace seekbug
@@ -0,0 +1,180 @@
+//===-------- MachineContext.cpp ------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/MachineContext.h"
+#include "seek-bug/StackEncoder.h"
+
+#include <lldb/API/SBAddress.h>
+#include <lldb/API/SBFileSpec.h>
+#include <lldb/API/SBInstruction.h>
+#include <lldb/API/SBInstructionList.h>
+#include <lldb/API/SBModule.h>
+#include <lldb/API/SBProcess.h>
+#include <lldb/API/SBSymbol.h>
+#include <lldb/API/SBTarget.h>
+#include <lldb/API/SBThread.h>
+#include <lldb/API/SBValue.h>
+#include <lldb/API/SBValueList.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace seekbug {
+
+namespace {
+
+struct DecodedInstruction {
+  uint64_t Address = 0;
+  uint64_t Size = 0;
+  /// Mnemonic and operands.
+  std::string Text;
+  /// The words of the operands, some of which are registers.
+  llvm::SmallVector<std::string, 4> Words;
+};
+
+} // end anonymous namespace
+
+static std::vector<DecodedInstruction>
+decodeInstructions(lldb::SBTarget &Target, uint64_t From, uint32_t Count) {
+  std::vector<DecodedInstruction> Decoded;
+  lldb::SBInstructionList List =
+      Target.ReadInstructions(Target.ResolveLoadAddress(From), Count);
+  for (uint32_t I = 0; I < List.GetSize(); ++I) {
+    lldb::SBInstruction Instruction = List.GetInstructionAtIndex(I);
+    DecodedInstruction Entry;
+    Entry.Address = Instruction.GetAddress().GetLoadAddress(Target);
+    Entry.Size = Instruction.GetByteSize();
+    const char *Mnemonic = Instruction.GetMnemonic(Target);
+    const char *Operands = Instruction.GetOperands(Target);
+    Entry.Text = Mnemonic ? Mnemonic : "??";
+    if (Operands && *Operands)
+      Entry.Text += std::string(" ") + Operands;
+
+    // "%rax", "0x8(%rdi)" and "[x1, #0x8]" all split into plain words.
+    llvm::StringRef Rest(Operands ? Operands : "");
+    while (!Rest.empty()) {
+      Rest = Rest.drop_while([](char C) { return !llvm::isAlnum(C); });
+      llvm::StringRef Word =
+          Rest.take_while([](char C) { return llvm::isAlnum(C) || C == '_'; });
+      if (!Word.empty())
+        Entry.Words.push_back(Word.lower());
+      Rest = Rest.drop_front(Word.size());
+    }
+    Decoded.push_back(std::move(Entry));
+  }
+  return Decoded;
+}
+
+/// The general purpose registers of \p Frame that have a value, by name.
+static llvm::StringMap<uint64_t> readRegisters(lldb::SBFrame &Frame) {
+  llvm::StringMap<uint64_t> Registers;
+  lldb::SBValueList Sets = Frame.GetRegisters();
+  if (Sets.GetSize() == 0)
+    return Registers;
+  lldb::SBValue GeneralPurpose = Sets.GetValueAtIndex(0);
+  for (uint32_t I = 0; I < GeneralPurpose.GetNumChildren(); ++I) {
+    lldb::SBValue Register = GeneralPurpose.GetChildAtIndex(I);
+    // Volatile registers are not known in outer frames.
+    if (!Register.GetName() || !Register.GetValue())
+      continue;
+    Registers[llvm::StringRef(Register.GetName()).lower()] =
+        Register.GetValueAsUnsigned(0);
+  }
+  return Registers;
+}
+
+std::string encodeMachineContext(lldb::SBFrame &Frame,
+                                 const LLMEngine &Engine, size_t TokenBudget,
+                                 const MachineContextLimits &Limits) {
+  lldb::SBTarget Target = Frame.GetThread().GetProcess().GetTarget();
+  if (!Frame.IsValid() || !Target.IsValid())
+    return "";
+
+  // Past the innermost frame the pc is a return address; the frame is
+  // executing the call before it.
+  uint64_t PC = Frame.GetPC();
+  uint64_t Current = Frame.GetFrameID() == 0 ? PC : PC - 1;
+  lldb::SBSymbol Symbol = Frame.GetSymbol();
+  uint64_t Start = Symbol.IsValid()
+                       ? Symbol.GetStartAddress().GetLoadAddress(Target)
+                       : LLDB_INVALID_ADDRESS;
+
+  std::vector<DecodedInstruction> Decoded;
+  if (Start != LLDB_INVALID_ADDRESS && Start <= Current)
+    Decoded = decodeInstructions(Target, Start, Limits.MaxScannedInstructions);
+  auto Marked =
+      std::find_if(Decoded.begin(), Decoded.end(), [&](const auto &Entry) {
+        return Entry.Address <= Current && Current < Entry.Address + Entry.Size;
+      });
+  // Without a symbol, or far into a long function, start at the pc.
+  if (Marked == Decoded.end()) {
+    Decoded = decodeInstructions(Target, PC, Limits.InstructionsAfter + 1);
+    Marked = Decoded.begin();
+  }
+  if (Decoded.empty())
+    return "";
+
+  size_t MarkedIndex = Marked - Decoded.begin();
+  size_t First = MarkedIndex - std::min<size_t>(MarkedIndex,
+                                                Limits.InstructionsBefore);
+  size_t Last = std::min(Decoded.size(),
+                         MarkedIndex + Limits.InstructionsAfter + 1);
+
+  const char *ModuleName = Frame.GetModule().GetFileSpec().GetFilename();
+  const char *SymbolName = Symbol.IsValid() ? Symbol.GetName() : nullptr;
+  std::string Header = "Disassembly of " +
+                       std::string(ModuleName ? ModuleName : "??") + "`" +
+                       shortenSymbolName(SymbolName ? SymbolName : "??") +
+                       " (no source):\n";
+  llvm::StringMap<uint64_t> Registers = readRegisters(Frame);
+
+  auto render = [&] {
+    std::string Text = Header;
+    std::vector<std::string> Used;
+    for (size_t I = First; I < Last; ++I) {
+      const DecodedInstruction &Entry = Decoded[I];
+      Text += I == MarkedIndex ? "-> " : "   ";
+      if (Start != LLDB_INVALID_ADDRESS && Entry.Address >= Start)
+        Text += "<+" + std::to_string(Entry.Address - Start) + ">";
+      else
+        Text += "0x" + llvm::utohexstr(Entry.Address, /*LowerCase=*/true);
+      Text += ": " + Entry.Text + "\n";
+      for (const std::string &Word : Entry.Words)
+        if (Registers.count(Word) &&
+            std::find(Used.begin(), Used.end(), Word) == Used.end())
+          Used.push_back(Word);
+    }
+    if (!Used.empty()) {
+      Text += "Registers:";
+      for (const std::string &Name : Used)
+        Text += " " + Name + "=0x" +
+                llvm::utohexstr(Registers[Name], /*LowerCase=*/true);
+      Text += "\n";
+    }
+    return Text;
+  };
+
+  // Drop instructions from the farther end, and with them the registers
+  // only they use, until the text fits.
+  std::string Text = render();
+  while (Last - First > 1 && Engine.countTokens(Text) > TokenBudget) {
+    if (MarkedIndex - First > Last - 1 - MarkedIndex)
+      ++First;
+    else
+      --Last;
+    Text = render();
+  }
+  return Text;
+}
+
+} // end namespace seekbug
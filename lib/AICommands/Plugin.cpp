@@ -53,6 +53,72 @@ bool PluginInitialize(SBDebugger debugger) {
     return false;
   }
 
+  // Load the model once; every AI command reuses it.
+  std::string error;
+  seekbug::LLMEngineOptions engineOptions;
+  auto getUnsignedEnv = [](const char *name) {
+    const char *value = std::getenv(name);
+    return value ? (unsigned)std::strtoul(value, nullptr, 10) : 0u;
+  };
+  engineOptions.Threads = getUnsignedEnv("SEEKBUG_THREADS");
+  engineOptions.BatchThreads = getUnsignedEnv("SEEKBUG_BATCH_THREADS");
+  engineOptions.BatchSize = getUnsignedEnv("SEEKBUG_BATCH_SIZE");
+  engineOptions.UBatchSize = getUnsignedEnv("SEEKBUG_UBATCH_SIZE");
+  if (const char *env_affinity = std::getenv("SEEKBUG_CPU_AFFINITY"))
+    engineOptions.CPUAffinity = env_affinity;
+  if (const char *env_mmap = std::getenv("SEEKBUG_MMAP"))
+    engineOptions.UseMMap = std::string(env_mmap) != "0";
+  if (const char *env_mlock = std::getenv("SEEKBUG_MLOCK"))
+    engineOptions.LockMemory = std::string(env_mlock) == "1";
+  if (const char *env_profile = std::getenv("SEEKBUG_MEMORY_PROFILE"))
+    if (std::string(env_profile) == "low")
+      seekbug::applyLowMemoryProfile(
+          engineOptions, getUnsignedEnv("SEEKBUG_PROMPT_TOKEN_BUDGET"),
+          getUnsignedEnv("SEEKBUG_MAX_TOKENS"));
+  if (const char *env_socket = std::getenv("SEEKBUG_DAEMON_SOCKET"))
+    context.Engine = seekbug::LLMEngine::createForDaemon(
+        context.DeepSeekLLMPath, env_socket, error);
+  else
+    context.Engine = seekbug::LLMEngine::create(context.DeepSeekLLMPath,
+                                                error, engineOptions);
+  if (!context.Engine) {
+    llvm::WithColor::error() << error << "\n";
+    return false;
+  }
+  if (const char *env_draft = std::getenv("SEEKBUG_DRAFT_MODEL_PATH"))
+    if (!context.Engine->isRemote() &&
+        !context.Engine->loadDraftModel(env_draft, error)) {
+      llvm::WithColor::error() << error << "\n";
+      return false;
+    }
+  llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+      << "[" << seekbug::getMemoryReport(*context.Engine) << "]\n";
+  if (const char *env_stats = std::getenv("SEEKBUG_STATS_FILE")) {
+    context.Stats = std::make_shared<seekbug::Telemetry>(context.Engine);
+    if (!context.Stats->openLog(env_stats, error)) {
+      llvm::WithColor::error() << error << "\n";
+      return false;
+    }
+  }
+  if (const char *env_persist = std::getenv("SEEKBUG_PERSIST_PROMPT_CACHE"))
+    if (std::string(env_persist) == "1")
+      context.Engine->enablePersistentPrefixCache();
+  if (const char *env_skip = std::getenv("SEEKBUG_SKIP_REASONING"))
+    context.Engine->setSkipReasoning(std::string(env_skip) != "0");
+  if (const char *env_budget = std::getenv("SEEKBUG_PROMPT_TOKEN_BUDGET"))
+    context.PromptTokenBudget = std::strtoul(env_budget, nullptr, 10);
+  if (const char *env_temp = std::getenv("SEEKBUG_TEMPERATURE"))
+    context.Sampling.Temperature = std::strtof(env_temp, nullptr);
+  if (const char *env_top_k = std::getenv("SEEKBUG_TOP_K"))
+    context.Sampling.TopK = std::atoi(env_top_k);
+  if (const char *env_top_p = std::getenv("SEEKBUG_TOP_P"))
+    context.Sampling.TopP = std::strtof(env_top_p, nullptr);
+  if (const char *env_penalty = std::getenv("SEEKBUG_REPEAT_PENALTY"))
+    context.Sampling.RepeatPenalty = std::strtof(env_penalty, nullptr);
+  context.Sampling.Seed = getUnsignedEnv("SEEKBUG_SEED");
+  context.MaxNewTokens = getUnsignedEnv("SEEKBUG_MAX_TOKENS");
+  context.DeadlineMs = getUnsignedEnv("SEEKBUG_DEADLINE_MS");
+
   // Register our AI commands (for example, "ai suggest") using our existing
   // API.
   if (!seekbug::RegisterAICommands(interpreter, context)) {
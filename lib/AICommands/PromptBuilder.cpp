@@ -0,0 +1,112 @@
+//===-------- PromptBuilder.cpp -------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/PromptBuilder.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <algorithm>
+
+namespace seekbug {
+
+// Tokenizing sections one by one does not give exactly the token count of
+// their concatenation, so keep some slack.
+static constexpr size_t SafetyMargin = 16;
+
+PromptBuilder::PromptBuilder(const LLMEngine &Engine, size_t TokenBudget)
+    : PromptBuilder(
+          [&Engine](const std::string &Text) {
+            return Engine.countTokens(Text);
+          },
+          TokenBudget) {}
+
+PromptBuilder::PromptBuilder(TokenCounter CountTokens, size_t TokenBudget)
+    : CountTokens(std::move(CountTokens)), TokenBudget(TokenBudget) {}
+
+void PromptBuilder::add(Priority P, std::string Text, bool Shrinkable) {
+  size_t Tokens = CountTokens(Text);
+  Sections.push_back({P, std::move(Text), Shrinkable, Tokens});
+}
+
+/// Keep only the marked lines of a snippet and any headers, i.e. drop the
+/// lines that are indented as unmarked source lines.
+static std::string shrinkSnippet(llvm::StringRef Text) {
+  llvm::SmallVector<llvm::StringRef, 16> Lines;
+  Text.split(Lines, '\n', -1, /* KeepEmpty */ false);
+  std::string Result;
+  for (llvm::StringRef Line : Lines)
+    if (Line.substr(0, 3) != "   ")
+      Result += Line.str() + "\n";
+  return Result;
+}
+
+std::string PromptBuilder::build() {
+  NumShrunk = 0;
+  NumDropped = 0;
+  size_t Budget = TokenBudget > SafetyMargin ? TokenBudget - SafetyMargin : 0;
+  size_t Total = 0;
+  // Sections dropped by an earlier build() stay dropped.
+  for (const Section &S : Sections) {
+    if (S.Dropped)
+      ++NumDropped;
+    else
+      Total += S.Tokens;
+  }
+
+  // Shrink first, then drop, going from the least important priority up.
+  // The crashing frame is never dropped.
+  for (int Level = (int)Priority::Extras;
+       Level >= (int)Priority::CrashingFrame && Total > Budget; --Level) {
+    for (auto It = Sections.rbegin(); It != Sections.rend() && Total > Budget;
+         ++It) {
+      if ((int)It->P != Level || !It->Shrinkable)
+        continue;
+      std::string Shrunk = shrinkSnippet(It->Text);
+      if (Shrunk.size() >= It->Text.size())
+        continue;
+      size_t Tokens = CountTokens(Shrunk);
+      Total = Total - It->Tokens + Tokens;
+      It->Text = std::move(Shrunk);
+      It->Tokens = Tokens;
+      ++NumShrunk;
+    }
+    if (Level == (int)Priority::CrashingFrame)
+      break;
+    for (auto It = Sections.rbegin(); It != Sections.rend() && Total > Budget;
+         ++It) {
+      if ((int)It->P != Level || It->Dropped)
+        continue;
+      It->Dropped = true;
+      Total -= It->Tokens;
+      ++NumDropped;
+    }
+  }
+
+  std::string Result;
+  for (const Section &S : Sections)
+    if (!S.Dropped)
+      Result += S.Text;
+  if (NumDropped)
+    Result += "[" + std::to_string(NumDropped) +
+              " less important parts omitted to fit the context]\n";
+  return Result;
+}
+
+size_t getPromptTokenBudget(const LLMEngine &Engine,
+                            const std::string &Preamble,
+                            size_t ConfiguredBudget, int MaxNewTokens) {
+  size_t PreambleTokens = Engine.countTokens(Preamble) + 1; // BOS
+  size_t MaxPromptTokens = Engine.getMaxPromptTokens(MaxNewTokens);
+  size_t Available =
+      MaxPromptTokens > PreambleTokens ? MaxPromptTokens - PreambleTokens : 0;
+  if (ConfiguredBudget)
+    return std::min(Available, ConfiguredBudget);
+  return Available;
+}
+
+} // end namespace seekbug
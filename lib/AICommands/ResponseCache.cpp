@@ -0,0 +1,265 @@
+//===-------- ResponseCache.cpp -------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/ResponseCache.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
+#include <cctype>
+#include <vector>
+
+namespace seekbug {
+
+ResponseCache::ResponseCache(std::string Directory, size_t MaxMemoryEntries,
+                             uint64_t MaxDiskBytes)
+    : Directory(std::move(Directory)), MaxMemoryEntries(MaxMemoryEntries),
+      MaxDiskBytes(MaxDiskBytes) {}
+
+std::string ResponseCache::getDefaultDirectory() {
+  llvm::SmallString<128> Path;
+  if (!llvm::sys::path::cache_directory(Path))
+    return "";
+  llvm::sys::path::append(Path, "seek-bug", "responses");
+  return std::string(Path);
+}
+
+/// \p Line with the digits after "ID=" replaced by "_".
+static std::string normalizeIDs(llvm::StringRef Line) {
+  std::string Result;
+  size_t I = 0;
+  while (I < Line.size()) {
+    if (Line.substr(I, 3) == "ID=") {
+      size_t End = I + 3;
+      while (End < Line.size() && llvm::isDigit(Line[End]))
+        ++End;
+      Result += "ID=_";
+      I = End;
+      continue;
+    }
+    Result += Line[I++];
+  }
+  return Result;
+}
+
+std::string ResponseCache::normalizePrompt(llvm::StringRef Prompt) {
+  llvm::SmallVector<llvm::StringRef, 64> Lines;
+  Prompt.split(Lines, '\n');
+  std::string Normalized;
+  Normalized.reserve(Prompt.size());
+  for (llvm::StringRef Line : Lines) {
+    auto hasPrefix = [&](llvm::StringRef Prefix) {
+      return Line.substr(0, Prefix.size()) == Prefix;
+    };
+    if (hasPrefix("Process: ") || hasPrefix("Thread: ") ||
+        hasPrefix("Thread #")) {
+      // Process and thread ids are assigned anew on every run.
+      Normalized += normalizeIDs(Line);
+    } else if ((hasPrefix("-> 0x") || hasPrefix("   0x")) &&
+               Line.contains(": ")) {
+      // Disassembly without a symbol is addressed where the module was
+      // loaded, which changes from run to run. The instruction is kept.
+      Normalized += Line.substr(0, 3).str() + "0x_" +
+                    Line.substr(Line.find(": ")).str();
+    } else {
+      Normalized += Line.str();
+    }
+    Normalized += '\n';
+  }
+
+  // Whitespace layout does not change the question.
+  std::string Result;
+  Result.reserve(Normalized.size());
+  for (size_t I = 0; I < Normalized.size();) {
+    if (std::isspace(static_cast<unsigned char>(Normalized[I]))) {
+      while (I < Normalized.size() &&
+             std::isspace(static_cast<unsigned char>(Normalized[I])))
+        ++I;
+      Result += ' ';
+      continue;
+    }
+    Result += Normalized[I++];
+  }
+  return Result;
+}
+
+uint64_t ResponseCache::computeKey(const LLMRequest &Request,
+                                   const LLMEngine &Engine) {
+  return computeKey(Request, Engine.getModelFingerprint(),
+                    Engine.getPromptFormat());
+}
+
+uint64_t ResponseCache::computeKey(const LLMRequest &Request,
+                                   uint64_t ModelFingerprint,
+                                   llvm::StringRef PromptFormat) {
+  std::string Key = llvm::utohexstr(ModelFingerprint);
+  Key += '\0';
+  Key += PromptFormat;
+  Key += '\0';
+  Key += getSamplingDescription(Request);
+  Key += '\0';
+  Key += normalizePrompt(Request.Preamble + Request.Prompt);
+  return llvm::xxHash64(Key);
+}
+
+std::string ResponseCache::getEntryPath(uint64_t Key) const {
+  llvm::SmallString<128> Path(Directory);
+  llvm::sys::path::append(Path, llvm::utohexstr(Key) + ".txt");
+  return std::string(Path);
+}
+
+void ResponseCache::touchMemoryEntry(uint64_t Key,
+                                     const std::string &Response) {
+  auto It = Index.find(Key);
+  if (It != Index.end())
+    Entries.erase(It->second);
+  Entries.emplace_front(Key, Response);
+  Index[Key] = Entries.begin();
+
+  while (Entries.size() > MaxMemoryEntries) {
+    Index.erase(Entries.back().first);
+    Entries.pop_back();
+  }
+}
+
+bool ResponseCache::lookup(uint64_t Key, std::string &Response) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Index.find(Key);
+  if (It != Index.end()) {
+    Response = It->second->second;
+    touchMemoryEntry(Key, Response);
+    ++Counters.Hits;
+    return true;
+  }
+
+  if (!Directory.empty()) {
+    std::string Path = getEntryPath(Key);
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (Buffer) {
+      Response = std::string((*Buffer)->getBuffer());
+      touchMemoryEntry(Key, Response);
+      // Bump the modification time, which orders the on-disk LRU.
+      int FD;
+      if (!llvm::sys::fs::openFileForWrite(Path, FD,
+                                           llvm::sys::fs::CD_OpenExisting,
+                                           llvm::sys::fs::OF_Append)) {
+        auto Now = std::chrono::system_clock::now();
+        llvm::sys::fs::setLastAccessAndModificationTime(FD, Now, Now);
+        llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+      }
+      ++Counters.Hits;
+      return true;
+    }
+  }
+
+  ++Counters.Misses;
+  return false;
+}
+
+void ResponseCache::insert(uint64_t Key, const std::string &Response) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  touchMemoryEntry(Key, Response);
+  if (Directory.empty())
+    return;
+
+  if (llvm::sys::fs::create_directories(Directory))
+    return;
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(getEntryPath(Key), EC);
+  if (EC)
+    return;
+  OS << Response;
+  OS.close();
+
+  if (!DiskUsageKnown)
+    computeDiskUsage();
+  else
+    Counters.DiskBytes += Response.size();
+  if (Counters.DiskBytes > MaxDiskBytes)
+    evictDiskEntries();
+}
+
+void ResponseCache::computeDiskUsage() {
+  Counters.DiskBytes = 0;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(Directory, EC), End;
+       It != End && !EC; It.increment(EC)) {
+    llvm::sys::fs::file_status Status;
+    if (!llvm::sys::fs::status(It->path(), Status))
+      Counters.DiskBytes += Status.getSize();
+  }
+  DiskUsageKnown = true;
+}
+
+void ResponseCache::evictDiskEntries() {
+  struct DiskEntry {
+    std::string Path;
+    uint64_t Size;
+    llvm::sys::TimePoint<> Modified;
+  };
+  std::vector<DiskEntry> DiskEntries;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(Directory, EC), End;
+       It != End && !EC; It.increment(EC)) {
+    llvm::sys::fs::file_status Status;
+    if (!llvm::sys::fs::status(It->path(), Status))
+      DiskEntries.push_back({It->path(), Status.getSize(),
+                             Status.getLastModificationTime()});
+  }
+
+  // Remove the least recently used entries until we are at 3/4 of the
+  // limit, so that the next few inserts do not scan the directory again.
+  std::sort(DiskEntries.begin(), DiskEntries.end(),
+            [](const DiskEntry &A, const DiskEntry &B) {
+              return A.Modified < B.Modified;
+            });
+  uint64_t Total = 0;
+  for (const DiskEntry &Entry : DiskEntries)
+    Total += Entry.Size;
+  for (const DiskEntry &Entry : DiskEntries) {
+    if (Total <= MaxDiskBytes / 4 * 3)
+      break;
+    if (!llvm::sys::fs::remove(Entry.Path))
+      Total -= Entry.Size;
+  }
+  Counters.DiskBytes = Total;
+}
+
+void ResponseCache::clear() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Entries.clear();
+  Index.clear();
+  if (!Directory.empty()) {
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator It(Directory, EC), End;
+         It != End && !EC; It.increment(EC))
+      llvm::sys::fs::remove(It->path());
+  }
+  Counters.DiskBytes = 0;
+  DiskUsageKnown = true;
+}
+
+ResponseCache::Stats ResponseCache::getStats() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (!DiskUsageKnown && !Directory.empty())
+    computeDiskUsage();
+  Stats Result = Counters;
+  Result.MemoryEntries = Entries.size();
+  return Result;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,96 @@
+//===-------- SourceCache.cpp ---------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/SourceCache.h"
+
+#include <llvm/Support/FileSystem.h>
+
+namespace seekbug {
+
+SourceFile::SourceFile(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+                       llvm::sys::TimePoint<> ModificationTime)
+    : Buffer(std::move(Buffer)), ModificationTime(ModificationTime) {}
+
+void SourceFile::buildLineIndex() const {
+  std::call_once(IndexOnce, [this] {
+    llvm::StringRef Text = Buffer->getBuffer();
+    if (Text.empty())
+      return;
+    LineOffsets.push_back(0);
+    for (size_t I = 0, E = Text.size(); I != E; ++I)
+      // A trailing newline ends the last line rather than starting a new one.
+      if (Text[I] == '\n' && I + 1 != E)
+        LineOffsets.push_back(I + 1);
+  });
+}
+
+uint32_t SourceFile::getNumLines() const {
+  buildLineIndex();
+  return LineOffsets.size();
+}
+
+llvm::StringRef SourceFile::getLine(uint32_t Line) const {
+  buildLineIndex();
+  if (Line == 0 || Line > LineOffsets.size())
+    return llvm::StringRef();
+
+  llvm::StringRef Text = Buffer->getBuffer();
+  size_t Begin = LineOffsets[Line - 1];
+  size_t End = Line < LineOffsets.size() ? LineOffsets[Line] : Text.size();
+  llvm::StringRef Result = Text.slice(Begin, End);
+  if (!Result.empty() && Result.back() == '\n')
+    Result = Result.drop_back();
+  if (!Result.empty() && Result.back() == '\r')
+    Result = Result.drop_back();
+  return Result;
+}
+
+std::shared_ptr<const SourceFile>
+SourceCache::getFile(const std::string &Path) {
+  if (Path.empty())
+    return nullptr;
+
+  llvm::sys::fs::file_status Status;
+  if (llvm::sys::fs::status(Path, Status) ||
+      !llvm::sys::fs::is_regular_file(Status))
+    return nullptr;
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Files.find(Path);
+  if (It != Files.end() &&
+      It->second->getModificationTime() == Status.getLastModificationTime() &&
+      It->second->getSize() == Status.getSize())
+    return It->second;
+
+  // Sources are plain text and never need a null terminator, which lets the
+  // buffer be a direct mapping of the file.
+  auto Buffer = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!Buffer) {
+    if (It != Files.end())
+      Files.erase(It);
+    return nullptr;
+  }
+
+  auto File = std::make_shared<const SourceFile>(
+      std::move(*Buffer), Status.getLastModificationTime());
+  Files[Path] = File;
+  return File;
+}
+
+void SourceCache::clear() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Files.clear();
+}
+
+void SourceCache::addReadTime(double Milliseconds) {
+  ReadMicroseconds += (uint64_t)(Milliseconds * 1000);
+}
+
+double SourceCache::getReadTime() const { return ReadMicroseconds / 1000.0; }
+
+} // end namespace seekbug
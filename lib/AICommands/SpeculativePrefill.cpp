@@ -0,0 +1,76 @@
+//===-------- SpeculativePrefill.cpp --------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/SpeculativePrefill.h"
+
+namespace seekbug {
+
+SpeculativePrefill::SpeculativePrefill(std::shared_ptr<LLMEngine> Engine,
+                                       std::chrono::milliseconds Debounce)
+    : Engine(std::move(Engine)), Debounce(Debounce) {}
+
+SpeculativePrefill::~SpeculativePrefill() { stop(); }
+
+void SpeculativePrefill::schedule(LLMRequest Request) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (Stopping)
+    return;
+
+  Request.Cancel = &Cancel;
+  Pending = std::move(Request);
+  ++Generation;
+  // Whatever is being prefilled right now belongs to an older stop.
+  Cancel = true;
+
+  if (!Worker.joinable())
+    Worker = std::thread(&SpeculativePrefill::run, this);
+  Changed.notify_all();
+}
+
+void SpeculativePrefill::stop() {
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stopping = true;
+    Cancel = true;
+    Changed.notify_all();
+  }
+  if (Worker.joinable())
+    Worker.join();
+}
+
+void SpeculativePrefill::run() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  while (true) {
+    Changed.wait(Lock, [&] { return Stopping || Pending.has_value(); });
+
+    // Debounce: while stepping quickly, only the last stop is worth it.
+    while (!Stopping) {
+      unsigned Seen = Generation;
+      if (!Changed.wait_for(Lock, Debounce,
+                            [&] { return Stopping || Generation != Seen; }))
+        break;
+    }
+    if (Stopping)
+      return;
+
+    LLMRequest Request = std::move(*Pending);
+    Pending.reset();
+    Cancel = false;
+    Lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> EngineLock(Engine->getMutex());
+      std::string Error;
+      // A failure only means the command will prefill on its own.
+      Engine->prefillRequest(Request, Error);
+    }
+
+    Lock.lock();
+  }
+}
+
+} // end namespace seekbug
@@ -0,0 +1,243 @@
+//===-------- StackEncoder.cpp --------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/StackEncoder.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+namespace seekbug {
+
+// Template argument lists longer than this are elided.
+static constexpr size_t MaxTemplateArgsLength = 24;
+// Cycles longer than this are not looked for.
+static constexpr size_t MaxCycleLength = 8;
+// A cycle has to repeat this often to be collapsed.
+static constexpr size_t MinCycleRepeats = 3;
+// Paths keep at most this many trailing components.
+static constexpr size_t MaxPathComponents = 3;
+
+/// Offset of the '>' that closes the '<' at \p Open, or npos.
+static size_t findClosingAngle(llvm::StringRef Name, size_t Open) {
+  unsigned Depth = 0;
+  for (size_t I = Open, E = Name.size(); I != E; ++I) {
+    if (Name[I] == '<')
+      ++Depth;
+    else if (Name[I] == '>' && --Depth == 0)
+      return I;
+  }
+  return llvm::StringRef::npos;
+}
+
+std::string shortenSymbolName(llvm::StringRef Name) {
+  std::string Result;
+  Result.reserve(Name.size());
+  for (size_t I = 0, E = Name.size(); I < E;) {
+    // Inline namespaces of the standard libraries only add noise.
+    if (Name.substr(I, 5) == "__1::") {
+      I += 5;
+      continue;
+    }
+    if (Name.substr(I, 9) == "__cxx11::") {
+      I += 9;
+      continue;
+    }
+
+    char C = Name[I];
+    // The '<' of operator<, operator<< and operator<= is not a template.
+    bool IsOperator = llvm::StringRef(Result).take_back(8) == "operator" ||
+                      llvm::StringRef(Result).take_back(9) == "operator<";
+    if (C != '<' || IsOperator) {
+      Result += C;
+      ++I;
+      continue;
+    }
+
+    size_t Close = findClosingAngle(Name, I);
+    if (Close == llvm::StringRef::npos) {
+      Result += Name.substr(I).str();
+      break;
+    }
+    llvm::StringRef Args = Name.slice(I + 1, Close);
+    if (Args.size() > MaxTemplateArgsLength)
+      Result += "<...>";
+    else
+      Result += "<" + shortenSymbolName(Args) + ">";
+    I = Close + 1;
+  }
+  return Result;
+}
+
+/// Display names for the files on the stack: relative to the directory they
+/// all share, and cut to the last few components.
+static llvm::StringMap<std::string>
+shortenPaths(llvm::ArrayRef<StackFrameInfo> Frames) {
+  std::vector<llvm::StringRef> Paths;
+  for (const StackFrameInfo &Frame : Frames)
+    if (!Frame.Path.empty())
+      Paths.push_back(Frame.Path);
+
+  llvm::StringRef Common;
+  if (!Paths.empty()) {
+    Common = llvm::sys::path::parent_path(Paths.front());
+    for (llvm::StringRef Path : Paths)
+      while (!Common.empty() &&
+             !(Path.substr(0, Common.size()) == Common &&
+               Path.size() > Common.size() &&
+               llvm::sys::path::is_separator(Path[Common.size()])))
+        Common = llvm::sys::path::parent_path(Common);
+  }
+
+  llvm::StringMap<std::string> Names;
+  for (llvm::StringRef Path : Paths) {
+    if (Names.count(Path))
+      continue;
+    llvm::StringRef Relative = Path;
+    if (!Common.empty())
+      Relative = Path.drop_front(Common.size() + 1);
+
+    llvm::SmallVector<llvm::StringRef, 8> Components(
+        llvm::sys::path::begin(Relative), llvm::sys::path::end(Relative));
+    if (Components.size() <= MaxPathComponents) {
+      Names[Path] = Relative.str();
+      continue;
+    }
+    std::string Name = "...";
+    for (size_t I = Components.size() - MaxPathComponents;
+         I < Components.size(); ++I)
+      Name += "/" + Components[I].str();
+    Names[Path] = Name;
+  }
+  return Names;
+}
+
+static bool isSameFrame(const StackFrameInfo &A, const StackFrameInfo &B) {
+  return A.Line == B.Line && A.Function == B.Function && A.Path == B.Path;
+}
+
+/// Length and repeat count of the longest run of a repeated cycle starting
+/// at \p Begin, or {0, 0} if there is none worth collapsing.
+static std::pair<size_t, size_t>
+findCycle(llvm::ArrayRef<StackFrameInfo> Frames, size_t Begin) {
+  std::pair<size_t, size_t> Best(0, 0);
+  for (size_t Length = 1;
+       Length <= MaxCycleLength && Begin + Length * MinCycleRepeats <=
+                                       Frames.size();
+       ++Length) {
+    size_t End = Begin + Length;
+    while (End < Frames.size() && isSameFrame(Frames[End], Frames[End - Length]))
+      ++End;
+    size_t Repeats = (End - Begin) / Length;
+    if (Repeats >= MinCycleRepeats && Repeats * Length > Best.first * Best.second)
+      Best = {Length, Repeats};
+  }
+  return Best;
+}
+
+EncodedStack encodeStack(SourceCache &Sources,
+                         llvm::ArrayRef<StackFrameInfo> Frames,
+                         unsigned ContextLines) {
+  EncodedStack Result;
+  llvm::StringMap<std::string> Names = shortenPaths(Frames);
+
+  auto describeLocation = [&](const StackFrameInfo &Frame) {
+    if (Frame.Path.empty())
+      return std::string();
+    return Names[Frame.Path] + ":" + std::to_string(Frame.Line);
+  };
+
+  // Lines to show per file, with the frame lines to mark. Files are kept in
+  // the order they first appear.
+  std::vector<std::string> FileOrder;
+  std::map<std::string, std::set<uint32_t>> MarkedLines;
+  auto addSource = [&](const StackFrameInfo &Frame) {
+    if (Frame.Path.empty() || Frame.Line == 0)
+      return;
+    auto Inserted = MarkedLines.insert({Frame.Path, {}});
+    if (Inserted.second)
+      FileOrder.push_back(Frame.Path);
+    Inserted.first->second.insert(Frame.Line);
+  };
+
+  for (size_t I = 0; I < Frames.size();) {
+    std::pair<size_t, size_t> Cycle = findCycle(Frames, I);
+    if (Cycle.second) {
+      size_t Length = Cycle.first, Repeats = Cycle.second;
+      std::string Line = "#" + std::to_string(Frames[I].Index) + "-#" +
+                         std::to_string(Frames[I + Length * Repeats - 1].Index) +
+                         ": recursion of ";
+      for (size_t J = 0; J < Length; ++J) {
+        const StackFrameInfo &Frame = Frames[I + J];
+        if (J)
+          Line += " -> ";
+        Line += shortenSymbolName(Frame.Function);
+        std::string Location = describeLocation(Frame);
+        if (!Location.empty())
+          Line += " (" + Location + ")";
+        addSource(Frame);
+      }
+      Line += " (x" + std::to_string(Repeats) + ")\n";
+      Result.Frames.push_back(std::move(Line));
+      I += Length * Repeats;
+      continue;
+    }
+
+    const StackFrameInfo &Frame = Frames[I];
+    std::string Line = "#" + std::to_string(Frame.Index) + " " +
+                       shortenSymbolName(Frame.Function);
+    std::string Location = describeLocation(Frame);
+    if (!Location.empty())
+      Line += " at " + Location;
+    Result.Frames.push_back(Line + "\n");
+    addSource(Frame);
+    ++I;
+  }
+
+  for (const std::string &Path : FileOrder) {
+    std::shared_ptr<const SourceFile> File = Sources.getFile(Path);
+    if (!File)
+      continue;
+    const std::set<uint32_t> &Marked = MarkedLines[Path];
+
+    // Merge the windows around the marked lines where they overlap or touch.
+    std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+    for (uint32_t Line : Marked) {
+      uint32_t First = Line > ContextLines ? Line - ContextLines : 1;
+      uint32_t Last = std::min(Line + ContextLines, File->getNumLines());
+      if (First > Last)
+        continue;
+      if (!Ranges.empty() && First <= Ranges.back().second + 1)
+        Ranges.back().second = std::max(Ranges.back().second, Last);
+      else
+        Ranges.push_back({First, Last});
+    }
+    if (Ranges.empty())
+      continue;
+
+    std::string Text = Names[Path] + ":\n";
+    for (size_t R = 0; R < Ranges.size(); ++R) {
+      if (R)
+        Text += "   ...\n";
+      for (uint32_t Line = Ranges[R].first; Line <= Ranges[R].second; ++Line)
+        Text += (Marked.count(Line) ? "-> " : "   ") + std::to_string(Line) +
+                ": " + File->getLine(Line).str() + "\n";
+    }
+    Text += "\n";
+
+    if (!Frames.empty() && Path == Frames.front().Path)
+      Result.CrashingSource = Result.Sources.size();
+    Result.Sources.push_back(std::move(Text));
+  }
+  return Result;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,118 @@
+//===-------- Telemetry.cpp -----------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/Telemetry.h"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+
+namespace seekbug {
+
+Telemetry::Telemetry(std::shared_ptr<LLMEngine> Engine, size_t MaxHistory)
+    : Engine(std::move(Engine)), MaxHistory(MaxHistory) {}
+
+bool Telemetry::openLog(const std::string &Path, std::string &Error) {
+  std::error_code EC;
+  auto File = std::make_unique<llvm::raw_fd_ostream>(
+      Path, EC, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+  if (EC) {
+    Error = "Cannot open " + Path + ": " + EC.message();
+    return false;
+  }
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Log = std::move(File);
+  return true;
+}
+
+/// \p Stats as a line of the JSONL log. The model and engine settings are
+/// included, so that entries of different setups can be told apart.
+static llvm::json::Object toJSON(const InvocationStats &Stats,
+                                 const LLMEngine &Engine) {
+  const GenerationStats &Generation = Stats.Generation;
+  const LLMEngineOptions &Options = Engine.getOptions();
+  return llvm::json::Object{
+      {"timestamp", Stats.Timestamp},
+      {"command", Stats.Command},
+      {"model", llvm::sys::path::filename(Engine.getModelPath()).str()},
+      {"model_fingerprint", llvm::utohexstr(Engine.getModelFingerprint())},
+      {"prompt_format", Engine.getPromptFormat()},
+      {"remote", Engine.isRemote()},
+      {"draft_model", Engine.hasDraftModel()},
+      {"threads", (int64_t)Options.Threads},
+      {"batch_size", (int64_t)Options.BatchSize},
+      {"ubatch_size", (int64_t)Options.UBatchSize},
+      {"context_size", (int64_t)Engine.getContextSize()},
+      {"from_cache", Stats.FromCache},
+      {"context_ms", Stats.ContextTime},
+      {"source_ms", Stats.SourceTime},
+      {"tokenize_ms", Generation.TokenizeTime},
+      {"prefill_ms", Generation.PrefillTime},
+      {"decode_ms", Generation.DecodeTime},
+      {"max_decode_step_ms", Generation.MaxDecodeStepTime},
+      {"first_token_ms", Stats.FirstTokenTime},
+      {"total_ms", Stats.TotalTime},
+      {"prompt_tokens", (int64_t)Generation.PromptTokens},
+      {"generated_tokens", (int64_t)Generation.GeneratedTokens},
+      {"perf_prompt_eval_ms", Generation.PerfPromptEvalTime},
+      {"perf_prompt_eval_tokens", (int64_t)Generation.PerfPromptEvalTokens},
+      {"perf_eval_ms", Generation.PerfEvalTime},
+      {"perf_eval_tokens", (int64_t)Generation.PerfEvalTokens},
+  };
+}
+
+void Telemetry::record(const InvocationStats &Stats) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  History.push_back(Stats);
+  if (History.size() > MaxHistory)
+    History.pop_front();
+
+  ++NumInvocations;
+  if (Stats.FromCache)
+    ++NumFromCache;
+  Totals.ContextTime += Stats.ContextTime;
+  Totals.SourceTime += Stats.SourceTime;
+  Totals.FirstTokenTime += Stats.FirstTokenTime;
+  Totals.TotalTime += Stats.TotalTime;
+  GenerationStats &Sum = Totals.Generation;
+  const GenerationStats &Generation = Stats.Generation;
+  Sum.TokenizeTime += Generation.TokenizeTime;
+  Sum.PrefillTime += Generation.PrefillTime;
+  Sum.DecodeTime += Generation.DecodeTime;
+  Sum.MaxDecodeStepTime =
+      std::max(Sum.MaxDecodeStepTime, Generation.MaxDecodeStepTime);
+  Sum.PromptTokens += Generation.PromptTokens;
+  Sum.GeneratedTokens += Generation.GeneratedTokens;
+  Sum.PerfPromptEvalTime += Generation.PerfPromptEvalTime;
+  Sum.PerfPromptEvalTokens += Generation.PerfPromptEvalTokens;
+  Sum.PerfEvalTime += Generation.PerfEvalTime;
+  Sum.PerfEvalTokens += Generation.PerfEvalTokens;
+
+  if (Log) {
+    *Log << llvm::json::Value(toJSON(Stats, *Engine)) << "\n";
+    Log->flush();
+  }
+}
+
+std::vector<InvocationStats> Telemetry::getRecent(size_t N) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  N = std::min(N, History.size());
+  return std::vector<InvocationStats>(History.end() - N, History.end());
+}
+
+InvocationStats Telemetry::getTotals(unsigned &NumInvocations,
+                                     unsigned &NumFromCache) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  NumInvocations = this->NumInvocations;
+  NumFromCache = this->NumFromCache;
+  return Totals;
+}
+
+} // end namespace seekbug
@@ -0,0 +1,368 @@
+//===-------- Triage.cpp --------------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/Triage.h"
+#include "seek-bug/AICommands.h"
+#include "seek-bug/CrashSignature.h"
+
+#include <lldb/API/SBDebugger.h>
+#include <lldb/API/SBProcess.h>
+#include <lldb/API/SBTarget.h>
+#include <lldb/API/SBThread.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <map>
+#include <thread>
+#include <vector>
+
+namespace seekbug {
+
+// How many tokens the analysis of one crash may have.
+static constexpr int TriageAnswerTokens = 256;
+
+/// Set by the first Ctrl-C while the model runs. That ends the analysis
+/// early, and the results so far are still written; a second Ctrl-C ends
+/// the process.
+static std::atomic<bool> AnalysisInterrupted{false};
+
+static void handleAnalysisInterrupt(int) {
+  AnalysisInterrupted = true;
+  std::signal(SIGINT, SIG_DFL);
+}
+
+/// Model output is not guaranteed to be valid UTF-8, which JSON requires.
+static std::string sanitizeUTF8(std::string Text) {
+  if (llvm::json::isUTF8(Text))
+    return Text;
+  return llvm::json::fixUTF8(Text);
+}
+
+int runTriageWorker(const std::string &Program, const std::string &CorePath,
+                    const std::string &OutputPath) {
+  llvm::json::Object Result{{"core", CorePath}};
+
+  lldb::SBDebugger::Initialize();
+  lldb::SBDebugger Debugger = lldb::SBDebugger::Create(false);
+  Debugger.SetAsync(false);
+  lldb::SBTarget Target = Debugger.CreateTarget(Program.c_str());
+  lldb::SBProcess Process;
+  if (Target.IsValid())
+    Process = Target.LoadCore(CorePath.c_str());
+  lldb::SBThread Thread;
+  if (Process.IsValid())
+    Thread = Process.GetSelectedThread();
+
+  if (!Target.IsValid()) {
+    Result["error"] = "Failed to create target for " + Program;
+  } else if (!Process.IsValid()) {
+    Result["error"] = "Failed to load core file";
+  } else if (!Thread.IsValid()) {
+    Result["error"] = "No valid thread in the core file";
+  } else {
+    CrashSignature Signature = computeCrashSignature(Thread);
+    Result["hash"] = Signature.getHashString();
+    Result["build_hash"] = llvm::utohexstr(Signature.getBuildHash());
+    Result["signature"] = sanitizeUTF8(Signature.Text);
+
+    llvm::json::Array Frames;
+    for (const StackFrameInfo &Frame : collectStackFrames(Thread))
+      Frames.push_back(llvm::json::Object{{"index", (int64_t)Frame.Index},
+                                          {"function",
+                                           sanitizeUTF8(Frame.Function)},
+                                          {"path", Frame.Path},
+                                          {"line", (int64_t)Frame.Line}});
+    Result["frames"] = std::move(Frames);
+  }
+
+  lldb::SBDebugger::Destroy(Debugger);
+  lldb::SBDebugger::Terminate();
+
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(OutputPath, EC);
+  if (EC)
+    return 1;
+  OS << llvm::json::Value(std::move(Result)) << "\n";
+  return 0;
+}
+
+/// The cores named by \p Input: the files of a directory, or the lines of a
+/// list file.
+static bool collectCores(const std::string &Input,
+                         std::vector<std::string> &Cores) {
+  if (llvm::sys::fs::is_directory(Input)) {
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator It(Input, EC), End;
+         It != End && !EC; It.increment(EC))
+      if (llvm::sys::fs::is_regular_file(It->path()))
+        Cores.push_back(It->path());
+    std::sort(Cores.begin(), Cores.end());
+    return !EC;
+  }
+
+  auto Buffer = llvm::MemoryBuffer::getFile(Input);
+  if (!Buffer)
+    return false;
+  llvm::SmallVector<llvm::StringRef, 64> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n', -1, /* KeepEmpty */ false);
+  for (llvm::StringRef Line : Lines) {
+    Line = Line.trim();
+    if (!Line.empty() && Line.front() != '#')
+      Cores.push_back(Line.str());
+  }
+  return true;
+}
+
+/// What a worker found out about one core.
+struct CoreReport {
+  std::string Core;
+  std::string Error;
+  std::string Hash;
+  uint64_t BuildHash = 0;
+  std::string Signature;
+  std::vector<StackFrameInfo> Frames;
+};
+
+static CoreReport readWorkerReport(const std::string &Core,
+                                   const std::string &Path) {
+  CoreReport Report;
+  Report.Core = Core;
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    Report.Error = "Worker produced no result";
+    return Report;
+  }
+  llvm::Expected<llvm::json::Value> Parsed =
+      llvm::json::parse((*Buffer)->getBuffer());
+  if (!Parsed) {
+    Report.Error = llvm::toString(Parsed.takeError());
+    return Report;
+  }
+  const llvm::json::Object *Object = Parsed->getAsObject();
+  if (!Object) {
+    Report.Error = "Malformed worker result";
+    return Report;
+  }
+  if (auto Error = Object->getString("error")) {
+    Report.Error = Error->str();
+    return Report;
+  }
+  if (auto Hash = Object->getString("hash"))
+    Report.Hash = Hash->str();
+  if (auto BuildHash = Object->getString("build_hash"))
+    BuildHash->getAsInteger(16, Report.BuildHash);
+  if (auto Signature = Object->getString("signature"))
+    Report.Signature = Signature->str();
+  if (const llvm::json::Array *Frames = Object->getArray("frames")) {
+    for (const llvm::json::Value &Value : *Frames) {
+      const llvm::json::Object *Frame = Value.getAsObject();
+      if (!Frame)
+        continue;
+      StackFrameInfo Info;
+      if (auto Index = Frame->getInteger("index"))
+        Info.Index = *Index;
+      if (auto Function = Frame->getString("function"))
+        Info.Function = Function->str();
+      if (auto FramePath = Frame->getString("path"))
+        Info.Path = FramePath->str();
+      if (auto Line = Frame->getInteger("line"))
+        Info.Line = *Line;
+      Report.Frames.push_back(std::move(Info));
+    }
+  }
+  return Report;
+}
+
+/// Load every core in a worker process of its own, \p Jobs at a time.
+/// Loading a core is mostly symbol parsing, which runs single-threaded
+/// inside LLDB, so separate processes are what uses the whole machine.
+static std::vector<CoreReport>
+loadCores(const TriageOptions &Options, const std::vector<std::string> &Cores) {
+  std::vector<CoreReport> Reports(Cores.size());
+  std::atomic<size_t> Next{0};
+  std::atomic<size_t> NumDone{0};
+
+  auto work = [&] {
+    for (size_t I = Next++; I < Cores.size(); I = Next++) {
+      llvm::SmallString<128> OutputPath;
+      if (llvm::sys::fs::createTemporaryFile("seek-bug-triage", "json",
+                                             OutputPath)) {
+        Reports[I].Core = Cores[I];
+        Reports[I].Error = "Could not create a temporary file";
+        continue;
+      }
+
+      std::string CoreArg = "--triage-worker=" + Cores[I];
+      std::string OutputArg =
+          "--triage-worker-output=" + std::string(OutputPath);
+      llvm::StringRef Args[] = {Options.SelfPath, CoreArg, OutputArg,
+                                Options.Program};
+      std::string ErrorMessage;
+      int Status = llvm::sys::ExecuteAndWait(
+          Options.SelfPath, Args, /*Env=*/{},
+          {llvm::StringRef(""), llvm::StringRef(""), llvm::StringRef("")},
+          /*SecondsToWait=*/0, /*MemoryLimit=*/0, &ErrorMessage);
+
+      Reports[I] = readWorkerReport(Cores[I], std::string(OutputPath));
+      if (Status != 0 && Reports[I].Error.empty() && Reports[I].Hash.empty())
+        Reports[I].Error = "Worker failed: " + ErrorMessage;
+      llvm::sys::fs::remove(OutputPath);
+
+      size_t Done = ++NumDone;
+      if (Done % 10 == 0 || Done == Cores.size())
+        llvm::WithColor(llvm::errs(), llvm::HighlightColor::Remark)
+            << "[" << Done << "/" << Cores.size() << " cores loaded]\n";
+    }
+  };
+
+  unsigned NumWorkers = Options.Jobs ? Options.Jobs
+                                     : std::max(1u,
+                                                std::thread::hardware_concurrency());
+  NumWorkers = std::min<size_t>(NumWorkers, std::max<size_t>(1, Cores.size()));
+  std::vector<std::thread> Workers;
+  for (unsigned I = 0; I < NumWorkers; ++I)
+    Workers.emplace_back(work);
+  for (std::thread &Worker : Workers)
+    Worker.join();
+  return Reports;
+}
+
+int runTriage(SeekBugContext &Context, const TriageOptions &Options) {
+  std::vector<std::string> Cores;
+  if (!collectCores(Options.Input, Cores)) {
+    llvm::WithColor::error() << "Cannot read cores from " << Options.Input
+                             << "\n";
+    return 1;
+  }
+  if (!Context.Sources)
+    Context.Sources = std::make_shared<SourceCache>();
+  if (!Context.Crashes)
+    Context.Crashes =
+        std::make_shared<CrashIndex>(CrashIndex::getDefaultDirectory());
+
+  std::vector<CoreReport> Reports = loadCores(Options, Cores);
+
+  // Group the cores by signature, in the order the crashes were first seen.
+  struct Bucket {
+    const CoreReport *First = nullptr;
+    std::vector<std::string> Cores;
+  };
+  std::vector<Bucket> Buckets;
+  std::map<std::string, size_t> BucketIndex;
+  std::vector<const CoreReport *> Failures;
+  for (const CoreReport &Report : Reports) {
+    if (!Report.Error.empty()) {
+      Failures.push_back(&Report);
+      continue;
+    }
+    auto Inserted = BucketIndex.insert({Report.Hash, Buckets.size()});
+    if (Inserted.second)
+      Buckets.push_back({&Report, {}});
+    Buckets[Inserted.first->second].Cores.push_back(Report.Core);
+  }
+  llvm::WithColor(llvm::errs(), llvm::HighlightColor::String)
+      << Cores.size() << " cores, " << Buckets.size() << " distinct crashes, "
+      << Failures.size() << " failed to load.\n";
+
+  // Crashes analyzed before are answered from the crash index. The others
+  // all share the crash-elaborate preamble, so they are analyzed side by
+  // side.
+  std::vector<std::string> Analyses(Buckets.size());
+  std::vector<size_t> Unknown;
+  std::vector<std::string> Prompts;
+  std::string Preamble;
+  for (size_t I = 0; I < Buckets.size(); ++I) {
+    const CoreReport &First = *Buckets[I].First;
+    CrashIndex::Entry Known;
+    if (Context.Crashes->recordOccurrence(First.BuildHash, Known,
+                                          Buckets[I].Cores.size())) {
+      Analyses[I] = Known.Analysis;
+      continue;
+    }
+    LLMRequest Answer;
+    Answer.MaxNewTokens = TriageAnswerTokens;
+    LLMRequest Request =
+        createCrashElaboratePrompt(Context, First.Frames, "", Answer);
+    Preamble = Request.Preamble;
+    Prompts.push_back(Request.Prompt);
+    Unknown.push_back(I);
+  }
+  llvm::WithColor(llvm::errs(), llvm::HighlightColor::String)
+      << Buckets.size() - Unknown.size() << " crashes known, analyzing "
+      << Unknown.size() << ".\n";
+  bool Ok = true;
+  if (!Prompts.empty()) {
+    std::vector<std::string> Answers;
+    std::string Error;
+    auto Deadline = std::chrono::steady_clock::time_point::max();
+    if (Options.DeadlineMs)
+      Deadline = std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(Options.DeadlineMs);
+    {
+      std::lock_guard<std::mutex> Lock(Context.Engine->getMutex());
+      AnalysisInterrupted = false;
+      auto PreviousHandler = std::signal(SIGINT, handleAnalysisInterrupt);
+      Ok = Context.Engine->generateBatch(Preamble, Prompts, TriageAnswerTokens,
+                                         Context.Sampling, Answers,
+                                         &AnalysisInterrupted, Deadline, Error);
+      std::signal(SIGINT, PreviousHandler);
+    }
+    for (size_t J = 0; J < Unknown.size(); ++J) {
+      const std::string &Answer = J < Answers.size() ? Answers[J] : Error;
+      Analyses[Unknown[J]] = Answer.empty() && !Ok ? Error : Answer;
+      // Only complete analyses are worth remembering.
+      if (Ok && !Answer.empty() && Answer.front() != '[' &&
+          Answer.find("[truncated") == std::string::npos)
+        Context.Crashes->store(Buckets[Unknown[J]].First->BuildHash,
+                               Buckets[Unknown[J]].First->Signature, Answer,
+                               Buckets[Unknown[J]].Cores.size());
+    }
+  }
+
+  std::error_code EC;
+  std::string OutputPath = Options.OutputPath.empty() ? "-"
+                                                      : Options.OutputPath;
+  llvm::raw_fd_ostream OS(OutputPath, EC);
+  if (EC) {
+    llvm::WithColor::error() << "Cannot write " << OutputPath << ": "
+                             << EC.message() << "\n";
+    return 1;
+  }
+  for (size_t I = 0; I < Buckets.size(); ++I) {
+    llvm::json::Array BucketCores;
+    for (const std::string &Core : Buckets[I].Cores)
+      BucketCores.push_back(Core);
+    OS << llvm::json::Value(llvm::json::Object{
+              {"hash", Buckets[I].First->Hash},
+              {"signature", Buckets[I].First->Signature},
+              {"count", (int64_t)Buckets[I].Cores.size()},
+              {"cores", std::move(BucketCores)},
+              {"analysis", sanitizeUTF8(Analyses[I])}})
+       << "\n";
+  }
+  for (const CoreReport *Failure : Failures)
+    OS << llvm::json::Value(llvm::json::Object{{"core", Failure->Core},
+                                               {"error", Failure->Error}})
+       << "\n";
+  // The results are written either way; scripts still need to know.
+  bool NoCoreLoaded = Buckets.empty() && !Failures.empty();
+  return NoCoreLoaded || !Ok ? 1 : 0;
+}
+
+} // end namespace seekbug
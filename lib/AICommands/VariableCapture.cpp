@@ -0,0 +1,170 @@
+//===-------- VariableCapture.cpp -----------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/VariableCapture.h"
+#include "seek-bug/StackEncoder.h"
+
+#include <lldb/API/SBProcess.h>
+#include <lldb/API/SBThread.h>
+#include <lldb/API/SBType.h>
+#include <lldb/API/SBValueList.h>
+
+namespace seekbug {
+
+using Clock = std::chrono::steady_clock;
+
+std::string CapturedVariable::format() const {
+  std::string Text = Name;
+  if (!Type.empty())
+    Text += " (" + Type + ")";
+  return Text + " = " + Value + "\n";
+}
+
+std::string VariableSnapshot::format() const {
+  std::string Text;
+  for (const CapturedVariable &Variable : Variables)
+    Text += Variable.format();
+  if (Truncated)
+    Text += "(more variables not shown)\n";
+  return Text;
+}
+
+VariableCapture::VariableCapture(VariableCaptureLimits Limits)
+    : Limits(Limits) {}
+
+std::string VariableCapture::clip(const char *Text) const {
+  std::string Clipped = Text ? Text : "";
+  if (Clipped.size() > Limits.MaxValueLength)
+    Clipped = Clipped.substr(0, Limits.MaxValueLength) + "...";
+  return Clipped;
+}
+
+std::string VariableCapture::formatChildren(lldb::SBValue &Value,
+                                            unsigned Depth,
+                                            CaptureState &State) {
+  // Asking for one more than is shown tells whether there are more, without
+  // counting all elements of a huge container.
+  uint32_t NumChildren = Value.GetNumChildren(Limits.MaxChildren + 1);
+  if (NumChildren == 0)
+    return "{}";
+
+  std::string Text = "{";
+  for (uint32_t I = 0; I < NumChildren; ++I) {
+    if (I != 0)
+      Text += ", ";
+    if (I == Limits.MaxChildren || Clock::now() >= State.Deadline) {
+      State.OutOfTime |= I != Limits.MaxChildren;
+      Text += "...";
+      break;
+    }
+    lldb::SBValue Child = Value.GetChildAtIndex(I);
+    if (const char *Name = Child.GetName())
+      Text += std::string(Name) + "=";
+    Text += formatValue(Child, Depth + 1, State);
+  }
+  return Text + "}";
+}
+
+std::string VariableCapture::formatValue(lldb::SBValue &Value, unsigned Depth,
+                                         CaptureState &State) {
+  if (!Value.IsValid())
+    return "<unavailable>";
+  const char *Text = Value.GetValue();
+  const char *Summary = Value.GetSummary();
+
+  if (Value.GetType().IsPointerType()) {
+    // A summary of a pointer is what it points to, like a C string.
+    if (Summary)
+      return clip(Text) + " " + clip(Summary);
+    // Follow the pointer only while there is budget left, and only to
+    // addresses not seen before in this capture.
+    uint64_t Address = Value.GetValueAsUnsigned(0);
+    if (Address == 0 || Depth >= Limits.MaxDepth ||
+        State.Dereferences >= Limits.MaxDereferences ||
+        !State.VisitedAddresses.insert(Address).second)
+      return clip(Text);
+    ++State.Dereferences;
+    lldb::SBValue Pointee = Value.Dereference();
+    return clip(Text) + " -> " + formatValue(Pointee, Depth + 1, State);
+  }
+
+  if (Text)
+    return clip(Text);
+  // Containers have a summary like "size=3" and their elements as synthetic
+  // children; other summaries, like those of strings, say it all.
+  if (Summary && !Value.IsSynthetic())
+    return clip(Summary);
+  if (!Value.MightHaveChildren())
+    return Summary ? clip(Summary) : "<unavailable>";
+  std::string Prefix = Summary ? clip(Summary) + " " : "";
+  if (Depth >= Limits.MaxDepth)
+    return Prefix + "{...}";
+  return Prefix + formatChildren(Value, Depth, State);
+}
+
+VariableSnapshot VariableCapture::capture(lldb::SBFrame &Frame) {
+  VariableSnapshot Snapshot;
+  if (!Frame.IsValid())
+    return Snapshot;
+
+  lldb::SBThread Thread = Frame.GetThread();
+  lldb::SBProcess Process = Thread.GetProcess();
+  std::lock_guard<std::mutex> Lock(Mutex);
+  // Values only change while the process runs.
+  uint64_t ProcessID = Process.GetProcessID();
+  uint32_t StopID = Process.GetStopID();
+  if (ProcessID != CachedProcessID || StopID != CachedStopID) {
+    Cache.clear();
+    CachedProcessID = ProcessID;
+    CachedStopID = StopID;
+  }
+
+  CaptureState State;
+  State.Deadline = Clock::now() + Limits.TimeBudget;
+  lldb::SBValueList Values = Frame.GetVariables(
+      /*arguments=*/true, /*locals=*/true, /*statics=*/false,
+      /*in_scope_only=*/true);
+  size_t NumBytes = 0;
+  for (uint32_t I = 0; I < Values.GetSize(); ++I) {
+    if (Snapshot.Variables.size() == Limits.MaxVariables || State.OutOfTime ||
+        Clock::now() >= State.Deadline) {
+      Snapshot.Truncated = true;
+      break;
+    }
+    lldb::SBValue Value = Values.GetValueAtIndex(I);
+    const char *Name = Value.GetName();
+    if (!Name)
+      continue;
+
+    auto Key = std::make_tuple(Thread.GetThreadID(), Frame.GetCFA(),
+                               std::string(Name));
+    auto Cached = Cache.find(Key);
+    CapturedVariable Variable;
+    if (Cached != Cache.end()) {
+      Variable = Cached->second;
+    } else {
+      Variable.Name = Name;
+      if (const char *Type = Value.GetDisplayTypeName())
+        Variable.Type = shortenSymbolName(Type);
+      Variable.Value = formatValue(Value, 0, State);
+      // A value cut short by the time budget may be complete next time.
+      if (!State.OutOfTime)
+        Cache.emplace(Key, Variable);
+    }
+
+    size_t Size = Variable.format().size();
+    if (NumBytes + Size > Limits.MaxBytes) {
+      Snapshot.Truncated = true;
+      break;
+    }
+    NumBytes += Size;
+    Snapshot.Variables.push_back(std::move(Variable));
+  }
+  return Snapshot;
+}
+
+} // end namespace seekbug
@@ -1,18 +1,39 @@
 #include "seek-bug/llm.h"
+#include "seek-bug/Autotune.h"
+#include "seek-bug/DaemonProtocol.h"
 
 #include "llama.h"
 
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/WithColor.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
 // Example: discard all llama.cpp logs
 static void llama_null_log_callback(enum ggml_log_level level, const char *text,
                                     void *user_data) {
@@ -21,84 +42,1340 @@ static void llama_null_log_callback(enum ggml_log_level level, const char *text,
   (void)user_data;
 }
 
-std::string runLLM(const std::string &prompt, const std::string &modelPath) {
-  if (const char* debugEnv = std::getenv("DEBUG_SEEKBUG")) {
-    if (std::string(debugEnv) == "1") {
-      llvm::WithColor(llvm::outs(), llvm::HighlightColor::String)
-          << "The prompt is: " << prompt << "\n";
-    }
+// How many tokens an answer may have at most.
+static constexpr int MaxNewTokens = 256;
+
+// Size of the context window, shared by the prompt and the answer.
+static constexpr uint32_t ContextSize = 4096;
+
+// An answer that has the same run of this many tokens this many times is
+// looping, and is cut off there.
+static constexpr size_t LoopNGramSize = 16;
+static constexpr unsigned LoopNGramRepeats = 3;
+
+// How many tokens the draft model proposes per decode of the main model.
+static constexpr int SpeculativeDraftTokens = 6;
+
+// The low memory profile sizes the context for prompts of this many tokens,
+// unless a prompt token budget is given, plus this many for the preamble.
+static constexpr size_t LowMemoryPromptTokens = 1536;
+static constexpr size_t PreambleTokenAllowance = 256;
+
+// Models of the same family may differ by a few added special tokens.
+static constexpr int MaxDraftVocabDifference = 128;
+
+// The answer when a request's deadline passes before the first token.
+static constexpr char DeadlineBeforeAnswer[] =
+    "[truncated: deadline reached before the answer started]";
+
+namespace seekbug {
+
+void applyEngineOptions(const LLMEngineOptions &Options,
+                        llama_context_params &Params) {
+  if (Options.Threads)
+    Params.n_threads = Options.Threads;
+  if (Options.BatchThreads)
+    Params.n_threads_batch = Options.BatchThreads;
+  if (Options.BatchSize)
+    Params.n_batch = Options.BatchSize;
+  if (Options.UBatchSize)
+    Params.n_ubatch = Options.UBatchSize;
+  if (Options.ContextSize)
+    Params.n_ctx = Options.ContextSize;
+  // llama.cpp only supports a quantized V cache with flash attention.
+  if (Options.QuantizeKVCache) {
+    Params.type_k = GGML_TYPE_Q8_0;
+    Params.type_v = GGML_TYPE_Q8_0;
+    Params.flash_attn = true;
   }
+  // A micro-batch cannot be larger than the batch it is taken from.
+  Params.n_ubatch = std::min(Params.n_ubatch, Params.n_batch);
+}
 
-  llvm::WithColor(llvm::outs(), llvm::HighlightColor::String)
-      << "DeepSeek is thinking...\n";
+// Hashing the whole multi-gigabyte model would defeat the purpose of caching,
+// so identify it by size, modification time and the GGUF header instead.
+uint64_t computeModelFingerprint(const std::string &ModelPath) {
+  llvm::sys::fs::file_status Status;
+  if (llvm::sys::fs::status(ModelPath, Status))
+    return 0;
 
-  // Load the model
-  llama_model_params model_params = llama_model_default_params();
+  std::string Key = std::to_string(Status.getSize()) + ":" +
+                    std::to_string(Status.getLastModificationTime()
+                                       .time_since_epoch()
+                                       .count());
+  constexpr uint64_t HeaderSize = 1 << 20;
+  auto Header = llvm::MemoryBuffer::getFileSlice(
+      ModelPath, std::min<uint64_t>(HeaderSize, Status.getSize()), 0);
+  if (Header)
+    Key += (*Header)->getBuffer();
+  return llvm::xxHash64(Key);
+}
+
+void applyLowMemoryProfile(LLMEngineOptions &Options, size_t PromptTokenBudget,
+                           int MaxNewTokens) {
+  size_t NumTokens =
+      (PromptTokenBudget ? PromptTokenBudget : LowMemoryPromptTokens) +
+      PreambleTokenAllowance +
+      (MaxNewTokens > 0 ? MaxNewTokens : ::MaxNewTokens);
+  // Round up to the granularity of the KV cache.
+  NumTokens = (NumTokens + 255) / 256 * 256;
+  Options.ContextSize = std::min<size_t>(NumTokens, ContextSize);
+  Options.QuantizeKVCache = true;
+}
+
+size_t getResidentMemory() {
+#if defined(__linux__)
+  // The second field is the resident set, in pages.
+  std::FILE *Statm = std::fopen("/proc/self/statm", "r");
+  if (!Statm)
+    return 0;
+  unsigned long Size = 0, Resident = 0;
+  int NumRead = std::fscanf(Statm, "%lu %lu", &Size, &Resident);
+  std::fclose(Statm);
+  return NumRead == 2 ? Resident * (size_t)::sysconf(_SC_PAGESIZE) : 0;
+#elif defined(__APPLE__)
+  mach_task_basic_info Info;
+  mach_msg_type_number_t Count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                reinterpret_cast<task_info_t>(&Info), &Count) != KERN_SUCCESS)
+    return 0;
+  return Info.resident_size;
+#else
+  return 0;
+#endif
+}
+
+std::string getMemoryReport(const LLMEngine &Engine) {
+  std::string Report;
+  llvm::raw_string_ostream OS(Report);
+  if (llama_context *Ctx = Engine.getContext())
+    OS << "context of " << llama_n_ctx(Ctx) << " tokens, "
+       << (Engine.getOptions().QuantizeKVCache ? "q8_0" : "f16")
+       << " KV cache, ";
+  size_t Resident = getResidentMemory();
+  if (Resident)
+    OS << llvm::format("%.2f", Resident / (1024.0 * 1024 * 1024))
+       << " GiB resident";
+  else
+    OS << "resident memory unknown";
+  return OS.str();
+}
+
+bool setCPUAffinity(const std::string &Spec, std::string &Error) {
+#ifdef __linux__
+  cpu_set_t Set;
+  CPU_ZERO(&Set);
+  llvm::SmallVector<llvm::StringRef, 8> Ranges;
+  llvm::StringRef(Spec).split(Ranges, ',', -1, /*KeepEmpty=*/false);
+  for (llvm::StringRef Range : Ranges) {
+    std::pair<llvm::StringRef, llvm::StringRef> Bounds = Range.trim().split('-');
+    unsigned First, Last;
+    if (Bounds.first.getAsInteger(10, First)) {
+      Error = "Invalid CPU list: " + Spec;
+      return false;
+    }
+    Last = First;
+    if (!Bounds.second.empty() && Bounds.second.getAsInteger(10, Last)) {
+      Error = "Invalid CPU list: " + Spec;
+      return false;
+    }
+    for (unsigned CPU = First; CPU <= Last && CPU < CPU_SETSIZE; ++CPU)
+      CPU_SET(CPU, &Set);
+  }
+  if (CPU_COUNT(&Set) == 0) {
+    Error = "Invalid CPU list: " + Spec;
+    return false;
+  }
+  if (sched_setaffinity(0, sizeof(Set), &Set) != 0) {
+    Error = "Cannot set CPU affinity: " + std::string(std::strerror(errno));
+    return false;
+  }
+  return true;
+#else
+  (void)Spec;
+  Error = "CPU affinity is not supported on this platform.";
+  return false;
+#endif
+}
 
+std::unique_ptr<LLMEngine> LLMEngine::create(const std::string &ModelPath,
+                                             std::string &Error,
+                                             const LLMEngineOptions &Options) {
   // Optionally disable logs:
   llama_log_set(llama_null_log_callback, nullptr);
 
-  llama_model *model =
-      llama_load_model_from_file(modelPath.c_str(), model_params);
-  if (!model) {
-    return "[Error] Could not load model from " + modelPath;
+  std::unique_ptr<LLMEngine> Engine(new LLMEngine());
+  Engine->ModelPath = ModelPath;
+  Engine->ModelFingerprint = computeModelFingerprint(ModelPath);
+
+  // Whatever was not given explicitly comes from the autotuned profile.
+  Engine->Options = Options;
+  LLMEngineOptions Tuned;
+  if (loadTunedProfile(Engine->ModelFingerprint, Tuned)) {
+    LLMEngineOptions &Chosen = Engine->Options;
+    if (!Chosen.Threads)
+      Chosen.Threads = Tuned.Threads;
+    if (!Chosen.BatchThreads)
+      Chosen.BatchThreads = Tuned.BatchThreads;
+    if (!Chosen.BatchSize)
+      Chosen.BatchSize = Tuned.BatchSize;
+    if (!Chosen.UBatchSize)
+      Chosen.UBatchSize = Tuned.UBatchSize;
+  }
+  // A step of generateBatch() decodes a token of every sequence, and one of
+  // speculative decoding the token and its draft, in a single batch.
+  if (Engine->Options.BatchSize)
+    Engine->Options.BatchSize = std::max<unsigned>(
+        {Engine->Options.BatchSize, MaxParallelSequences,
+         SpeculativeDraftTokens + 1});
+  // Before llama.cpp starts any threads, so that they inherit it.
+  if (!Engine->Options.CPUAffinity.empty() &&
+      !setCPUAffinity(Engine->Options.CPUAffinity, Error))
+    return nullptr;
+
+  // Load the model
+  auto LoadStart = std::chrono::steady_clock::now();
+  llama_model_params model_params = llama_model_default_params();
+  model_params.use_mmap = Engine->Options.UseMMap;
+  model_params.use_mlock = Engine->Options.LockMemory;
+  Engine->Model = llama_load_model_from_file(ModelPath.c_str(), model_params);
+  if (!Engine->Model) {
+    Error = "Could not load model from " + ModelPath;
+    return nullptr;
   }
 
-  // Create a context from the model
+  // Create a context from the model. It is reused by every request.
   llama_context_params ctx_params = llama_context_default_params();
-  llama_context *ctx = llama_init_from_model(model, ctx_params);
-  if (!ctx) {
-    llama_free_model(model);
-    return "[Error] Could not create llama context from model.";
+  ctx_params.n_ctx = ContextSize;
+  // Sequence 0, the parallel sequences of generateBatch() and the chat.
+  ctx_params.n_seq_max = LLMEngine::ChatSequence + 1;
+  // Keep llama.cpp's timing counters for `ai stats`.
+  ctx_params.no_perf = false;
+  applyEngineOptions(Engine->Options, ctx_params);
+  Engine->Ctx = llama_init_from_model(Engine->Model, ctx_params);
+  if (!Engine->Ctx) {
+    Error = "Could not create llama context from model.";
+    return nullptr;
+  }
+
+  // Long prefills can be abandoned, e.g. when a speculative prefill becomes
+  // stale.
+  llama_set_abort_callback(Engine->Ctx, &LLMEngine::shouldAbortDecode,
+                           Engine.get());
+
+  // We need the vocab to tokenize
+  Engine->Vocab = llama_model_get_vocab(Engine->Model);
+  if (!Engine->Vocab) {
+    Error = "Could not retrieve vocab from model.";
+    return nullptr;
+  }
+
+  Engine->LoadTime = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - LoadStart)
+                         .count();
+  return Engine;
+}
+
+std::unique_ptr<LLMEngine>
+LLMEngine::createForDaemon(const std::string &ModelPath,
+                           const std::string &SocketPath, std::string &Error) {
+  llama_log_set(llama_null_log_callback, nullptr);
+
+  // Fail early rather than on the first AI command.
+  int FD = connectToDaemon(SocketPath, Error);
+  if (FD < 0)
+    return nullptr;
+  std::unique_ptr<LLMEngine> Engine(new LLMEngine());
+  bool GotInfo = requestDaemonInfo(FD, Engine->RemoteContextSize);
+  ::close(FD);
+  if (!GotInfo) {
+    Error = "seek-bugd at " + SocketPath + " did not report its context size";
+    return nullptr;
   }
 
-  // 3) We need the vocab to tokenize
-  const struct llama_vocab *vocab = llama_model_get_vocab(model);
-  if (!vocab) {
-    llama_free(ctx);
-    llama_free_model(model);
-    return "[Error] Could not retrieve vocab from model.";
+  Engine->ModelPath = ModelPath;
+  Engine->DaemonSocket = SocketPath;
+  Engine->ModelFingerprint = computeModelFingerprint(ModelPath);
+
+  // The weights stay in the daemon; tokenizing needs the vocabulary only.
+  auto LoadStart = std::chrono::steady_clock::now();
+  llama_model_params model_params = llama_model_default_params();
+  model_params.vocab_only = true;
+  Engine->Model = llama_load_model_from_file(ModelPath.c_str(), model_params);
+  if (!Engine->Model) {
+    Error = "Could not load model vocabulary from " + ModelPath;
+    return nullptr;
   }
+  Engine->Vocab = llama_model_get_vocab(Engine->Model);
+  if (!Engine->Vocab) {
+    Error = "Could not retrieve vocab from model.";
+    return nullptr;
+  }
+  Engine->LoadTime = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - LoadStart)
+                         .count();
+  return Engine;
+}
 
-  // Tokenize the prompt.
+LLMEngine::~LLMEngine() {
+  if (DraftCtx)
+    llama_free(DraftCtx);
+  if (DraftModel)
+    llama_free_model(DraftModel);
+  if (Ctx)
+    llama_free(Ctx);
+  if (Model)
+    llama_free_model(Model);
+}
+
+size_t LLMEngine::getMaxPromptTokens(int NumNewTokens) const {
+  uint32_t NumCtx = Ctx ? llama_n_ctx(Ctx) : RemoteContextSize;
+  size_t Reserved =
+      (NumNewTokens > 0 ? NumNewTokens : MaxNewTokens) + ReservedTokens;
+  return NumCtx > Reserved ? NumCtx - Reserved : 0;
+}
+
+bool LLMEngine::tokenize(const std::string &Text, bool AddSpecial,
+                         std::vector<llama_token> &Tokens) const {
+  // Tokenize the text.
   // This older API typically has the signature:
   //   llama_tokenize(vocab, text, text_len, tokens, n_tokens_max,
   //                  bool add_special, bool parse_special);
-  std::vector<llama_token> prompt_tokens(2048);
-  int n_prompt =
-      llama_tokenize(vocab, prompt.c_str(), (int32_t)prompt.size(),
-                     prompt_tokens.data(), (int32_t)prompt_tokens.size(),
-                     /* add_special  */ true,
-                     /* parse_special */ true);
-  if (n_prompt < 0) {
-    llama_free(ctx);
-    llama_free_model(model);
-    return "[Error] Failed to tokenize prompt.";
-  }
-  prompt_tokens.resize(n_prompt);
+  // A token covers at least one byte, so this is almost always enough. If it
+  // is not, llama_tokenize returns the negated number of tokens needed.
+  Tokens.resize(Text.size() + 2);
+  int NumTokens = llama_tokenize(Vocab, Text.c_str(), (int32_t)Text.size(),
+                                 Tokens.data(), (int32_t)Tokens.size(),
+                                 AddSpecial,
+                                 /* parse_special */ true);
+  if (NumTokens < 0) {
+    Tokens.resize(-NumTokens);
+    NumTokens = llama_tokenize(Vocab, Text.c_str(), (int32_t)Text.size(),
+                               Tokens.data(), (int32_t)Tokens.size(),
+                               AddSpecial,
+                               /* parse_special */ true);
+  }
+  if (NumTokens < 0) {
+    Tokens.clear();
+    return false;
+  }
+  Tokens.resize(NumTokens);
+  return true;
+}
+
+size_t LLMEngine::countTokens(const std::string &Text) const {
+  std::vector<llama_token> Tokens;
+  if (!tokenize(Text, /* AddSpecial */ false, Tokens))
+    return Text.size();
+  return Tokens.size();
+}
+
+void LLMEngine::resetCache() {
+  // Only sequence 0 is ours; the others may be in use by a daemon.
+  llama_kv_cache_seq_rm(Ctx, 0, -1, -1);
+  CachedTokens.clear();
+}
+
+bool LLMEngine::shouldAbortDecode(void *Data) {
+  const LLMEngine *Engine = static_cast<LLMEngine *>(Data);
+  const std::atomic<bool> *Cancel = Engine->ActiveCancel;
+  return (Cancel && *Cancel) ||
+         std::chrono::steady_clock::now() >= Engine->ActiveDeadline;
+}
+
+bool LLMEngine::prefill(const std::vector<llama_token> &Tokens,
+                        const std::atomic<bool> *Cancel,
+                        std::chrono::steady_clock::time_point Deadline) {
+  size_t NumCommon = 0;
+  while (NumCommon < Tokens.size() && NumCommon < CachedTokens.size() &&
+         Tokens[NumCommon] == CachedTokens[NumCommon])
+    ++NumCommon;
+  // At least one token has to be decoded, so that there are logits to
+  // sample the first generated token from.
+  if (NumCommon == Tokens.size() && NumCommon > 0)
+    --NumCommon;
+
+  if (!llama_kv_cache_seq_rm(Ctx, 0, (llama_pos)NumCommon, -1)) {
+    resetCache();
+    NumCommon = 0;
+  }
+  CachedTokens.resize(NumCommon);
+  if (NumCommon == Tokens.size())
+    return true;
+
+  // Positions are taken from the end of sequence 0, right after the part we
+  // kept. A single batch may not exceed n_batch tokens, and smaller batches
+  // also bound the size of the intermediate buffers.
+  std::vector<llama_token> Rest(Tokens.begin() + NumCommon, Tokens.end());
+  size_t ChunkSize = std::max<uint32_t>(1, llama_n_batch(Ctx));
+  for (size_t Begin = 0; Begin < Rest.size(); Begin += ChunkSize) {
+    if ((Cancel && *Cancel) || std::chrono::steady_clock::now() >= Deadline)
+      return false;
+
+    int32_t Size = (int32_t)std::min(ChunkSize, Rest.size() - Begin);
+    llama_batch Batch = llama_batch_get_one(Rest.data() + Begin, Size);
+    ActiveCancel = Cancel;
+    ActiveDeadline = Deadline;
+    int32_t Status = llama_decode(Ctx, Batch);
+    ActiveCancel = nullptr;
+    ActiveDeadline = std::chrono::steady_clock::time_point::max();
+    if (Status != 0) {
+      // Drop the cells of the failed or aborted chunk, but keep everything
+      // before it.
+      if (!llama_kv_cache_seq_rm(Ctx, 0, (llama_pos)CachedTokens.size(), -1))
+        resetCache();
+      return false;
+    }
+    CachedTokens.insert(CachedTokens.end(), Rest.begin() + Begin,
+                        Rest.begin() + Begin + Size);
+  }
+  return true;
+}
+
+bool LLMEngine::prefillRequest(const LLMRequest &Request, std::string &Error) {
+  // The request may have been cancelled while waiting for the engine.
+  if (Request.Cancel && *Request.Cancel) {
+    Error = "[cancelled]";
+    return false;
+  }
+  if (std::chrono::steady_clock::now() >= Request.Deadline) {
+    Error = DeadlineBeforeAnswer;
+    return false;
+  }
+  if (isRemote())
+    return true;
+
+  // The fixed preamble comes from the prefix cache; only the dynamic part of
+  // the prompt is tokenized and prefilled on every request. The chat
+  // template keeps it that way: the preamble becomes the system turn.
+  using Clock = std::chrono::steady_clock;
+  auto millisecondsSince = [](Clock::time_point Start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - Start)
+        .count();
+  };
+  LLMRequest Formatted = formatRequest(Request);
+  std::vector<llama_token> Tokens;
+  auto PreambleStart = Clock::now();
+  if (!Formatted.Preamble.empty() &&
+      !restorePreamble(Formatted.Preamble, Tokens)) {
+    Error = "[Error] Failed to prefill prompt preamble.";
+    return false;
+  }
+  double PreambleTime = millisecondsSince(PreambleStart);
+
+  auto TokenizeStart = Clock::now();
+  std::vector<llama_token> BodyTokens;
+  if (!tokenize(Formatted.Prompt, /* AddSpecial */ Formatted.Preamble.empty(),
+                BodyTokens)) {
+    Error = "[Error] Failed to tokenize prompt.";
+    return false;
+  }
+  Tokens.insert(Tokens.end(), BodyTokens.begin(), BodyTokens.end());
+  if (Request.Stats) {
+    Request.Stats->TokenizeTime += millisecondsSince(TokenizeStart);
+    Request.Stats->PromptTokens = Tokens.size();
+  }
+  size_t MaxPromptTokens = getMaxPromptTokens(getMaxNewTokens(Request));
+  if (Tokens.size() > MaxPromptTokens) {
+    Error = "[Error] Prompt is too long: " + std::to_string(Tokens.size()) +
+            " tokens, at most " + std::to_string(MaxPromptTokens) +
+            " fit in the context.";
+    return false;
+  }
 
   // Evaluate the prompt tokens (decode them) so the model sees the prompt
   // context
-  //    This older fork calls 'llama_decode(...)' with a 'llama_batch'.
-  llama_batch batch = llama_batch_get_one(prompt_tokens.data(), n_prompt);
-  if (llama_decode(ctx, batch) != 0) {
-    llama_free(ctx);
-    llama_free_model(model);
-    return "[Error] Failed to decode prompt tokens.";
+  auto PrefillStart = Clock::now();
+  bool Prefilled = prefill(Tokens, Request.Cancel, Request.Deadline);
+  if (Request.Stats)
+    Request.Stats->PrefillTime += PreambleTime + millisecondsSince(PrefillStart);
+  if (!Prefilled) {
+    if (Request.Cancel && *Request.Cancel)
+      Error = "[cancelled]";
+    else if (Clock::now() >= Request.Deadline)
+      Error = DeadlineBeforeAnswer;
+    else
+      Error = "[Error] Failed to decode prompt tokens.";
+    return false;
+  }
+  return true;
+}
+
+bool LLMEngine::decodeToken(llama_token Token) {
+  llama_batch Batch = llama_batch_get_one(&Token, 1);
+  if (llama_decode(Ctx, Batch) != 0) {
+    resetCache();
+    return false;
+  }
+  CachedTokens.push_back(Token);
+  return true;
+}
+
+void LLMEngine::truncateCache(size_t NumTokens) {
+  if (CachedTokens.size() <= NumTokens)
+    return;
+  if (!llama_kv_cache_seq_rm(Ctx, 0, (llama_pos)NumTokens, -1)) {
+    resetCache();
+    return;
+  }
+  CachedTokens.resize(NumTokens);
+}
+
+bool LLMEngine::loadDraftModel(const std::string &Path, std::string &Error) {
+  llama_model_params model_params = llama_model_default_params();
+  model_params.use_mmap = Options.UseMMap;
+  model_params.use_mlock = Options.LockMemory;
+  DraftModel = llama_load_model_from_file(Path.c_str(), model_params);
+  if (!DraftModel) {
+    Error = "Could not load draft model from " + Path;
+    return false;
   }
 
-  // Create a sampler chain (again, older API in some forks).
-  auto sparams = llama_sampler_chain_default_params();
-  llama_sampler *smpl = llama_sampler_chain_init(sparams);
+  // Drafted tokens are compared with the main model's by id, so both models
+  // have to number them the same way.
+  const llama_vocab *DraftVocab = llama_model_get_vocab(DraftModel);
+  if (!DraftVocab ||
+      std::abs(llama_vocab_n_tokens(DraftVocab) -
+               llama_vocab_n_tokens(Vocab)) > MaxDraftVocabDifference ||
+      llama_vocab_bos(DraftVocab) != llama_vocab_bos(Vocab) ||
+      llama_vocab_eos(DraftVocab) != llama_vocab_eos(Vocab)) {
+    Error = "The vocabulary of the draft model " + Path +
+            " does not match the one of the model.";
+    llama_free_model(DraftModel);
+    DraftModel = nullptr;
+    return false;
+  }
+
+  llama_context_params ctx_params = llama_context_default_params();
+  ctx_params.n_seq_max = 1;
+  applyEngineOptions(Options, ctx_params);
+  ctx_params.n_ctx = llama_n_ctx(Ctx);
+  DraftCtx = llama_init_from_model(DraftModel, ctx_params);
+  if (!DraftCtx) {
+    Error = "Could not create llama context from draft model.";
+    llama_free_model(DraftModel);
+    DraftModel = nullptr;
+    return false;
+  }
+  return true;
+}
 
-  // For demonstration, a greedy sampler:
-  llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+bool LLMEngine::draftTokens(const std::vector<llama_token> &Context,
+                            int MaxDraft, std::vector<llama_token> &Draft) {
+  // Same as prefill(), for the draft context.
+  size_t NumCommon = 0;
+  while (NumCommon < Context.size() && NumCommon < DraftCachedTokens.size() &&
+         Context[NumCommon] == DraftCachedTokens[NumCommon])
+    ++NumCommon;
+  if (NumCommon == Context.size() && NumCommon > 0)
+    --NumCommon;
+  if (!llama_kv_cache_seq_rm(DraftCtx, 0, (llama_pos)NumCommon, -1)) {
+    llama_kv_cache_seq_rm(DraftCtx, 0, -1, -1);
+    NumCommon = 0;
+  }
+  DraftCachedTokens.resize(NumCommon);
+
+  std::vector<llama_token> Rest(Context.begin() + NumCommon, Context.end());
+  size_t ChunkSize = std::max<uint32_t>(1, llama_n_batch(DraftCtx));
+  for (size_t Begin = 0; Begin < Rest.size(); Begin += ChunkSize) {
+    int32_t Size = (int32_t)std::min(ChunkSize, Rest.size() - Begin);
+    if (llama_decode(DraftCtx,
+                     llama_batch_get_one(Rest.data() + Begin, Size)) != 0) {
+      llama_kv_cache_seq_rm(DraftCtx, 0, -1, -1);
+      DraftCachedTokens.clear();
+      return false;
+    }
+    DraftCachedTokens.insert(DraftCachedTokens.end(), Rest.begin() + Begin,
+                             Rest.begin() + Begin + Size);
+  }
+
+  // The draft only has to be cheap and usually right; take the most likely
+  // token every time.
+  const llama_vocab *DraftVocab = llama_model_get_vocab(DraftModel);
+  int32_t NumTokens = llama_vocab_n_tokens(DraftVocab);
+  while ((int)Draft.size() < MaxDraft) {
+    const float *Logits = llama_get_logits_ith(DraftCtx, -1);
+    llama_token Token = std::max_element(Logits, Logits + NumTokens) - Logits;
+    if (llama_token_is_eog(DraftVocab, Token))
+      break;
+    Draft.push_back(Token);
+    if ((int)Draft.size() == MaxDraft)
+      break;
+    if (llama_decode(DraftCtx, llama_batch_get_one(&Token, 1)) != 0)
+      break;
+    DraftCachedTokens.push_back(Token);
+  }
+  return true;
+}
+
+bool LLMEngine::decodeSpeculative(llama_token Token, int MaxDraft,
+                                  llama_sampler *Sampler,
+                                  std::vector<llama_token> &Next,
+                                  int &NumDrafted) {
+  Next.clear();
+  NumDrafted = 0;
+  size_t Pos = CachedTokens.size();
+  MaxDraft = std::min<int>(MaxDraft, (int)llama_n_ctx(Ctx) - (int)Pos - 1);
+
+  // A failed draft only costs its speedup.
+  std::vector<llama_token> Draft;
+  if (DraftCtx && MaxDraft > 0) {
+    std::vector<llama_token> Context = CachedTokens;
+    Context.push_back(Token);
+    if (!draftTokens(Context, MaxDraft, Draft))
+      Draft.clear();
+  }
+
+  NumDrafted = Draft.size();
+
+  llama_batch Batch = llama_batch_init(Draft.size() + 1, 0, 1);
+  for (size_t I = 0; I <= Draft.size(); ++I) {
+    Batch.token[I] = I == 0 ? Token : Draft[I - 1];
+    Batch.pos[I] = (llama_pos)(Pos + I);
+    Batch.n_seq_id[I] = 1;
+    Batch.seq_id[I][0] = 0;
+    Batch.logits[I] = true;
+  }
+  Batch.n_tokens = Draft.size() + 1;
+  int32_t Status = llama_decode(Ctx, Batch);
+  llama_batch_free(Batch);
+  if (Status != 0) {
+    resetCache();
+    return false;
+  }
+
+  // The logits after each drafted token are only valid if that token is the
+  // one the sampler picks itself.
+  for (size_t I = 0; I <= Draft.size(); ++I) {
+    Next.push_back(llama_sampler_sample(Sampler, Ctx, (int32_t)I));
+    if (I == Draft.size() || Next.back() != Draft[I])
+      break;
+  }
+  CachedTokens.push_back(Token);
+  CachedTokens.insert(CachedTokens.end(), Draft.begin(),
+                      Draft.begin() + (Next.size() - 1));
+  llama_kv_cache_seq_rm(Ctx, 0, (llama_pos)CachedTokens.size(), -1);
+  return true;
+}
+
+bool tokenToPiece(const llama_vocab *Vocab, llama_token Token,
+                         std::string &Piece) {
+  char Buf[256];
+  int N = llama_token_to_piece(Vocab, Token, Buf, sizeof(Buf), 0, true);
+  if (N < 0)
+    return false;
+  Piece.assign(Buf, N);
+  return true;
+}
+
+bool LLMEngine::generateBatch(const std::string &Preamble,
+                              const std::vector<std::string> &Prompts,
+                              int MaxNewTokens,
+                              const SamplingOptions &Sampling,
+                              std::vector<std::string> &Answers,
+                              const std::atomic<bool> *Cancel,
+                              std::chrono::steady_clock::time_point Deadline,
+                              std::string &Error) {
+  Answers.assign(Prompts.size(), std::string());
+  // The rendering of the preamble does not depend on the prompt.
+  LLMRequest Request;
+  Request.Preamble = Preamble;
+  std::string Prefix = formatRequest(Request).Preamble;
+  std::vector<std::string> Bodies(Prompts.size());
+  for (size_t I = 0; I < Prompts.size(); ++I) {
+    Request.Prompt = Prompts[I];
+    Bodies[I] = formatRequest(Request).Prompt;
+  }
+
+  if (isRemote()) {
+    // One connection per prompt; the daemon decodes them side by side.
+    std::vector<std::thread> Workers;
+    for (size_t I = 0; I < Prompts.size(); ++I)
+      Workers.emplace_back([&, I] {
+        LLMRequest Request;
+        Request.Preamble = Prefix;
+        Request.Prompt = Bodies[I];
+        Request.Sampling = Sampling;
+        Request.Cancel = Cancel;
+        Request.Deadline = Deadline;
+        Answers[I] = generateRemote(DaemonSocket, Request, MaxNewTokens);
+      });
+    for (std::thread &Worker : Workers)
+      Worker.join();
+    if (Cancel && *Cancel) {
+      Error = "[cancelled]";
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<llama_token> PreambleTokens;
+  if (!restorePreamble(Prefix, PreambleTokens)) {
+    Error = "[Error] Failed to prefill prompt preamble.";
+    return false;
+  }
+  // Only the preamble of sequence 0 is shared; give its cells to the batch.
+  if (llama_kv_cache_seq_rm(Ctx, 0, (llama_pos)PreambleTokens.size(), -1))
+    CachedTokens.resize(PreambleTokens.size());
+
+  std::vector<std::vector<llama_token>> Tokens(Prompts.size());
+  for (size_t I = 0; I < Prompts.size(); ++I)
+    if (!tokenize(Bodies[I], /* AddSpecial */ false, Tokens[I])) {
+      Error = "[Error] Failed to tokenize prompt.";
+      return false;
+    }
+
+  // The sequences share the KV cache, so take as many at a time as fit in
+  // what the preamble and the chat, if any, leave of it.
+  size_t Used = PreambleTokens.size() + ReservedTokens;
+  size_t Free = llama_n_ctx(Ctx) > Used ? llama_n_ctx(Ctx) - Used : 0;
+  for (size_t Begin = 0; Begin < Prompts.size();) {
+    std::vector<std::vector<llama_token>> Group;
+    size_t GroupSize = 0;
+    size_t End = Begin;
+    while (End < Prompts.size() && Group.size() < MaxParallelSequences &&
+           GroupSize + Tokens[End].size() + MaxNewTokens <= Free) {
+      GroupSize += Tokens[End].size() + MaxNewTokens;
+      Group.push_back(Tokens[End++]);
+    }
+    if (Group.empty()) {
+      Answers[Begin++] = "[Error] Prompt is too long for the context.";
+      continue;
+    }
+    // Groups that never started have no answer to truncate.
+    if (std::chrono::steady_clock::now() >= Deadline) {
+      for (size_t I = Begin; I < Prompts.size(); ++I)
+        Answers[I] = DeadlineBeforeAnswer;
+      break;
+    }
+
+    std::vector<std::string> GroupAnswers;
+    bool Decoded = generateGroup(PreambleTokens.size(), Group, MaxNewTokens,
+                                 Sampling, GroupAnswers, Cancel, Deadline);
+    for (size_t I = 0; I < GroupAnswers.size(); ++I)
+      Answers[Begin + I] = GroupAnswers[I];
+    if (!Decoded) {
+      Error = Cancel && *Cancel ? "[cancelled]"
+                                : "[Error] Failed to decode batch.";
+      return false;
+    }
+    Begin = End;
+  }
+  return true;
+}
+
+bool LLMEngine::generateGroup(
+    size_t PreambleSize, const std::vector<std::vector<llama_token>> &Prompts,
+    int MaxNewTokens, const SamplingOptions &Sampling,
+    std::vector<std::string> &Answers, const std::atomic<bool> *Cancel,
+    std::chrono::steady_clock::time_point Deadline) {
+  size_t NumSeqs = Prompts.size();
+  Answers.assign(NumSeqs, std::string());
+
+  // Sequence I + 1 starts out as a copy of the preamble in sequence 0. This
+  // shares the cells rather than copying the state.
+  for (size_t I = 0; I < NumSeqs; ++I) {
+    llama_kv_cache_seq_rm(Ctx, I + 1, -1, -1);
+    llama_kv_cache_seq_cp(Ctx, 0, I + 1, 0, (llama_pos)PreambleSize);
+  }
+  auto releaseSequences = [&] {
+    for (size_t I = 0; I < NumSeqs; ++I)
+      llama_kv_cache_seq_rm(Ctx, I + 1, -1, -1);
+  };
+
+  int32_t BatchSize = llama_n_batch(Ctx);
+  llama_batch Batch = llama_batch_init(BatchSize, 0, 1);
+  auto addToken = [&](llama_token Token, llama_pos Pos, size_t Seq,
+                      bool Logits) {
+    int32_t N = Batch.n_tokens++;
+    Batch.token[N] = Token;
+    Batch.pos[N] = Pos;
+    Batch.n_seq_id[N] = 1;
+    Batch.seq_id[N][0] = Seq + 1;
+    Batch.logits[N] = Logits;
+  };
+
+  // The repetition penalty looks at the tokens a sampler has seen, so every
+  // sequence has its own.
+  std::vector<llama_sampler *> Samplers(NumSeqs);
+  for (llama_sampler *&Sampler : Samplers)
+    Sampler = createSampler(Sampling, Vocab, /*Grammar=*/"");
+
+  std::vector<GenerationMonitor> Monitors(NumSeqs);
+  // Where in the current batch each sequence's logits are, or -1.
+  std::vector<int32_t> LogitsIndex(NumSeqs, -1);
+  std::vector<llama_pos> NextPos(NumSeqs);
+  std::vector<bool> Active(NumSeqs, true);
+  std::vector<int> NumGenerated(NumSeqs, 0);
+  bool Ok = true;
+
+  // Sample the next token of every sequence with logits in the batch just
+  // decoded, and queue it for the next step.
+  std::vector<llama_token> Pending(NumSeqs);
+  auto sampleReady = [&] {
+    for (size_t I = 0; I < NumSeqs; ++I) {
+      if (LogitsIndex[I] < 0)
+        continue;
+      llama_token Token =
+          llama_sampler_sample(Samplers[I], Ctx, LogitsIndex[I]);
+      LogitsIndex[I] = -1;
+      std::string Piece;
+      if (llama_token_is_eog(Vocab, Token) ||
+          ++NumGenerated[I] > MaxNewTokens ||
+          !tokenToPiece(Vocab, Token, Piece)) {
+        Active[I] = false;
+        continue;
+      }
+      Answers[I] += Monitors[I].add(Token, Piece);
+      if (Monitors[I].isDone()) {
+        Active[I] = false;
+        continue;
+      }
+      Pending[I] = Token;
+    }
+  };
+  auto decode = [&] {
+    ActiveCancel = Cancel;
+    ActiveDeadline = Deadline;
+    int32_t Status = llama_decode(Ctx, Batch);
+    ActiveCancel = nullptr;
+    ActiveDeadline = std::chrono::steady_clock::time_point::max();
+    Batch.n_tokens = 0;
+    return Status == 0;
+  };
+
+  // Prefill all prompts, packed into batches of at most n_batch tokens.
+  for (size_t I = 0; I < NumSeqs && Ok; ++I) {
+    NextPos[I] = PreambleSize;
+    for (size_t J = 0; J < Prompts[I].size() && Ok; ++J) {
+      bool Last = J + 1 == Prompts[I].size();
+      if (Last)
+        LogitsIndex[I] = Batch.n_tokens;
+      addToken(Prompts[I][J], NextPos[I]++, I, Last);
+      if (Batch.n_tokens == BatchSize) {
+        Ok = decode();
+        if (Ok)
+          sampleReady();
+      }
+    }
+    if (Prompts[I].empty())
+      Active[I] = false;
+  }
+  if (Ok && Batch.n_tokens) {
+    Ok = decode();
+    if (Ok)
+      sampleReady();
+  }
+
+  // Generate: one token per unfinished sequence and step.
+  while (Ok) {
+    for (size_t I = 0; I < NumSeqs; ++I) {
+      if (!Active[I])
+        continue;
+      LogitsIndex[I] = Batch.n_tokens;
+      addToken(Pending[I], NextPos[I]++, I, true);
+    }
+    if (!Batch.n_tokens)
+      break;
+    if ((Cancel && *Cancel) || std::chrono::steady_clock::now() >= Deadline) {
+      Ok = false;
+      break;
+    }
+    Ok = decode();
+    if (Ok)
+      sampleReady();
+  }
+
+  // Past the deadline, what was generated so far is the answer.
+  bool TimedOut = !Ok && !(Cancel && *Cancel) &&
+                  std::chrono::steady_clock::now() >= Deadline;
+  for (size_t I = 0; I < NumSeqs; ++I) {
+    Answers[I] += Monitors[I].flush();
+    if (!TimedOut)
+      continue;
+    if (NumGenerated[I] == 0)
+      Answers[I] = DeadlineBeforeAnswer;
+    else if (Active[I])
+      Answers[I] += "\n[truncated: deadline reached]";
+  }
+  if (TimedOut)
+    Ok = true;
+  for (llama_sampler *Sampler : Samplers)
+    llama_sampler_free(Sampler);
+  llama_batch_free(Batch);
+  releaseSequences();
+  return Ok;
+}
+
+/// Render \p Messages through the chat template \p Template, followed by
+/// the header of an assistant turn.
+static bool renderChat(const char *Template,
+                       const std::vector<llama_chat_message> &Messages,
+                       size_t SizeHint, std::string &Rendered) {
+  std::vector<char> Buffer(SizeHint + 256);
+  int32_t Size = llama_chat_apply_template(Template, Messages.data(),
+                                           Messages.size(), /*add_ass=*/true,
+                                           Buffer.data(), Buffer.size());
+  if (Size > (int32_t)Buffer.size()) {
+    Buffer.resize(Size);
+    Size = llama_chat_apply_template(Template, Messages.data(),
+                                     Messages.size(), /*add_ass=*/true,
+                                     Buffer.data(), Buffer.size());
+  }
+  if (Size < 0)
+    return false;
+  Rendered.assign(Buffer.data(), Size);
+  return true;
+}
+
+/// Reasoning models think before they answer. Make the reasoning block
+/// that follows the assistant header in \p Prompt empty and closed, so the
+/// first generated token belongs to the answer.
+static void skipReasoning(const char *Template, std::string &Prompt) {
+  if (!std::strstr(Template, "</think>"))
+    return;
+  if (llvm::StringRef(Prompt).rtrim().take_back(7) != "<think>")
+    Prompt += "<think>";
+  Prompt += "\n\n</think>\n\n";
+}
+
+// Rendered in place of the messages, to split the output of the template
+// into the text around them.
+static const char PromptMarker[] = "\x01seek-bug-prompt\x01";
+static const char AnswerMarker[] = "\x01seek-bug-answer\x01";
+static const char FollowUpMarker[] = "\x01seek-bug-follow-up\x01";
+
+LLMRequest LLMEngine::formatRequest(const LLMRequest &Request) const {
+  const char *Template = llama_model_chat_template(Model, /*name=*/nullptr);
+  if (!Template)
+    return Request;
+
+  // Render the turns around a marker in place of the prompt: what comes
+  // before it is the same for every request with this preamble, and what
+  // comes after it ends the user turn and starts the assistant's.
+  std::vector<llama_chat_message> Messages;
+  if (!Request.Preamble.empty())
+    Messages.push_back({"system", Request.Preamble.c_str()});
+  Messages.push_back({"user", PromptMarker});
+  std::string Rendered;
+  if (!renderChat(Template, Messages, Request.Preamble.size(), Rendered))
+    return Request;
+  size_t MarkerPos = Rendered.find(PromptMarker);
+  if (MarkerPos == std::string::npos)
+    return Request;
+
+  LLMRequest Formatted = Request;
+  Formatted.Preamble = Rendered.substr(0, MarkerPos);
+  // Tokenizing the start of the prompt adds the BOS token already.
+  std::string BOS;
+  if (tokenToPiece(Vocab, llama_vocab_bos(Vocab), BOS) && !BOS.empty() &&
+      Formatted.Preamble.compare(0, BOS.size(), BOS) == 0)
+    Formatted.Preamble.erase(0, BOS.size());
+  Formatted.Prompt =
+      Request.Prompt + Rendered.substr(MarkerPos + sizeof(PromptMarker) - 1);
+  if (SkipReasoning)
+    skipReasoning(Template, Formatted.Prompt);
+  return Formatted;
+}
+
+void LLMEngine::formatFollowUp(const std::string &Message,
+                               std::string &Closing, std::string &Turn) const {
+  Closing = "\n\n";
+  Turn = Message + "\n";
+  const char *Template = llama_model_chat_template(Model, /*name=*/nullptr);
+  if (!Template)
+    return;
+
+  // The text between an answer and the next user message is what the
+  // template puts between any two such turns.
+  std::vector<llama_chat_message> Messages = {{"user", PromptMarker},
+                                              {"assistant", AnswerMarker},
+                                              {"user", FollowUpMarker}};
+  std::string Rendered;
+  if (!renderChat(Template, Messages, 0, Rendered))
+    return;
+  size_t AnswerPos = Rendered.find(AnswerMarker);
+  size_t FollowUpPos = Rendered.find(FollowUpMarker);
+  if (AnswerPos == std::string::npos || FollowUpPos == std::string::npos ||
+      FollowUpPos < AnswerPos)
+    return;
+
+  AnswerPos += sizeof(AnswerMarker) - 1;
+  Closing = Rendered.substr(AnswerPos, FollowUpPos - AnswerPos);
+  Turn = Message + Rendered.substr(FollowUpPos + sizeof(FollowUpMarker) - 1);
+  if (SkipReasoning)
+    skipReasoning(Template, Turn);
+}
+
+std::string LLMEngine::getPromptFormat() const {
+  const char *Template = llama_model_chat_template(Model, /*name=*/nullptr);
+  if (!Template)
+    return "raw";
+  std::string Format =
+      "chat-" + llvm::utohexstr(llvm::xxHash64(llvm::StringRef(Template)));
+  if (SkipReasoning && std::strstr(Template, "</think>"))
+    Format += ";skip-reasoning";
+  return Format;
+}
+
+void LLMEngine::enablePersistentPrefixCache() {
+  PrefixCacheDir = ModelPath + ".prefix-cache";
+}
+
+std::string LLMEngine::getPrefixFilePath(uint64_t Key) const {
+  return PrefixCacheDir + "/" + llvm::utohexstr(ModelFingerprint) + "-" +
+         llvm::utohexstr(Key) + ".kv";
+}
+
+bool LLMEngine::loadPrefixFile(uint64_t Key,
+                               const std::vector<llama_token> &Tokens) {
+  if (PrefixCacheDir.empty())
+    return false;
+
+  std::string Path = getPrefixFilePath(Key);
+  if (!llvm::sys::fs::exists(Path))
+    return false;
+
+  resetCache();
+  std::vector<llama_token> Stored(Tokens.size());
+  size_t NumStored = 0;
+  size_t Read = llama_state_seq_load_file(Ctx, Path.c_str(), 0, Stored.data(),
+                                          Stored.size(), &NumStored);
+  Stored.resize(NumStored);
+  // The file may come from an older tokenization of the preamble or from a
+  // context with a different layout; fall back to prefilling in that case.
+  if (Read == 0 || Stored != Tokens) {
+    resetCache();
+    return false;
+  }
+  CachedTokens = Tokens;
+  return true;
+}
+
+void LLMEngine::snapshotPreamble(uint64_t Key,
+                                 const std::vector<llama_token> &Tokens) {
+  PrefixSnapshot &Snapshot = Prefixes[Key];
+  Snapshot.Tokens = Tokens;
+  Snapshot.State.resize(llama_state_seq_get_size(Ctx, 0));
+  Snapshot.State.resize(llama_state_seq_get_data(
+      Ctx, Snapshot.State.data(), Snapshot.State.size(), 0));
+}
+
+bool LLMEngine::restorePreamble(const std::string &Preamble,
+                                std::vector<llama_token> &Tokens) {
+  if (!tokenize(Preamble, /* AddSpecial */ true, Tokens))
+    return false;
+
+  // Still resident from the previous request of the same kind.
+  if (CachedTokens.size() >= Tokens.size() &&
+      std::equal(Tokens.begin(), Tokens.end(), CachedTokens.begin()))
+    return true;
+
+  uint64_t Key = llvm::xxHash64(Preamble);
+  auto It = Prefixes.find(Key);
+  if (It != Prefixes.end() && It->second.Tokens == Tokens) {
+    resetCache();
+    const std::vector<uint8_t> &State = It->second.State;
+    if (llama_state_seq_set_data(Ctx, State.data(), State.size(), 0) != 0) {
+      CachedTokens = Tokens;
+      return true;
+    }
+    resetCache();
+  }
+
+  if (loadPrefixFile(Key, Tokens)) {
+    snapshotPreamble(Key, Tokens);
+    return true;
+  }
+
+  if (!prefill(Tokens))
+    return false;
+  snapshotPreamble(Key, Tokens);
+
+  if (!PrefixCacheDir.empty() &&
+      !llvm::sys::fs::create_directories(PrefixCacheDir))
+    llama_state_seq_save_file(Ctx, getPrefixFilePath(Key).c_str(), 0,
+                              Tokens.data(), Tokens.size());
+  return true;
+}
+
+GenerationMonitor::GenerationMonitor(std::vector<std::string> Stop,
+                                     bool DetectLoops)
+    : Stop(std::move(Stop)), DetectLoops(DetectLoops) {
+  this->Stop.erase(std::remove(this->Stop.begin(), this->Stop.end(), ""),
+                   this->Stop.end());
+}
+
+/// Length of the longest end of \p Text that \p Tag starts with, short of
+/// the whole tag.
+static size_t getPartialTagSize(const std::string &Text,
+                                const std::string &Tag) {
+  for (size_t Len = std::min(Tag.size() - 1, Text.size()); Len > 0; --Len)
+    if (Text.compare(Text.size() - Len, Len, Tag, 0, Len) == 0)
+      return Len;
+  return 0;
+}
+
+std::string GenerationMonitor::add(llama_token Token,
+                                   const std::string &Piece) {
+  if (Done)
+    return "";
+
+  History.push_back(Token);
+  if (DetectLoops && History.size() >= LoopNGramSize) {
+    uint64_t Hash = llvm::xxHash64(llvm::StringRef(
+        reinterpret_cast<const char *>(History.data() + History.size() -
+                                       LoopNGramSize),
+        LoopNGramSize * sizeof(llama_token)));
+    if (++NGramCounts[Hash] >= LoopNGramRepeats) {
+      std::string Text = flush();
+      Done = true;
+      return Text;
+    }
+  }
+
+  return release(filterReasoning(Piece));
+}
+
+std::string GenerationMonitor::filterReasoning(const std::string &Piece) {
+  static const std::string Open = "<think>";
+  static const std::string Close = "</think>";
+  Unfiltered += Piece;
+  std::string Visible;
+  while (!Unfiltered.empty()) {
+    if (InReasoning) {
+      size_t End = Unfiltered.find(Close);
+      if (End == std::string::npos) {
+        size_t Keep = getPartialTagSize(Unfiltered, Close);
+        Reasoning.append(Unfiltered, 0, Unfiltered.size() - Keep);
+        Unfiltered.erase(0, Unfiltered.size() - Keep);
+        break;
+      }
+      Reasoning.append(Unfiltered, 0, End);
+      Unfiltered.erase(0, End + Close.size());
+      InReasoning = false;
+      SkipSpace = true;
+      continue;
+    }
+
+    // The answer starts at its first non-blank character.
+    if (SkipSpace) {
+      size_t Begin = Unfiltered.find_first_not_of(" \t\r\n");
+      Unfiltered.erase(0, Begin);
+      if (Unfiltered.empty())
+        break;
+      SkipSpace = false;
+    }
+
+    size_t OpenPos = Unfiltered.find(Open);
+    size_t ClosePos = Unfiltered.find(Close);
+    if (OpenPos == std::string::npos && ClosePos == std::string::npos) {
+      size_t Keep = std::max(getPartialTagSize(Unfiltered, Open),
+                             getPartialTagSize(Unfiltered, Close));
+      Visible.append(Unfiltered, 0, Unfiltered.size() - Keep);
+      Unfiltered.erase(0, Unfiltered.size() - Keep);
+      break;
+    }
+    // A closing tag without an opening one ends reasoning that started
+    // without a tag; it has been shown already, only the tag is dropped.
+    size_t TagPos = std::min(OpenPos, ClosePos);
+    Visible.append(Unfiltered, 0, TagPos);
+    bool Opens = TagPos == OpenPos;
+    Unfiltered.erase(0, TagPos + (Opens ? Open : Close).size());
+    InReasoning = Opens;
+    Reasoning.clear();
+    SkipSpace = !Opens;
+  }
+  if (!Visible.empty())
+    AnythingShown = true;
+  return Visible;
+}
+
+std::string GenerationMonitor::release(const std::string &Text) {
+  Pending += Text;
+  size_t StopPos = std::string::npos;
+  for (const std::string &S : Stop)
+    StopPos = std::min(StopPos, Pending.find(S));
+  if (StopPos != std::string::npos) {
+    Done = true;
+    std::string Released = Pending.substr(0, StopPos);
+    Pending.clear();
+    return Released;
+  }
+
+  // Hold back the longest end of the text that a stop string starts with.
+  size_t Keep = 0;
+  for (const std::string &S : Stop)
+    Keep = std::max(Keep, getPartialTagSize(Pending, S));
+  std::string Released = Pending.substr(0, Pending.size() - Keep);
+  Pending.erase(0, Pending.size() - Keep);
+  return Released;
+}
+
+std::string GenerationMonitor::flush() {
+  if (Done)
+    return "";
+  // Reasoning that never finished within the token limit is all there is;
+  // show it rather than nothing.
+  std::string Rest = InReasoning ? Reasoning + Unfiltered : Unfiltered;
+  if (InReasoning && AnythingShown)
+    Rest.clear();
+  Unfiltered.clear();
+  Reasoning.clear();
+  InReasoning = false;
+  std::string Text = release(Rest);
+  Text += Pending;
+  Pending.clear();
+  Done = true;
+  return Text;
+}
+
+llama_sampler *createSampler(const SamplingOptions &Options,
+                             const llama_vocab *Vocab,
+                             const std::string &Grammar) {
+  llama_sampler *Chain =
+      llama_sampler_chain_init(llama_sampler_chain_default_params());
+  // Rule out the tokens the grammar does not allow before picking one.
+  if (!Grammar.empty()) {
+    llama_sampler *GrammarSampler =
+        llama_sampler_init_grammar(Vocab, Grammar.c_str(), "root");
+    if (!GrammarSampler) {
+      llama_sampler_free(Chain);
+      return nullptr;
+    }
+    llama_sampler_chain_add(Chain, GrammarSampler);
+  }
+  if (Options.RepeatPenalty != 1.0f)
+    llama_sampler_chain_add(
+        Chain, llama_sampler_init_penalties(Options.RepeatLastN,
+                                            Options.RepeatPenalty,
+                                            /*penalty_freq=*/0.0f,
+                                            /*penalty_present=*/0.0f));
+  if (Options.Temperature <= 0) {
+    llama_sampler_chain_add(Chain, llama_sampler_init_greedy());
+    return Chain;
+  }
+  if (Options.TopK > 0)
+    llama_sampler_chain_add(Chain, llama_sampler_init_top_k(Options.TopK));
+  if (Options.TopP < 1.0f)
+    llama_sampler_chain_add(Chain,
+                            llama_sampler_init_top_p(Options.TopP, 1));
+  llama_sampler_chain_add(Chain, llama_sampler_init_temp(Options.Temperature));
+  llama_sampler_chain_add(Chain, llama_sampler_init_dist(Options.Seed));
+  return Chain;
+}
+
+int getMaxNewTokens(const LLMRequest &Request) {
+  return Request.MaxNewTokens > 0 ? Request.MaxNewTokens : MaxNewTokens;
+}
+
+std::string getSamplingDescription(const LLMRequest &Request) {
+  const SamplingOptions &Sampling = Request.Sampling;
+  std::string Description;
+  llvm::raw_string_ostream OS(Description);
+  if (Sampling.Temperature <= 0)
+    OS << "greedy";
+  else
+    OS << "temp=" << Sampling.Temperature << ";top-k=" << Sampling.TopK
+       << ";top-p=" << Sampling.TopP << ";seed=" << Sampling.Seed;
+  if (Sampling.RepeatPenalty != 1.0f)
+    OS << ";repeat-penalty=" << Sampling.RepeatPenalty << "/"
+       << Sampling.RepeatLastN;
+  OS << ";max-new-tokens=" << getMaxNewTokens(Request);
+  OS << ";loop-ngram=" << LoopNGramSize << "x" << LoopNGramRepeats;
+  for (const std::string &S : Request.Stop)
+    OS << ";stop=" << S.size() << ":" << S;
+  if (!Request.Grammar.empty())
+    OS << ";grammar=" << llvm::utohexstr(llvm::xxHash64(Request.Grammar));
+  return OS.str();
+}
+
+} // end namespace seekbug
+
+std::string runLLM(const std::string &prompt, seekbug::LLMEngine &engine) {
+  seekbug::LLMRequest request;
+  request.Prompt = prompt;
+  return runLLM(request, engine);
+}
+
+std::string runLLM(const seekbug::LLMRequest &request,
+                   seekbug::LLMEngine &engine) {
+  bool verbose = false;
+  if (const char* debugEnv = std::getenv("DEBUG_SEEKBUG")) {
+    if (std::string(debugEnv) == "1") {
+      verbose = true;
+      llvm::WithColor(llvm::outs(), llvm::HighlightColor::String)
+          << "The prompt is: " << request.Preamble << request.Prompt << "\n";
+    }
+  }
+
+  // The daemon schedules requests itself, so there is nothing to lock.
+  if (engine.isRemote())
+    return seekbug::generateRemote(engine.getDaemonSocket(),
+                                   engine.formatRequest(request),
+                                   seekbug::getMaxNewTokens(request));
+
+  std::lock_guard<std::mutex> lock(engine.getMutex());
+  llama_context *ctx = engine.getContext();
+  const struct llama_vocab *vocab = engine.getVocab();
+  // llama.cpp counts for the whole session; the request's share is the
+  // difference.
+  llama_perf_context_data perfBefore = llama_perf_context(ctx);
+
+  std::string error;
+  if (!engine.prefillRequest(request, error)) {
+    return error;
+  }
+
+  llama_sampler *smpl =
+      seekbug::createSampler(request.Sampling, vocab, request.Grammar);
+  if (!smpl)
+    return "[Error] Invalid grammar.";
+  seekbug::GenerationMonitor monitor(request.Stop, request.Grammar.empty());
 
   std::ostringstream ss;
-  const int max_new_tokens = 256;
+  // Everything that ends up in the answer also goes to the token sink, so
+  // streaming callers see exactly the returned text.
+  auto emit = [&](const std::string &piece) {
+    if (piece.empty())
+      return;
+    ss << piece;
+    if (request.OnToken)
+      request.OnToken(piece);
+  };
+
+  // With a draft model, the tokens the main model picked while verifying a
+  // draft are queued here; all but the last one are already decoded.
+  const bool speculative = engine.hasDraftModel();
+  std::vector<llama_token> next;
+  size_t nextIndex = 0;
+  int numDrafted = 0;
+  int numAccepted = 0;
+  int numVerified = 0;
+  // The first token is decoded on its own, as a baseline for the speedup.
+  double singleDecodeTime = 0;
+  double speculativeTime = 0;
+  int numGenerated = 0;
+  double maxStepTime = 0;
+  auto generationStart = std::chrono::steady_clock::now();
+
+  const int max_new_tokens = seekbug::getMaxNewTokens(request);
   for (int i = 0; i < max_new_tokens; i++) {
-    // Sample next token
-    llama_token token_id = llama_sampler_sample(smpl, ctx, -1);
+    if (request.Cancel && *request.Cancel) {
+      emit(monitor.flush());
+      emit("\n[cancelled]");
+      break;
+    }
+    if (std::chrono::steady_clock::now() >= request.Deadline) {
+      emit(monitor.flush());
+      emit("\n[truncated: deadline reached]");
+      break;
+    }
+
+    // Sample next token, unless verifying the draft already did
+    llama_token token_id = nextIndex < next.size()
+                               ? next[nextIndex++]
+                               : llama_sampler_sample(smpl, ctx, -1);
 
     // Check if we got the end-of-generation signal
     // The older code uses 'llama_token_is_eog(vocab, token_id)'
@@ -108,28 +1385,80 @@ std::string runLLM(const std::string &prompt, const std::string &modelPath) {
     }
 
     // Convert token to string
-    char buf[256];
-    int n = llama_token_to_piece(vocab, token_id, buf, sizeof(buf), 0, true);
-    if (n < 0) {
-      ss << "[Error: failed to convert token to piece]\n";
+    std::string piece;
+    if (!seekbug::tokenToPiece(vocab, token_id, piece)) {
+      emit(monitor.flush());
+      emit("[Error: failed to convert token to piece]\n");
       break;
     }
-    // Append token text
-    std::string token_str(buf, n);
-    ss << token_str;
+    // Append token text, unless it completes a stop string or a loop.
+    ++numGenerated;
+    emit(monitor.add(token_id, piece));
+    if (monitor.isDone())
+      break;
 
-    // Feed the newly generated token back into the decoder
-    llama_batch next_batch = llama_batch_get_one(&token_id, 1);
-    if (llama_decode(ctx, next_batch) != 0) {
-      ss << "[Error: decode failure in generation loop]\n";
+    // Feed the newly generated token back into the decoder, unless it was
+    // part of the verified draft
+    if (nextIndex < next.size())
+      continue;
+    auto start = std::chrono::steady_clock::now();
+    bool decoded;
+    if (speculative && i > 0) {
+      int drafted = 0;
+      decoded = engine.decodeSpeculative(
+          token_id, std::min(SpeculativeDraftTokens, max_new_tokens - i - 1),
+          smpl, next, drafted);
+      nextIndex = 0;
+      numDrafted += drafted;
+      if (!next.empty()) {
+        numAccepted += next.size() - 1;
+        numVerified += next.size();
+      }
+    } else {
+      decoded = engine.decodeToken(token_id);
+    }
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (speculative && i > 0)
+      speculativeTime += elapsed;
+    else
+      singleDecodeTime = elapsed;
+    maxStepTime = std::max(maxStepTime, elapsed);
+    if (!decoded) {
+      emit(monitor.flush());
+      emit("[Error: decode failure in generation loop]\n");
       break;
     }
   }
+  emit(monitor.flush());
+
+  llama_sampler_free(smpl);
 
-  // Cleanup
-  // llama_sampler_chain_free(smpl);
-  llama_free(ctx);
-  llama_free_model(model);
+  if (seekbug::GenerationStats *stats = request.Stats) {
+    stats->DecodeTime += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() -
+                             generationStart)
+                             .count();
+    stats->MaxDecodeStepTime =
+        std::max(stats->MaxDecodeStepTime, maxStepTime * 1000);
+    stats->GeneratedTokens += numGenerated;
+    llama_perf_context_data perf = llama_perf_context(ctx);
+    stats->PerfPromptEvalTime += perf.t_p_eval_ms - perfBefore.t_p_eval_ms;
+    stats->PerfPromptEvalTokens += perf.n_p_eval - perfBefore.n_p_eval;
+    stats->PerfEvalTime += perf.t_eval_ms - perfBefore.t_eval_ms;
+    stats->PerfEvalTokens += perf.n_eval - perfBefore.n_eval;
+  }
+
+  if (verbose && numDrafted && speculativeTime > 0) {
+    // Compared with decoding each of these tokens on its own.
+    double speedup = numVerified * singleDecodeTime / speculativeTime;
+    llvm::WithColor(llvm::outs(), llvm::HighlightColor::Remark)
+        << "[speculative decoding: " << numAccepted << " of " << numDrafted
+        << " drafted tokens accepted ("
+        << llvm::format("%.0f", 100.0 * numAccepted / numDrafted)
+        << "%), about " << llvm::format("%.2f", speedup) << "x faster]\n";
+  }
 
   // 9) Return the final generated text
   return ss.str();
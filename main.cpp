@@ -10,9 +10,12 @@
 //===----------------------------------------------------------------------===//
 
 #include "seek-bug/AICommands.h"
+#include "seek-bug/Autotune.h"
 #include "seek-bug/SeekBugContext.h"
+#include "seek-bug/Triage.h"
 
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/WithColor.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -24,8 +27,11 @@
 #include "lldb/API/SBStream.h"
 #include "lldb/API/SBThread.h"
 
+#include <atomic>
+#include <csignal>
 #include <filesystem>
 #include <iostream>
+#include <unistd.h>
 
 using namespace llvm;
 
@@ -37,34 +43,211 @@ static opt<bool> Help("h", desc("Alias for -help"), Hidden,
                       cat(SeekBugCategory));
 static opt<std::string> InputFilename(Positional, desc("<input file>"),
                                       cat(SeekBugCategory));
+static cl::opt<unsigned>
+    Deadline("deadline",
+             cl::desc("Milliseconds an AI command may generate for, unless "
+                      "it gives --deadline (0 = no limit)."),
+             cl::init(0), cl::cat(SeekBugCategory));
 static cl::opt<std::string> DeepSeekLLMPath("deep-seek-llm-path",
                                             cl::desc("Path to DeepSeek LLM."),
                                             cl::init(""), cl::ValueRequired,
                                             cl::cat(SeekBugCategory));
+static cl::opt<bool> Autotune(
+    "autotune",
+    cl::desc("Measure the inference speed of the model for several thread "
+             "counts and batch sizes, and keep the fastest for later runs."),
+    cl::init(false), cl::cat(SeekBugCategory));
+static cl::opt<unsigned> BatchSize(
+    "batch-size", cl::desc("Most tokens submitted to a single decode."),
+    cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<unsigned>
+    BatchThreads("batch-threads",
+                 cl::desc("Number of threads decoding prompts."),
+                 cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<std::string>
+    CPUAffinity("cpu-affinity",
+                cl::desc("CPUs to run inference on, e.g. 0-7,16-23."),
+                cl::init(""), cl::cat(SeekBugCategory));
+static cl::opt<std::string> DaemonSocket(
+    "daemon-socket",
+    cl::desc("Let the seek-bugd daemon listening on this socket run the "
+             "model."),
+    cl::init(""), cl::cat(SeekBugCategory));
+static cl::opt<std::string> DraftModelPath(
+    "draft-model-path",
+    cl::desc("Small model with the same vocabulary that drafts tokens for "
+             "the model to verify, which speeds up decoding."),
+    cl::init(""), cl::cat(SeekBugCategory));
+static cl::opt<unsigned>
+    MaxTokens("max-tokens",
+              cl::desc("Most tokens of an answer (0 = the default, 256)."),
+              cl::init(0), cl::cat(SeekBugCategory));
+enum class MemoryProfile { Default, Low };
+static cl::opt<MemoryProfile> MemoryProfileOpt(
+    "memory-profile", cl::desc("How much memory inference may use."),
+    cl::values(clEnumValN(MemoryProfile::Default, "default",
+                          "Context of 4096 tokens, f16 KV cache."),
+               clEnumValN(MemoryProfile::Low, "low",
+                          "Context sized for the prompt token budget and "
+                          "--max-tokens, q8_0 KV cache.")),
+    cl::init(MemoryProfile::Default), cl::cat(SeekBugCategory));
+static cl::opt<bool>
+    MLock("mlock", cl::desc("Keep the model in RAM, never swap it out."),
+          cl::init(false), cl::cat(SeekBugCategory));
+static cl::opt<bool>
+    MMap("mmap",
+         cl::desc("Map the model file rather than reading it (default; "
+                  "=false reads it)."),
+         cl::init(true), cl::cat(SeekBugCategory));
+static cl::opt<bool> PersistPromptCache(
+    "persist-prompt-cache",
+    cl::desc("Store the prefilled prompt preambles next to the model."),
+    cl::init(false), cl::cat(SeekBugCategory));
+static cl::opt<unsigned> PromptTokenBudget(
+    "prompt-token-budget",
+    cl::desc("Maximum number of tokens of debugging context in a prompt "
+             "(0 = as many as fit)."),
+    cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<float> RepeatPenalty(
+    "repeat-penalty",
+    cl::desc("Penalty for repeating recent tokens (1 = none)."),
+    cl::init(1.0f), cl::cat(SeekBugCategory));
+static cl::opt<unsigned>
+    Seed("seed", cl::desc("Random seed used when sampling with a temperature."),
+         cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<bool> SkipReasoning(
+    "skip-reasoning",
+    cl::desc("Let reasoning models answer without thinking first "
+             "(default; =false lets them think)."),
+    cl::init(true), cl::cat(SeekBugCategory));
+static cl::opt<std::string> StatsFile(
+    "stats-file",
+    cl::desc("Append the timings of every AI command to this JSONL file."),
+    cl::init(""), cl::cat(SeekBugCategory));
+static cl::list<std::string>
+    Stop("stop", cl::desc("End answers at this string (can be repeated)."),
+         cl::cat(SeekBugCategory));
+static cl::opt<float> Temperature(
+    "temperature",
+    cl::desc("Sampling temperature (0 = always the most likely token)."),
+    cl::init(0.0f), cl::cat(SeekBugCategory));
+static cl::opt<unsigned>
+    Threads("threads",
+            cl::desc("Number of threads decoding generated tokens."),
+            cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<int> TopK("top-k",
+                         cl::desc("Sample among this many most likely "
+                                  "tokens (0 = all)."),
+                         cl::init(40), cl::cat(SeekBugCategory));
+static cl::opt<float>
+    TopP("top-p",
+         cl::desc("Sample among the most likely tokens making up this "
+                  "probability."),
+         cl::init(0.95f), cl::cat(SeekBugCategory));
+static cl::opt<std::string> Triage(
+    "triage",
+    cl::desc("Analyze the cores in a directory, or listed in a file, without "
+             "user interaction."),
+    cl::init(""), cl::cat(SeekBugCategory));
+static cl::opt<unsigned> TriageDeadline(
+    "triage-deadline",
+    cl::desc("Milliseconds the model may take to analyze all crashes "
+             "(0 = no limit)."),
+    cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<unsigned> TriageJobs(
+    "triage-jobs",
+    cl::desc("Number of processes loading cores (0 = one per CPU)."),
+    cl::init(0), cl::cat(SeekBugCategory));
+static cl::opt<std::string>
+    TriageOutput("triage-output",
+                 cl::desc("File to write the JSONL triage results to."),
+                 cl::init("-"), cl::cat(SeekBugCategory));
+static cl::opt<std::string> TriageWorker("triage-worker", cl::Hidden,
+                                         cl::desc("Load a single core."),
+                                         cl::init(""),
+                                         cl::cat(SeekBugCategory));
+static cl::opt<std::string>
+    TriageWorkerOutput("triage-worker-output", cl::Hidden,
+                       cl::desc("Where a triage worker writes its result."),
+                       cl::init(""), cl::cat(SeekBugCategory));
+static cl::opt<unsigned> UBatchSize(
+    "ubatch-size", cl::desc("Most tokens computed at once within a decode."),
+    cl::init(0), cl::cat(SeekBugCategory));
+
+/// The debugger of the interactive session, for the Ctrl-C handler.
+lldb::SBDebugger *InteractiveDebugger = nullptr;
+
+/// Same as the lldb driver: let the debugger decide what Ctrl-C interrupts,
+/// e.g. the running command (which stops an AI answer early), the process or
+/// the line being edited. Without it, Ctrl-C would end the whole session.
+void handleInterrupt(int signo) {
+  static std::atomic_flag interruptSent = ATOMIC_FLAG_INIT;
+  if (InteractiveDebugger && !interruptSent.test_and_set()) {
+    InteractiveDebugger->DispatchInputInterrupt();
+    interruptSent.clear();
+    return;
+  }
+  _exit(signo);
+}
 } // namespace
 /// @}
 //===----------------------------------------------------------------------===//
 
 int main(int argc, char **argv) {
-  WithColor(llvm::outs(), HighlightColor::String)
-      << "=== SeekBug - Modern, Portable and Deep Debugger\n";
-
   HideUnrelatedOptions({&SeekBugCategory});
   cl::ParseCommandLineOptions(argc, argv, "Have a chat with your debugger!");
 
+  // Triage results may go to stdout, so keep it clean in that mode.
+  if (!TriageWorker.empty())
+    return seekbug::runTriageWorker(InputFilename, TriageWorker,
+                                    TriageWorkerOutput);
+  if (Triage.empty())
+    WithColor(llvm::outs(), HighlightColor::String)
+        << "=== SeekBug - Modern, Portable and Deep Debugger\n";
+
   if (Help) {
     PrintHelpMessage(false, true);
     return 0;
   }
 
-  if (argc < 3) {
+  if (Autotune) {
+    if (DeepSeekLLMPath.empty()) {
+      llvm::WithColor::error() << "No LLM file specified.\n";
+      return 1;
+    }
+    if (!CPUAffinity.empty()) {
+      std::string error;
+      if (!seekbug::setCPUAffinity(CPUAffinity, error)) {
+        llvm::WithColor::error() << error << '\n';
+        return 1;
+      }
+    }
+    WithColor(llvm::outs(), HighlightColor::String)
+        << "Tuning " << DeepSeekLLMPath << " for this machine...\n";
+    seekbug::LLMEngineOptions best;
+    std::string error;
+    if (!seekbug::runAutotune(DeepSeekLLMPath, best, error)) {
+      llvm::WithColor::error() << error << '\n';
+      return 1;
+    }
+    WithColor(llvm::outs(), HighlightColor::String)
+        << "Using --threads=" << best.Threads
+        << " --batch-threads=" << best.BatchThreads
+        << " --batch-size=" << best.BatchSize
+        << " --ubatch-size=" << best.UBatchSize << " from now on.\n";
+    return 0;
+  }
+
+  // Options may come in any order, so the program is whatever positional
+  // argument there is.
+  if (InputFilename.empty()) {
     std::cerr << "Usage: " << argv[0]
               << " --deep-seek-llm-path=<path> <program to debug> "
               << std::endl;
     return 1;
   }
 
-  std::string program = argv[2];
+  std::string program = InputFilename;
 
   SeekBugContext context;
   if (!DeepSeekLLMPath.empty()) {
@@ -81,6 +264,77 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Load the model once; every AI command reuses it. With a daemon, it holds
+  // the model and we only need the vocabulary.
+  WithColor(Triage.empty() ? llvm::outs() : llvm::errs(),
+            HighlightColor::String)
+      << "Loading " << context.DeepSeekLLMPath << "...\n";
+  std::string error;
+  seekbug::LLMEngineOptions engineOptions;
+  engineOptions.Threads = Threads;
+  engineOptions.BatchThreads = BatchThreads;
+  engineOptions.BatchSize = BatchSize;
+  engineOptions.UBatchSize = UBatchSize;
+  engineOptions.CPUAffinity = CPUAffinity;
+  engineOptions.UseMMap = MMap;
+  engineOptions.LockMemory = MLock;
+  if (MemoryProfileOpt == MemoryProfile::Low)
+    seekbug::applyLowMemoryProfile(engineOptions, PromptTokenBudget,
+                                   MaxTokens);
+  if (DaemonSocket.empty())
+    context.Engine = seekbug::LLMEngine::create(context.DeepSeekLLMPath,
+                                                error, engineOptions);
+  else
+    context.Engine = seekbug::LLMEngine::createForDaemon(
+        context.DeepSeekLLMPath, DaemonSocket, error);
+  if (!context.Engine) {
+    llvm::WithColor::error() << error << '\n';
+    return 1;
+  }
+  if (!DraftModelPath.empty()) {
+    if (context.Engine->isRemote()) {
+      llvm::WithColor::warning()
+          << "--draft-model-path has no effect with --daemon-socket.\n";
+    } else if (!context.Engine->loadDraftModel(DraftModelPath, error)) {
+      llvm::WithColor::error() << error << '\n';
+      return 1;
+    }
+  }
+  WithColor(Triage.empty() ? llvm::outs() : llvm::errs(),
+            HighlightColor::Remark)
+      << "[" << seekbug::getMemoryReport(*context.Engine) << "]\n";
+  if (!StatsFile.empty()) {
+    context.Stats = std::make_shared<seekbug::Telemetry>(context.Engine);
+    if (!context.Stats->openLog(StatsFile, error)) {
+      llvm::WithColor::error() << error << '\n';
+      return 1;
+    }
+  }
+  if (PersistPromptCache)
+    context.Engine->enablePersistentPrefixCache();
+  context.Engine->setSkipReasoning(SkipReasoning);
+  context.PromptTokenBudget = PromptTokenBudget;
+  context.Sampling.Temperature = Temperature;
+  context.Sampling.TopK = TopK;
+  context.Sampling.TopP = TopP;
+  context.Sampling.RepeatPenalty = RepeatPenalty;
+  context.Sampling.Seed = Seed;
+  context.MaxNewTokens = MaxTokens;
+  context.DeadlineMs = Deadline;
+  context.Stop.assign(Stop.begin(), Stop.end());
+
+  if (!Triage.empty()) {
+    seekbug::TriageOptions options;
+    options.Program = program;
+    options.Input = Triage;
+    options.OutputPath = TriageOutput;
+    options.Jobs = TriageJobs;
+    options.DeadlineMs = TriageDeadline;
+    options.SelfPath = llvm::sys::fs::getMainExecutable(
+        argv[0], reinterpret_cast<void *>(&main));
+    return seekbug::runTriage(context, options);
+  }
+
   // Initialize LLDB.
   lldb::SBDebugger::Initialize();
   lldb::SBDebugger debugger = lldb::SBDebugger::Create();
@@ -102,7 +356,15 @@ int main(int argc, char **argv) {
   lldb::SBCommandInterpreter interpreter = debugger.GetCommandInterpreter();
   seekbug::RegisterAICommands(interpreter, context);
 
+  InteractiveDebugger = &debugger;
+  std::signal(SIGINT, handleInterrupt);
   debugger.RunCommandInterpreter(true, false);
+  std::signal(SIGINT, SIG_DFL);
+  InteractiveDebugger = nullptr;
+
+  // Do not let background AI jobs outlive the debugger.
+  context.Jobs->stop();
+  context.Prefill->stop();
 
   lldb::SBDebugger::Destroy(debugger);
   lldb::SBDebugger::Terminate();
@@ -0,0 +1,146 @@
+//===-------- seek-bugd.cpp - Shared inference daemon ---------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file provides the daemon that keeps the model loaded and answers the
+// AI commands of any number of seek-bug sessions on the same host. Sessions
+// use it when started with --daemon-socket.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/DaemonProtocol.h"
+#include "seek-bug/DaemonServer.h"
+#include "seek-bug/llm.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <csignal>
+#include <string>
+#include <unistd.h>
+
+using namespace llvm;
+
+namespace {
+using namespace cl;
+
+OptionCategory SeekBugdCategory("Specific Options");
+static cl::opt<std::string> DeepSeekLLMPath("deep-seek-llm-path",
+                                            cl::desc("Path to DeepSeek LLM."),
+                                            cl::init(""), cl::ValueRequired,
+                                            cl::cat(SeekBugdCategory));
+static cl::opt<std::string>
+    Socket("socket", cl::desc("Unix domain socket to listen on."),
+           cl::init(""), cl::cat(SeekBugdCategory));
+static cl::opt<bool> PersistPromptCache(
+    "persist-prompt-cache",
+    cl::desc("Store the prefilled prompt preambles next to the model."),
+    cl::init(false), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned>
+    Threads("threads",
+            cl::desc("Number of threads decoding generated tokens."),
+            cl::init(0), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned>
+    BatchThreads("batch-threads",
+                 cl::desc("Number of threads decoding prompts."),
+                 cl::init(0), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned> BatchSize(
+    "batch-size", cl::desc("Most tokens submitted to a single decode."),
+    cl::init(0), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned> UBatchSize(
+    "ubatch-size", cl::desc("Most tokens computed at once within a decode."),
+    cl::init(0), cl::cat(SeekBugdCategory));
+static cl::opt<std::string>
+    CPUAffinity("cpu-affinity",
+                cl::desc("CPUs to run inference on, e.g. 0-7,16-23."),
+                cl::init(""), cl::cat(SeekBugdCategory));
+enum class MemoryProfile { Default, Low };
+static cl::opt<MemoryProfile> MemoryProfileOpt(
+    "memory-profile", cl::desc("How much memory inference may use."),
+    cl::values(clEnumValN(MemoryProfile::Default, "default",
+                          "Context of 4096 tokens, f16 KV cache."),
+               clEnumValN(MemoryProfile::Low, "low",
+                          "Context sized for --prompt-token-budget and "
+                          "--max-tokens, q8_0 KV cache.")),
+    cl::init(MemoryProfile::Default), cl::cat(SeekBugdCategory));
+static cl::opt<bool>
+    MLock("mlock", cl::desc("Keep the model in RAM, never swap it out."),
+          cl::init(false), cl::cat(SeekBugdCategory));
+static cl::opt<bool>
+    MMap("mmap",
+         cl::desc("Map the model file rather than reading it (default; "
+                  "=false reads it)."),
+         cl::init(true), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned> PromptTokenBudget(
+    "prompt-token-budget",
+    cl::desc("Largest prompt token budget of the sessions served, for "
+             "--memory-profile=low (0 = the default)."),
+    cl::init(0), cl::cat(SeekBugdCategory));
+static cl::opt<unsigned> MaxTokens(
+    "max-tokens",
+    cl::desc("Largest --max-tokens of the sessions served, for "
+             "--memory-profile=low (0 = the default, 256)."),
+    cl::init(0), cl::cat(SeekBugdCategory));
+} // namespace
+
+static std::string SocketPath;
+
+static void handleTerminate(int) {
+  // Only async-signal-safe calls here.
+  ::unlink(SocketPath.c_str());
+  ::_exit(0);
+}
+
+int main(int argc, char **argv) {
+  HideUnrelatedOptions({&SeekBugdCategory});
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Serve the model to local seek-bug sessions.");
+
+  if (DeepSeekLLMPath.empty()) {
+    llvm::WithColor::error() << "No LLM file specified. Use "
+                             << "--deep-seek-llm-path=<path>\n";
+    return 1;
+  }
+  SocketPath =
+      Socket.empty() ? seekbug::getDefaultDaemonSocketPath() : Socket.getValue();
+
+  WithColor(llvm::errs(), HighlightColor::String)
+      << "Loading " << DeepSeekLLMPath << "...\n";
+  std::string error;
+  seekbug::LLMEngineOptions engineOptions;
+  engineOptions.Threads = Threads;
+  engineOptions.BatchThreads = BatchThreads;
+  engineOptions.BatchSize = BatchSize;
+  engineOptions.UBatchSize = UBatchSize;
+  engineOptions.CPUAffinity = CPUAffinity;
+  engineOptions.UseMMap = MMap;
+  engineOptions.LockMemory = MLock;
+  if (MemoryProfileOpt == MemoryProfile::Low)
+    seekbug::applyLowMemoryProfile(engineOptions, PromptTokenBudget,
+                                   MaxTokens);
+  std::unique_ptr<seekbug::LLMEngine> engine =
+      seekbug::LLMEngine::create(DeepSeekLLMPath, error, engineOptions);
+  if (!engine) {
+    llvm::WithColor::error() << error << '\n';
+    return 1;
+  }
+  WithColor(llvm::errs(), HighlightColor::Remark)
+      << "[" << seekbug::getMemoryReport(*engine) << "]\n";
+  if (PersistPromptCache)
+    engine->enablePersistentPrefixCache();
+
+  // A session going away mid-answer must not take the daemon with it.
+  std::signal(SIGPIPE, SIG_IGN);
+  std::signal(SIGINT, handleTerminate);
+  std::signal(SIGTERM, handleTerminate);
+
+  if (!seekbug::runDaemon(*engine, SocketPath, error)) {
+    llvm::WithColor::error() << error << '\n';
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,18 @@
+# -*- Python -*-
+
+# Configuration file for the unit tests, which are GoogleTest programs
+# built from test/unittests.
+
+import os
+
+import lit.formats
+
+config.name = "SeekBug-Unit"
+
+# No test files; the programs ending in "Tests" are the tests.
+config.suffixes = []
+
+config.test_exec_root = os.path.join(config.seekbug_obj_root, "test", "unittests")
+config.test_source_root = config.test_exec_root
+
+config.test_format = lit.formats.GoogleTest(".", "Tests")
@@ -36,7 +36,7 @@ llvm_config.with_system_environment(["HOME", "INCLUDE", "LIB", "TMP", "TEMP"])
 # excludes: A list of directories to exclude from the testsuite. The 'Inputs'
 # subdirectories contain auxiliary inputs for various tests in their parent
 # directories.
-config.excludes = ["Inputs", "Examples", "CMakeLists.txt", "README.txt", "LICENSE.txt", "Artefacts", "test-artefacts"]
+config.excludes = ["Inputs", "unittests", "Examples", "CMakeLists.txt", "README.txt", "LICENSE.txt", "Artefacts", "test-artefacts"]
 
 # test_exec_root: The root path where tests should be run.
 config.test_exec_root = os.path.join(config.seekbug_obj_root, "test")
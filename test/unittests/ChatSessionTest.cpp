@@ -0,0 +1,64 @@
+//===-------- ChatSessionTest.cpp -----------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/ChatSession.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdlib>
+
+using namespace seekbug;
+
+namespace {
+
+/// Loads the model named by DEEP_SEEK_LLM_PATH once for all tests.
+class ChatSessionTest : public ::testing::Test {
+protected:
+  static void SetUpTestSuite() {
+    const char *ModelPath = std::getenv("DEEP_SEEK_LLM_PATH");
+    if (!ModelPath)
+      return;
+    std::string Error;
+    Engine = LLMEngine::create(ModelPath, Error);
+  }
+
+  static void TearDownTestSuite() { Engine.reset(); }
+
+  void SetUp() override {
+    if (!Engine)
+      GTEST_SKIP() << "DEEP_SEEK_LLM_PATH does not name a model";
+  }
+
+  static std::shared_ptr<LLMEngine> Engine;
+};
+
+std::shared_ptr<LLMEngine> ChatSessionTest::Engine;
+
+TEST_F(ChatSessionTest, FailedFirstTurnLeavesTheChatEmpty) {
+  ChatSession Chat(Engine);
+  LLMRequest Request;
+  Request.Preamble = "You are a debugger.\n";
+  Request.Prompt = "The program stopped in main.\n";
+  Request.MaxNewTokens = 4;
+  // The system turn is decoded before the deadline stops the first turn.
+  Request.Deadline = std::chrono::steady_clock::now();
+  EXPECT_EQ(Chat.ask(Request).front(), '[');
+  EXPECT_TRUE(Chat.isEmpty());
+  EXPECT_EQ(Chat.getNumTurns(), 0u);
+
+  Request.Deadline = std::chrono::steady_clock::time_point::max();
+  std::string Answer = Chat.ask(Request);
+  ASSERT_TRUE(Answer.empty() || Answer.front() != '[') << Answer;
+  EXPECT_FALSE(Chat.isEmpty());
+  EXPECT_EQ(Chat.getNumTurns(), 1u);
+
+  Chat.reset();
+  EXPECT_TRUE(Chat.isEmpty());
+}
+
+} // end anonymous namespace
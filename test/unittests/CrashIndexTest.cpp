@@ -0,0 +1,125 @@
+//===-------- CrashIndexTest.cpp ------------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/CrashIndex.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+class CrashIndexTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    llvm::SmallString<128> Path;
+    ASSERT_FALSE(llvm::sys::fs::createUniqueDirectory("CrashIndexTest", Path));
+    Directory = std::string(Path);
+  }
+  void TearDown() override { llvm::sys::fs::remove_directories(Directory); }
+
+  std::string Directory;
+};
+
+TEST_F(CrashIndexTest, StoredEntryIsFoundAfterReload) {
+  {
+    CrashIndex Index(Directory);
+    ASSERT_TRUE(Index.store(0xab00000000000001, "a.out!parse+0x1c\n",
+                            "A null pointer is dereferenced."));
+  }
+  CrashIndex Index(Directory);
+  CrashIndex::Entry Entry;
+  ASSERT_TRUE(Index.lookup(0xab00000000000001, Entry));
+  EXPECT_EQ(Entry.Signature, "a.out!parse+0x1c\n");
+  EXPECT_EQ(Entry.Analysis, "A null pointer is dereferenced.");
+  EXPECT_EQ(Entry.Count, 1u);
+  EXPECT_GT(Entry.FirstSeen, 0);
+  EXPECT_EQ(Entry.LastSeen, Entry.FirstSeen);
+  EXPECT_FALSE(Index.lookup(0xab00000000000002, Entry));
+}
+
+TEST_F(CrashIndexTest, EntriesAreShardedByTheirFirstByte) {
+  CrashIndex Index(Directory);
+  ASSERT_TRUE(Index.store(0x1f, "s\n", "analysis"));
+  ASSERT_TRUE(Index.store(0xc0ffee0000000000, "s\n", "analysis"));
+  llvm::SmallString<128> Low(Directory), High(Directory);
+  llvm::sys::path::append(Low, "00", "000000000000001f.json");
+  llvm::sys::path::append(High, "c0", "c0ffee0000000000.json");
+  EXPECT_TRUE(llvm::sys::fs::exists(Low));
+  EXPECT_TRUE(llvm::sys::fs::exists(High));
+}
+
+TEST_F(CrashIndexTest, OccurrencesAreCounted) {
+  CrashIndex Index(Directory);
+  CrashIndex::Entry Entry;
+  EXPECT_FALSE(Index.recordOccurrence(7, Entry));
+  ASSERT_TRUE(Index.store(7, "s\n", "first analysis"));
+  ASSERT_TRUE(Index.recordOccurrence(7, Entry));
+  EXPECT_EQ(Entry.Count, 2u);
+  ASSERT_TRUE(CrashIndex(Directory).recordOccurrence(7, Entry));
+  EXPECT_EQ(Entry.Count, 3u);
+}
+
+TEST_F(CrashIndexTest, EveryCoreOfABucketIsCounted) {
+  CrashIndex Index(Directory);
+  CrashIndex::Entry Entry;
+  ASSERT_TRUE(Index.store(7, "s\n", "analysis", 3));
+  ASSERT_TRUE(Index.lookup(7, Entry));
+  EXPECT_EQ(Entry.Count, 3u);
+  ASSERT_TRUE(Index.recordOccurrence(7, Entry, 4));
+  EXPECT_EQ(Entry.Count, 7u);
+}
+
+TEST_F(CrashIndexTest, StoringAgainKeepsTheHistory) {
+  CrashIndex Index(Directory);
+  ASSERT_TRUE(Index.store(7, "s\n", "first analysis"));
+  CrashIndex::Entry First;
+  ASSERT_TRUE(Index.lookup(7, First));
+  ASSERT_TRUE(Index.store(7, "s\n", "second analysis"));
+  CrashIndex::Entry Second;
+  ASSERT_TRUE(Index.lookup(7, Second));
+  EXPECT_EQ(Second.Analysis, "second analysis");
+  EXPECT_EQ(Second.FirstSeen, First.FirstSeen);
+  EXPECT_EQ(Second.Count, 2u);
+}
+
+TEST_F(CrashIndexTest, InvalidUTF8IsStoredAsValidJSON) {
+  CrashIndex Index(Directory);
+  ASSERT_TRUE(Index.store(7, "s\n", "bad \xff byte"));
+  CrashIndex::Entry Entry;
+  ASSERT_TRUE(Index.lookup(7, Entry));
+  EXPECT_EQ(Entry.Analysis.substr(0, 4), "bad ");
+}
+
+TEST_F(CrashIndexTest, CorruptEntryIsAMiss) {
+  CrashIndex Index(Directory);
+  ASSERT_TRUE(Index.store(7, "s\n", "analysis"));
+  llvm::SmallString<128> Path(Directory);
+  llvm::sys::path::append(Path, "00", "0000000000000007.json");
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    ASSERT_FALSE(EC);
+    OS << "{\"analysis\": ";
+  }
+  CrashIndex::Entry Entry;
+  EXPECT_FALSE(Index.lookup(7, Entry));
+}
+
+TEST(CrashIndexWithoutDirectoryTest, NothingIsStored) {
+  CrashIndex Index("");
+  CrashIndex::Entry Entry;
+  EXPECT_FALSE(Index.store(7, "s\n", "analysis"));
+  EXPECT_FALSE(Index.lookup(7, Entry));
+}
+
+} // end anonymous namespace
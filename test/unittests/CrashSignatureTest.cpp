@@ -0,0 +1,87 @@
+//===-------- CrashSignatureTest.cpp --------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/CrashSignature.h"
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+SignatureFrame frame(std::string Module, std::string Symbol,
+                     uint64_t Offset, std::string UUID = "") {
+  SignatureFrame Frame;
+  Frame.Module = std::move(Module);
+  Frame.Symbol = std::move(Symbol);
+  Frame.Offset = Offset;
+  Frame.UUID = std::move(UUID);
+  return Frame;
+}
+
+TEST(CrashSignatureTest, SignalMachineryOnTopIsSkipped) {
+  CrashSignature Signature = computeCrashSignature(
+      {frame("libc.so.6", "__pthread_kill_implementation", 0x2c),
+       frame("libc.so.6", "raise", 0x16), frame("libc.so.6", "abort", 0xd3),
+       frame("libc.so.6", "__assert_fail", 0x42),
+       frame("a.out", "parse", 0x1c), frame("a.out", "main", 0x5)});
+  EXPECT_EQ(Signature.Text, "a.out!parse+0x1c\n"
+                            "a.out!main+0x5\n");
+}
+
+TEST(CrashSignatureTest, SameCrashWithOrWithoutAbortMatches) {
+  CrashSignature Aborted = computeCrashSignature(
+      {frame("libc.so.6", "abort", 0xd3), frame("a.out", "check", 0x8)});
+  CrashSignature Faulted =
+      computeCrashSignature({frame("a.out", "check", 0x8)});
+  EXPECT_EQ(Aborted.Hash, Faulted.Hash);
+  EXPECT_EQ(Aborted.getHashString(), Faulted.getHashString());
+}
+
+TEST(CrashSignatureTest, MachineryBelowTheCrashIsKept) {
+  CrashSignature Signature = computeCrashSignature(
+      {frame("a.out", "handler", 0x10), frame("libc.so.6", "raise", 0x16)});
+  EXPECT_EQ(Signature.Text, "a.out!handler+0x10\n"
+                            "libc.so.6!raise+0x16\n");
+}
+
+TEST(CrashSignatureTest, FramesWithoutSymbolOrModule) {
+  CrashSignature Signature = computeCrashSignature(
+      {frame("libfoo.so", "", 0x1234), frame("", "", 0xdeadbeef)});
+  EXPECT_EQ(Signature.Text, "libfoo.so!0x1234\n"
+                            "?\?!0xdeadbeef\n");
+}
+
+TEST(CrashSignatureTest, OnlyTheInnermostFramesCount) {
+  std::vector<SignatureFrame> Frames;
+  for (uint64_t I = 0; I < 20; ++I)
+    Frames.push_back(frame("a.out", "f" + std::to_string(I), I));
+  CrashSignature Signature = computeCrashSignature(Frames, /*NumFrames=*/2);
+  EXPECT_EQ(Signature.Text, "a.out!f0+0x0\n"
+                            "a.out!f1+0x1\n");
+  // What the outer frames do does not matter.
+  Frames.back().Symbol = "other";
+  EXPECT_EQ(computeCrashSignature(Frames, 2).Hash, Signature.Hash);
+}
+
+TEST(CrashSignatureTest, BuildHashDependsOnTheModuleBuilds) {
+  CrashSignature Old = computeCrashSignature(
+      {frame("a.out", "parse", 0x1c, "1111-AAAA")});
+  CrashSignature New = computeCrashSignature(
+      {frame("a.out", "parse", 0x1c, "2222-BBBB")});
+  EXPECT_EQ(Old.BuildIDs, "a.out 1111-AAAA\n");
+  EXPECT_EQ(Old.Hash, New.Hash);
+  EXPECT_NE(Old.getBuildHash(), New.getBuildHash());
+}
+
+TEST(CrashSignatureTest, OnlyMachineryGivesAnEmptySignature) {
+  CrashSignature Signature =
+      computeCrashSignature({frame("libc.so.6", "abort", 0xd3)});
+  EXPECT_EQ(Signature.Text, "");
+}
+
+} // end anonymous namespace
@@ -0,0 +1,186 @@
+//===-------- DaemonProtocolTest.cpp --------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/DaemonProtocol.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace seekbug;
+
+namespace {
+
+/// A connected pair of sockets, as between a session and the daemon.
+class DaemonProtocolTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, FDs), 0);
+  }
+  void TearDown() override {
+    for (int FD : FDs)
+      if (FD >= 0)
+        ::close(FD);
+  }
+
+  void closeWriter() {
+    ::close(FDs[0]);
+    FDs[0] = -1;
+  }
+
+  /// Write \p Bytes to the reading end one byte at a time.
+  void writeSlowly(const std::string &Bytes) {
+    for (char C : Bytes) {
+      ASSERT_EQ(::write(FDs[0], &C, 1), 1);
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  int FDs[2] = {-1, -1};
+};
+
+std::string header(char Type, uint32_t Size) {
+  std::string Header(1, Type);
+  for (int I = 0; I < 4; ++I)
+    Header += static_cast<char>((Size >> (8 * I)) & 0xff);
+  return Header;
+}
+
+TEST_F(DaemonProtocolTest, FramesRoundTrip) {
+  ASSERT_TRUE(writeFrame(FDs[0], FrameType::Token, "hello"));
+  ASSERT_TRUE(writeFrame(FDs[0], FrameType::Done, ""));
+  FrameType Type;
+  std::string Payload;
+  ASSERT_TRUE(readFrame(FDs[1], Type, Payload));
+  EXPECT_EQ(Type, FrameType::Token);
+  EXPECT_EQ(Payload, "hello");
+  ASSERT_TRUE(readFrame(FDs[1], Type, Payload));
+  EXPECT_EQ(Type, FrameType::Done);
+  EXPECT_EQ(Payload, "");
+}
+
+TEST_F(DaemonProtocolTest, SizeIsLittleEndian) {
+  std::string Payload(0x0102, 'x');
+  ASSERT_TRUE(writeFrame(FDs[0], FrameType::Error, Payload));
+  char Header[5];
+  ASSERT_EQ(::read(FDs[1], Header, sizeof(Header)), 5);
+  EXPECT_EQ(std::string(Header, 5), header('E', 0x0102));
+}
+
+TEST_F(DaemonProtocolTest, ShortReadsAreReassembled) {
+  std::string Payload = "{\"tokens\": 42}";
+  std::thread Writer(
+      [&] { writeSlowly(header('D', Payload.size()) + Payload); });
+  FrameType Type;
+  std::string Read;
+  bool Ok = readFrame(FDs[1], Type, Read);
+  Writer.join();
+  ASSERT_TRUE(Ok);
+  EXPECT_EQ(Type, FrameType::Done);
+  EXPECT_EQ(Read, Payload);
+}
+
+TEST_F(DaemonProtocolTest, OversizedFrameIsRejected) {
+  // Nothing but the header is sent: the size alone must be enough to
+  // refuse the frame, before any allocation.
+  writeSlowly(header('T', (16u << 20) + 1));
+  FrameType Type;
+  std::string Payload;
+  EXPECT_FALSE(readFrame(FDs[1], Type, Payload));
+  EXPECT_TRUE(Payload.empty());
+}
+
+TEST_F(DaemonProtocolTest, LargestFrameIsAccepted) {
+  std::string Payload(16u << 20, 'x');
+  std::thread Writer(
+      [&] { EXPECT_TRUE(writeFrame(FDs[0], FrameType::Token, Payload)); });
+  FrameType Type;
+  std::string Read;
+  bool Ok = readFrame(FDs[1], Type, Read);
+  Writer.join();
+  ASSERT_TRUE(Ok);
+  EXPECT_EQ(Read.size(), Payload.size());
+}
+
+TEST_F(DaemonProtocolTest, TruncatedFrameFails) {
+  writeSlowly(header('T', 10) + "abc");
+  closeWriter();
+  FrameType Type;
+  std::string Payload;
+  EXPECT_FALSE(readFrame(FDs[1], Type, Payload));
+}
+
+TEST_F(DaemonProtocolTest, TruncatedHeaderFails) {
+  writeSlowly(header('T', 10).substr(0, 3));
+  closeWriter();
+  FrameType Type;
+  std::string Payload;
+  EXPECT_FALSE(readFrame(FDs[1], Type, Payload));
+}
+
+TEST_F(DaemonProtocolTest, WritingToAClosedPeerFails) {
+  // Where send() cannot be told not to raise SIGPIPE.
+  std::signal(SIGPIPE, SIG_IGN);
+  ::close(FDs[1]);
+  FDs[1] = -1;
+  EXPECT_FALSE(writeFrame(FDs[0], FrameType::Cancel, ""));
+}
+
+TEST_F(DaemonProtocolTest, PeerIsThisUser) {
+  uid_t UID;
+  ASSERT_TRUE(getPeerUID(FDs[1], UID));
+  EXPECT_EQ(UID, ::getuid());
+}
+
+TEST_F(DaemonProtocolTest, InfoReportsTheContextSize) {
+  std::thread Daemon([&] {
+    FrameType Type;
+    std::string Payload;
+    ASSERT_TRUE(readFrame(FDs[1], Type, Payload));
+    EXPECT_EQ(Type, FrameType::Info);
+    EXPECT_TRUE(answerDaemonInfo(FDs[1], 1792));
+  });
+  uint32_t ContextSize = 0;
+  EXPECT_TRUE(requestDaemonInfo(FDs[0], ContextSize));
+  Daemon.join();
+  EXPECT_EQ(ContextSize, 1792u);
+}
+
+TEST_F(DaemonProtocolTest, InfoNeedsAContextSize) {
+  ASSERT_TRUE(writeFrame(FDs[1], FrameType::Info, "{}"));
+  uint32_t ContextSize = 0;
+  EXPECT_FALSE(requestDaemonInfo(FDs[0], ContextSize));
+  ASSERT_TRUE(writeFrame(FDs[1], FrameType::Error, "Malformed request."));
+  EXPECT_FALSE(requestDaemonInfo(FDs[0], ContextSize));
+}
+
+TEST(DaemonSocketPathTest, DefaultIsInAPrivateDirectory) {
+  const char *Saved = std::getenv("XDG_RUNTIME_DIR");
+  std::string SavedValue = Saved ? Saved : "";
+
+  ::setenv("XDG_RUNTIME_DIR", "/run/user/1000", 1);
+  EXPECT_EQ(getDefaultDaemonSocketPath(), "/run/user/1000/seek-bugd.sock");
+  // Not a usable runtime directory.
+  ::setenv("XDG_RUNTIME_DIR", "relative", 1);
+  EXPECT_EQ(getDefaultDaemonSocketPath(),
+            "/tmp/seek-bugd-" + std::to_string(::getuid()) +
+                "/seek-bugd.sock");
+  ::unsetenv("XDG_RUNTIME_DIR");
+  EXPECT_EQ(getDefaultDaemonSocketPath(),
+            "/tmp/seek-bugd-" + std::to_string(::getuid()) +
+                "/seek-bugd.sock");
+
+  if (Saved)
+    ::setenv("XDG_RUNTIME_DIR", SavedValue.c_str(), 1);
+}
+
+} // end anonymous namespace
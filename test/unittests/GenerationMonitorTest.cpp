@@ -0,0 +1,99 @@
+//===-------- GenerationMonitorTest.cpp -----------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/llm.h"
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+/// Feed \p Pieces to \p Monitor as consecutive tokens and return the text it
+/// shows, including what it holds back until the end.
+std::string run(GenerationMonitor &Monitor,
+                const std::vector<std::string> &Pieces) {
+  std::string Shown;
+  llama_token Token = 0;
+  for (const std::string &Piece : Pieces)
+    Shown += Monitor.add(Token++, Piece);
+  return Shown + Monitor.flush();
+}
+
+TEST(GenerationMonitorTest, StopStringEndsTheAnswer) {
+  GenerationMonitor Monitor({"STOP"});
+  EXPECT_EQ(Monitor.add(1, "Hello "), "Hello ");
+  // "ST" may be the start of the stop string, so it is held back.
+  EXPECT_EQ(Monitor.add(2, "world ST"), "world ");
+  EXPECT_FALSE(Monitor.isDone());
+  EXPECT_EQ(Monitor.add(3, "OP and more"), "");
+  EXPECT_TRUE(Monitor.isDone());
+  EXPECT_EQ(Monitor.add(4, "ignored"), "");
+  EXPECT_EQ(Monitor.flush(), "");
+}
+
+TEST(GenerationMonitorTest, HeldBackTextIsReleased) {
+  GenerationMonitor Monitor({"STOP"});
+  EXPECT_EQ(run(Monitor, {"ST", "AR"}), "STAR");
+  GenerationMonitor Ending({"STOP"});
+  EXPECT_EQ(run(Ending, {"the end: ST"}), "the end: ST");
+}
+
+TEST(GenerationMonitorTest, EmptyStopStringsAreIgnored) {
+  GenerationMonitor Monitor({""});
+  EXPECT_EQ(run(Monitor, {"a", "b"}), "ab");
+}
+
+TEST(GenerationMonitorTest, ThinkBlockIsHidden) {
+  GenerationMonitor Monitor;
+  EXPECT_EQ(run(Monitor, {"<thi", "nk>I should look", " at x</th",
+                          "ink>\n\nThe answer"}),
+            "The answer");
+}
+
+TEST(GenerationMonitorTest, ClosingTagWithoutOpeningOneIsDropped) {
+  GenerationMonitor Monitor;
+  EXPECT_EQ(run(Monitor, {"Reasoning.", "</think>", "  Answer."}),
+            "Reasoning.Answer.");
+}
+
+TEST(GenerationMonitorTest, UnfinishedReasoningIsShownIfNothingElseIs) {
+  GenerationMonitor Monitor;
+  EXPECT_EQ(Monitor.add(1, "<think>"), "");
+  EXPECT_EQ(Monitor.add(2, "still thinking"), "");
+  EXPECT_EQ(Monitor.flush(), "still thinking");
+}
+
+TEST(GenerationMonitorTest, RepeatedSixteenGramEndsTheAnswer) {
+  // A cycle of 16 tokens: the first 16-gram is complete after 16 tokens and
+  // seen for the third time after 48.
+  GenerationMonitor Monitor;
+  for (llama_token I = 0; I < 47; ++I) {
+    Monitor.add(I % 16, "x");
+    ASSERT_FALSE(Monitor.isDone()) << "after " << I + 1 << " tokens";
+  }
+  Monitor.add(47 % 16, "x");
+  EXPECT_TRUE(Monitor.isDone());
+}
+
+TEST(GenerationMonitorTest, TwoRepeatsAreNotALoop) {
+  GenerationMonitor Monitor;
+  for (llama_token I = 0; I < 32; ++I)
+    Monitor.add(I % 16, "x");
+  for (llama_token I = 100; I < 200; ++I)
+    Monitor.add(I, "x");
+  EXPECT_FALSE(Monitor.isDone());
+}
+
+TEST(GenerationMonitorTest, LoopDetectionCanBeTurnedOff) {
+  GenerationMonitor Monitor({}, /*DetectLoops=*/false);
+  for (llama_token I = 0; I < 200; ++I)
+    Monitor.add(I % 16, "x");
+  EXPECT_FALSE(Monitor.isDone());
+}
+
+} // end anonymous namespace
@@ -0,0 +1,39 @@
+//===-------- VariableCaptureInput.c --------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The program VariableCaptureTest stops in. It stops in stop() and looks at
+// the variables of inspect(), which are too many and too large to show in
+// full.
+//
+//===----------------------------------------------------------------------===//
+
+#include <string.h>
+
+struct Node {
+  int Value;
+  struct Node *Next;
+};
+
+__attribute__((noinline)) void stop(void) {}
+
+__attribute__((noinline)) int inspect(void) {
+  int Numbers[100];
+  for (int I = 0; I < 100; ++I)
+    Numbers[I] = I;
+  struct Node First = {1, 0};
+  struct Node Second = {2, &First};
+  First.Next = &Second;
+  char Text[200];
+  memset(Text, 'a', sizeof(Text) - 1);
+  Text[sizeof(Text) - 1] = 0;
+  int A = 1, B = 2, C = 3, D = 4, E = 5, F = 6, G = 7, H = 8;
+  stop();
+  return Numbers[99] + First.Next->Value + Text[0] + A + B + C + D + E + F +
+         G + H;
+}
+
+int main(void) { return inspect() == 0; }
@@ -0,0 +1,98 @@
+//===-------- PromptBuilderTest.cpp ---------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/PromptBuilder.h"
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+using Priority = PromptBuilder::Priority;
+
+// One token per character keeps the arithmetic of the budgets visible.
+size_t countCharacters(const std::string &Text) { return Text.size(); }
+
+// What build() keeps free of the budget for the tokenizer's sake.
+constexpr size_t SafetyMargin = 16;
+
+const std::string Crash = "#0 crash at main.c:3\n";
+const std::string Outer = "#1 main at main.c:9\n";
+const std::string Snippet = "main.c:\n"
+                            "   2: int *p = 0;\n"
+                            "-> 3: *p = 1;\n"
+                            "   4: return 0;\n";
+const std::string ShrunkSnippet = "main.c:\n"
+                                  "-> 3: *p = 1;\n";
+const std::string Extra = "Registers: rip=0x401126 rsp=0x7ffd0000\n";
+
+TEST(PromptBuilderTest, EverythingFitsInOrder) {
+  PromptBuilder Builder(countCharacters, 1000);
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::Extras, Extra);
+  Builder.add(Priority::OuterFrames, Outer);
+  EXPECT_EQ(Builder.build(), Crash + Extra + Outer);
+  EXPECT_EQ(Builder.getNumShrunk(), 0u);
+  EXPECT_EQ(Builder.getNumDropped(), 0u);
+}
+
+TEST(PromptBuilderTest, LeastImportantIsDroppedFirst) {
+  PromptBuilder Builder(countCharacters,
+                        SafetyMargin + Crash.size() + Outer.size());
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::OuterFrames, Outer);
+  Builder.add(Priority::Extras, Extra);
+  EXPECT_EQ(Builder.build(),
+            Crash + Outer +
+                "[1 less important parts omitted to fit the context]\n");
+  EXPECT_EQ(Builder.getNumDropped(), 1u);
+}
+
+TEST(PromptBuilderTest, LatestAddedIsDroppedFirst) {
+  PromptBuilder Builder(countCharacters,
+                        SafetyMargin + Crash.size() + Extra.size());
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::Extras, Extra);
+  Builder.add(Priority::Extras, Extra + "more\n");
+  EXPECT_EQ(Builder.build(),
+            Crash + Extra +
+                "[1 less important parts omitted to fit the context]\n");
+}
+
+TEST(PromptBuilderTest, SnippetIsShrunkBeforeItIsDropped) {
+  PromptBuilder Builder(countCharacters,
+                        SafetyMargin + Crash.size() + ShrunkSnippet.size());
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::Snippets, Snippet, /*Shrinkable=*/true);
+  EXPECT_EQ(Builder.build(), Crash + ShrunkSnippet);
+  EXPECT_EQ(Builder.getNumShrunk(), 1u);
+  EXPECT_EQ(Builder.getNumDropped(), 0u);
+}
+
+TEST(PromptBuilderTest, CrashingFrameIsShrunkButNeverDropped) {
+  PromptBuilder Builder(countCharacters, 0);
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::CrashingFrame, Snippet, /*Shrinkable=*/true);
+  Builder.add(Priority::OuterFrames, Outer);
+  EXPECT_EQ(Builder.build(),
+            Crash + ShrunkSnippet +
+                "[1 less important parts omitted to fit the context]\n");
+  EXPECT_EQ(Builder.getNumShrunk(), 1u);
+  EXPECT_EQ(Builder.getNumDropped(), 1u);
+}
+
+TEST(PromptBuilderTest, BuildStartsOverEveryTime) {
+  PromptBuilder Builder(countCharacters, SafetyMargin + Crash.size());
+  Builder.add(Priority::CrashingFrame, Crash);
+  Builder.add(Priority::Extras, Extra);
+  Builder.build();
+  Builder.build();
+  EXPECT_EQ(Builder.getNumDropped(), 1u);
+}
+
+} // end anonymous namespace
@@ -0,0 +1,86 @@
+//===-------- ResponseCacheTest.cpp ---------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/ResponseCache.h"
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+uint64_t keyOf(const std::string &Prompt) {
+  LLMRequest Request;
+  Request.Preamble = "You are a debugger.\n";
+  Request.Prompt = Prompt;
+  return ResponseCache::computeKey(Request, 42, "chatml");
+}
+
+TEST(ResponseCacheTest, IDsOfProcessAndThreadAreNormalized) {
+  EXPECT_EQ(keyOf("Process: ID=1234, State=stopped\n"
+                  "Thread: ID=98765, Name=a.out, StopReason=breakpoint 1.1\n"
+                  "x = 1\n"),
+            keyOf("Process: ID=4321, State=stopped\n"
+                  "Thread: ID=11111, Name=a.out, StopReason=breakpoint 1.1\n"
+                  "x = 1\n"));
+  EXPECT_EQ(keyOf("Thread #1, ID=77, Name=worker\n"),
+            keyOf("Thread #1, ID=78, Name=worker\n"));
+}
+
+TEST(ResponseCacheTest, PointerValuesAreKept) {
+  EXPECT_NE(keyOf("Variables in scope:\np (int *) = 0x0\n"),
+            keyOf("Variables in scope:\np (int *) = 0x7ffd1234\n"));
+}
+
+TEST(ResponseCacheTest, ConstantsAndRegistersAreKept) {
+  EXPECT_NE(keyOf("-> 12: return mask & 0xFF;\n"),
+            keyOf("-> 12: return mask & 0x0F;\n"));
+  EXPECT_NE(keyOf("-> <+32>: mov %rax, (%rdi)\nRegisters: rdi=0x0\n"),
+            keyOf("-> <+32>: mov %rax, (%rdi)\nRegisters: rdi=0x10\n"));
+  // An ID= outside the Process and Thread lines is part of the question.
+  EXPECT_NE(keyOf("x = ID=1\n"), keyOf("x = ID=2\n"));
+}
+
+TEST(ResponseCacheTest, LoadAddressesOfDisassemblyAreNormalized) {
+  EXPECT_EQ(ResponseCache::normalizePrompt("-> 0x55d0c0de1024: retq\n"
+                                           "   0x55d0c0de1025: nop\n"),
+            ResponseCache::normalizePrompt("-> 0x7f00aa001024: retq\n"
+                                           "   0x7f00aa001025: nop\n"));
+  EXPECT_NE(ResponseCache::normalizePrompt("-> 0x1024: retq\n"),
+            ResponseCache::normalizePrompt("-> 0x1024: nop\n"));
+}
+
+TEST(ResponseCacheTest, WhitespaceLayoutIsNormalized) {
+  EXPECT_EQ(keyOf("a  =\t1\n\n"), keyOf("a = 1\n"));
+}
+
+TEST(ResponseCacheTest, ModelAndSamplingArePartOfTheKey) {
+  LLMRequest Request;
+  Request.Prompt = "Why?\n";
+  uint64_t Key = ResponseCache::computeKey(Request, 42, "chatml");
+  EXPECT_NE(Key, ResponseCache::computeKey(Request, 43, "chatml"));
+  EXPECT_NE(Key, ResponseCache::computeKey(Request, 42, "llama3"));
+  Request.Sampling.Temperature = 0.7f;
+  EXPECT_NE(Key, ResponseCache::computeKey(Request, 42, "chatml"));
+}
+
+TEST(ResponseCacheTest, LookupAfterInsert) {
+  ResponseCache Cache(/*Directory=*/"", /*MaxMemoryEntries=*/2);
+  std::string Response;
+  EXPECT_FALSE(Cache.lookup(1, Response));
+  Cache.insert(1, "one");
+  Cache.insert(2, "two");
+  ASSERT_TRUE(Cache.lookup(1, Response));
+  EXPECT_EQ(Response, "one");
+  // 2 is now the least recently used entry.
+  Cache.insert(3, "three");
+  EXPECT_FALSE(Cache.lookup(2, Response));
+  EXPECT_TRUE(Cache.lookup(3, Response));
+  EXPECT_EQ(Cache.getStats().Hits, 2u);
+}
+
+} // end anonymous namespace
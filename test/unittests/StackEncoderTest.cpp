@@ -0,0 +1,115 @@
+//===-------- StackEncoderTest.cpp ----------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/StackEncoder.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+std::vector<StackFrameInfo>
+makeFrames(const std::vector<std::string> &Functions) {
+  std::vector<StackFrameInfo> Frames;
+  for (const std::string &Function : Functions) {
+    StackFrameInfo Frame;
+    Frame.Index = Frames.size();
+    Frame.Function = Function;
+    Frames.push_back(Frame);
+  }
+  return Frames;
+}
+
+TEST(StackEncoderTest, MutualRecursionIsCollapsed) {
+  SourceCache Sources;
+  EncodedStack Stack = encodeStack(
+      Sources, makeFrames({"leaf", "walk", "visit", "walk", "visit", "walk",
+                           "visit", "main"}));
+  ASSERT_EQ(Stack.Frames.size(), 3u);
+  EXPECT_EQ(Stack.Frames[0], "#0 leaf\n");
+  EXPECT_EQ(Stack.Frames[1], "#1-#6: recursion of walk -> visit (x3)\n");
+  EXPECT_EQ(Stack.Frames[2], "#7 main\n");
+}
+
+TEST(StackEncoderTest, DeepDirectRecursionIsOneLine) {
+  std::vector<std::string> Functions(1000, "fib");
+  Functions.push_back("main");
+  SourceCache Sources;
+  EncodedStack Stack = encodeStack(Sources, makeFrames(Functions));
+  ASSERT_EQ(Stack.Frames.size(), 2u);
+  EXPECT_EQ(Stack.Frames[0], "#0-#999: recursion of fib (x1000)\n");
+  EXPECT_EQ(Stack.Frames[1], "#1000 main\n");
+}
+
+TEST(StackEncoderTest, FewRepeatsAreKept) {
+  SourceCache Sources;
+  EncodedStack Stack =
+      encodeStack(Sources, makeFrames({"leaf", "fib", "fib", "main"}));
+  ASSERT_EQ(Stack.Frames.size(), 4u);
+  EXPECT_EQ(Stack.Frames[1], "#1 fib\n");
+  EXPECT_EQ(Stack.Frames[2], "#2 fib\n");
+}
+
+TEST(StackEncoderTest, DifferentLinesAreNotARecursion) {
+  std::vector<StackFrameInfo> Frames =
+      makeFrames({"step", "step", "step", "main"});
+  for (StackFrameInfo &Frame : Frames)
+    Frame.Line = 10 + Frame.Index;
+  SourceCache Sources;
+  EXPECT_EQ(encodeStack(Sources, Frames).Frames.size(), 4u);
+}
+
+TEST(StackEncoderTest, FramesInOneFileShareTheirSnippet) {
+  llvm::SmallString<128> Path;
+  int FD;
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("StackEncoderTest", "c", FD, Path));
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    for (int Line = 1; Line <= 20; ++Line)
+      OS << "line" << Line << "\n";
+  }
+
+  std::vector<StackFrameInfo> Frames = makeFrames({"inner", "outer", "main"});
+  Frames[0].Path = Frames[1].Path = std::string(Path);
+  Frames[0].Line = 5;
+  Frames[1].Line = 3;
+  SourceCache Sources;
+  EncodedStack Stack = encodeStack(Sources, Frames, /*ContextLines=*/1);
+  llvm::sys::fs::remove(Path);
+
+  std::string Name = llvm::sys::path::filename(Path).str();
+  ASSERT_EQ(Stack.Frames.size(), 3u);
+  EXPECT_EQ(Stack.Frames[0], "#0 inner at " + Name + ":5\n");
+  EXPECT_EQ(Stack.Frames[2], "#2 main\n");
+  ASSERT_EQ(Stack.Sources.size(), 1u);
+  EXPECT_EQ(Stack.CrashingSource, 0);
+  EXPECT_EQ(Stack.Sources[0], Name + ":\n"
+                                     "   2: line2\n"
+                                     "-> 3: line3\n"
+                                     "   4: line4\n"
+                                     "-> 5: line5\n"
+                                     "   6: line6\n"
+                                     "\n");
+}
+
+TEST(StackEncoderTest, LongTemplateArgumentsAreElided) {
+  EXPECT_EQ(shortenSymbolName("std::__1::vector<int>::push_back"),
+            "std::vector<int>::push_back");
+  EXPECT_EQ(shortenSymbolName("std::map<std::basic_string<char>, "
+                              "std::vector<int>>::find"),
+            "std::map<...>::find");
+  EXPECT_EQ(shortenSymbolName("operator<<"), "operator<<");
+}
+
+} // end anonymous namespace
@@ -0,0 +1,142 @@
+//===-------- VariableCaptureTest.cpp -------------------------------------===//
+//
+// Part of the SeekBug Project, under the Apache License v2.0.
+// See LICENSE for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "seek-bug/VariableCapture.h"
+
+#include <lldb/API/SBBreakpoint.h>
+#include <lldb/API/SBDebugger.h>
+#include <lldb/API/SBProcess.h>
+#include <lldb/API/SBTarget.h>
+#include <lldb/API/SBThread.h>
+
+#include <gtest/gtest.h>
+
+using namespace seekbug;
+
+namespace {
+
+/// Runs Inputs/VariableCaptureInput.c to its stop() once for all tests, and
+/// captures the variables of its caller.
+class VariableCaptureTest : public ::testing::Test {
+protected:
+  static void SetUpTestSuite() {
+    lldb::SBDebugger::Initialize();
+    Debugger = lldb::SBDebugger::Create(false);
+    Debugger.SetAsync(false);
+    lldb::SBTarget Target = Debugger.CreateTarget(VARIABLE_CAPTURE_INPUT);
+    if (!Target.IsValid())
+      return;
+    Target.BreakpointCreateByName("stop");
+    Process = Target.LaunchSimple(nullptr, nullptr, nullptr);
+  }
+
+  static void TearDownTestSuite() {
+    if (Process.IsValid())
+      Process.Kill();
+    lldb::SBDebugger::Destroy(Debugger);
+    lldb::SBDebugger::Terminate();
+  }
+
+  void SetUp() override {
+    // Debugging may not be permitted where the tests run.
+    if (!Process.IsValid() || Process.GetState() != lldb::eStateStopped)
+      GTEST_SKIP() << "Cannot run " << VARIABLE_CAPTURE_INPUT;
+    Frame = Process.GetSelectedThread().GetFrameAtIndex(1);
+    ASSERT_TRUE(Frame.IsValid());
+  }
+
+  /// The variable \p Name of \p Snapshot, or null.
+  static const CapturedVariable *find(const VariableSnapshot &Snapshot,
+                                      const std::string &Name) {
+    for (const CapturedVariable &Variable : Snapshot.Variables)
+      if (Variable.Name == Name)
+        return &Variable;
+    return nullptr;
+  }
+
+  static lldb::SBDebugger Debugger;
+  static lldb::SBProcess Process;
+  lldb::SBFrame Frame;
+};
+
+lldb::SBDebugger VariableCaptureTest::Debugger;
+lldb::SBProcess VariableCaptureTest::Process;
+
+TEST_F(VariableCaptureTest, ArraysShowTheirFirstElements) {
+  VariableCaptureLimits Limits;
+  Limits.MaxChildren = 4;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  const CapturedVariable *Numbers = find(Snapshot, "Numbers");
+  ASSERT_TRUE(Numbers);
+  EXPECT_EQ(Numbers->Value, "{[0]=0, [1]=1, [2]=2, [3]=3, ...}");
+}
+
+TEST_F(VariableCaptureTest, LongValuesAreClipped) {
+  VariableCaptureLimits Limits;
+  Limits.MaxValueLength = 20;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  const CapturedVariable *Text = find(Snapshot, "Text");
+  ASSERT_TRUE(Text);
+  EXPECT_EQ(Text->Value.size(), 20u + 3);
+  EXPECT_EQ(Text->Value.substr(20), "...");
+}
+
+TEST_F(VariableCaptureTest, CyclicListsTerminate) {
+  VariableCaptureLimits Limits;
+  Limits.MaxDepth = 100;
+  Limits.MaxDereferences = 100;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  const CapturedVariable *First = find(Snapshot, "First");
+  ASSERT_TRUE(First);
+  EXPECT_NE(First->Value.find("Value=2"), std::string::npos);
+  // Every address is followed once, so the cycle is walked at most twice.
+  size_t NumFollowed = 0;
+  for (size_t Pos = First->Value.find(" -> "); Pos != std::string::npos;
+       Pos = First->Value.find(" -> ", Pos + 1))
+    ++NumFollowed;
+  EXPECT_LE(NumFollowed, 2u);
+}
+
+TEST_F(VariableCaptureTest, DereferencesAreBounded) {
+  VariableCaptureLimits Limits;
+  Limits.MaxDepth = 100;
+  Limits.MaxDereferences = 0;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  const CapturedVariable *Second = find(Snapshot, "Second");
+  ASSERT_TRUE(Second);
+  EXPECT_EQ(Second->Value.find(" -> "), std::string::npos);
+}
+
+TEST_F(VariableCaptureTest, NumberOfVariablesIsBounded) {
+  VariableCaptureLimits Limits;
+  Limits.MaxVariables = 3;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  EXPECT_EQ(Snapshot.Variables.size(), 3u);
+  EXPECT_TRUE(Snapshot.Truncated);
+  EXPECT_NE(Snapshot.format().find("(more variables not shown)"),
+            std::string::npos);
+}
+
+TEST_F(VariableCaptureTest, SizeIsBounded) {
+  VariableCaptureLimits Limits;
+  Limits.MaxBytes = 100;
+  VariableSnapshot Snapshot = VariableCapture(Limits).capture(Frame);
+  size_t Size = 0;
+  for (const CapturedVariable &Variable : Snapshot.Variables)
+    Size += Variable.format().size();
+  EXPECT_LE(Size, 100u);
+  EXPECT_TRUE(Snapshot.Truncated);
+}
+
+TEST_F(VariableCaptureTest, SameStopGivesTheSameSnapshot) {
+  VariableCapture Capture;
+  std::string First = Capture.capture(Frame).format();
+  EXPECT_EQ(Capture.capture(Frame).format(), First);
+  EXPECT_NE(First.find("H (int) = 8"), std::string::npos);
+}
+
+} // end anonymous namespace